@@ -0,0 +1,152 @@
+#! /usr/bin/perl
+# bench.pl - time mklbr on the benchmark corpus and compare against a baseline
+#
+# usage: bench.pl [-b mklbr] [-c corpus] [-n runs] [-t tolerance] [-f baseline] [-s]
+#                 [scenario ...]
+#   -b  the mklbr to time, default the one built in the repo directory
+#   -c  corpus generated by mkcorpus.pl, default corpus
+#   -n  timed runs of each scenario after one untimed warm up run, default 5
+#   -t  percentage slower than the baseline reported as a regression, default 10
+#   -f  baseline file, default baseline.txt alongside this script
+#   -s  save the results as the new baseline rather than comparing
+# scenario names restrict the run to those scenarios, by default all are run
+#
+# Each scenario is chosen to load one phase of the build, as named in its description.
+# Where mklbr supports --stats the time of each phase, summed over the libraries built, is
+# reported too. The median wall times are compared, phases only if they took at least 1ms
+# in the baseline, along with the speed of each CRC engine, and the exit status is 1 if
+# any regressed.
+use strict;
+use warnings;
+use Cwd 'abs_path';
+use FindBin;
+use Getopt::Std;
+use JSON::PP;
+use Time::HiRes 'time';
+
+my @scenarios = (
+    # name      description                                        setup, arguments     outputs
+    [ 'tiny',   'recipe parse, stat and header, 65534 members',   '', 'tiny.rcp',       'tiny.lbr' ],
+    [ 'tiny-u', 'header rewrite, all members reused',   'tiny.rcp', '-u tiny.rcp',    'tiny.lbr' ],
+    [ 'tiny-c', 'library cache hit, no member read',
+      '--lbr-cache=lbrcache tiny.rcp', '--lbr-cache=lbrcache tiny.rcp', 'tiny.lbr' ],
+    [ 'big',    'read, CRC and write of an 8M member',            '', 'big1.rcp',       'big1.lbr' ],
+    [ 'big-z',  'as big using zero copy',                         '', '-z big1.rcp',    'big1.lbr' ],
+    [ 'verify', 'read and CRC of an existing library',  'big2.rcp', '-c big2.lbr',    'big2.lbr' ],
+    [ 'deep',   'long paths',                                     '', 'deep.rcp',       'deep.lbr' ],
+    [ 'batch',  '16 libraries of 64 medium members, 4 at a time', '', '-j 4 -m batch.lst',
+      map { "med$_.lbr" } 0 .. 15 ],
+);
+
+my %opt;
+getopts('b:c:n:t:f:s', \%opt) or die "usage: bench.pl [-b mklbr] [-c corpus] [-n runs] [-t tolerance] [-f baseline] [-s] [scenario ...]\n";
+my $mklbr    = abs_path($opt{b} // "$FindBin::Bin/../mklbr");
+my $corpus   = $opt{c} // 'corpus';
+my $runs     = $opt{n} // 5;
+my $tol      = ($opt{t} // 10) / 100;
+my $baseFile = abs_path($opt{f} // "$FindBin::Bin/baseline.txt");
+my %wanted   = map { $_ => 1 } @ARGV;
+
+die "cannot find mklbr at " . ($opt{b} // "$FindBin::Bin/../mklbr") . "\n" unless $mklbr && -x $mklbr;
+chdir $corpus or die "cannot find corpus $corpus, see mkcorpus.pl\n";
+
+my %base;
+if (!$opt{s} && open my $in, '<', $baseFile) {
+    while (<$in>) {
+        my ($name, $value) = split;
+        $base{$name} = $value if defined $value && !/^#/;
+    }
+    close $in;
+}
+
+my ($results, $regressions) = ('', 0);
+
+# report a result, value is seconds or for rates MB/s where higher is better
+sub result {
+    my ($name, $value, $isRate, $detail) = @_;
+    my $cmp = '';
+    if (defined $base{$name} && ($isRate || $name !~ /\./ || $base{$name} >= 0.001)) {
+        my $ratio = $isRate ? $base{$name} / $value : $value / $base{$name};
+        $cmp = sprintf "%+6.1f%%", ($ratio - 1) * 100;
+        if ($ratio > 1 + $tol) {
+            $cmp .= ' REGRESSION';
+            $regressions++;
+        }
+    }
+    printf "%-16s %s %s %s\n", $name =~ /\./ ? "  $name" : $name,
+        $isRate ? sprintf("%8.1f MB/s", $value) : sprintf("%10.4f s ", $value), $detail, $cmp;
+    $results .= "$name $value\n";
+}
+
+my $hasStats = `"$mklbr" -h 2>&1` =~ /--stats/;
+
+# returns the wall and cpu time of running mklbr with args and the time of each phase
+sub runOnce {
+    my ($args) = @_;
+    my %phase;
+    my @before = times;
+    my $start  = time;
+    my @out    = `"$mklbr" @{[$hasStats ? '--stats=json' : '']} $args 2>/dev/null`;
+    my $wall   = time - $start;
+    my @after  = times;
+    die "mklbr $args failed\n" if $?;
+    for (grep { /^\{"lbr"/ } @out) {
+        my $phases = decode_json($_)->{phases};
+        $phase{$_} += $phases->{$_}{wall} for keys %$phases;
+    }
+    return ($wall, $after[2] + $after[3] - $before[2] - $before[3], \%phase);
+}
+
+sub median {
+    my @v = sort { $a <=> $b } @_;
+    return $v[$#v / 2];
+}
+
+print "mklbr: $mklbr\n";
+for my $s (@scenarios) {
+    my ($name, $desc, $setup, $args, @outputs) = @$s;
+    next if %wanted && !$wanted{$name};
+    runOnce($setup) if $setup; # build the library the scenario uses
+    runOnce($args);            # warm up
+    my (@wall, $cpu, %phase);
+    for (1 .. $runs) {
+        my ($w, $c, $p) = runOnce($args);
+        push @wall, $w;
+        $cpu += $c;
+        push @{ $phase{$_} }, $p->{$_} for keys %$p;
+    }
+    @wall = sort { $a <=> $b } @wall;
+    my $median = median(@wall);
+    my $bytes  = 0;
+    $bytes += -s $_ // 0 for @outputs;
+    result($name, $median,
+        0, sprintf("min %.4f cpu %.4f %8.1f MB/s  %s", $wall[0], $cpu / $runs,
+                   $bytes / 1e6 / $median, $desc));
+    for my $p (qw(parse lookup squeeze dedup header copy finish total)) {
+        result("$name.$p", median(@{ $phase{$p} }), 0, '') if $phase{$p};
+    }
+}
+
+# the CRC engines, from the speeds reported by --selftest
+if (!%wanted || $wanted{crc}) {
+    my %speed;
+    for (1 .. $runs) {
+        for (`"$mklbr" --selftest`) {
+            $speed{$1} = $2 if /^(\S+)\s+ok\s+([\d.]+) MB\/s/ && (!$speed{$1} || $2 > $speed{$1});
+        }
+    }
+    result("crc-$_", $speed{$_}, 1, 'best of runs') for sort keys %speed;
+}
+
+if ($opt{s}) {
+    open my $out, '>', $baseFile or die "cannot write $baseFile\n";
+    print $out "# mklbr benchmark baseline, median seconds or MB/s\n$results";
+    close $out;
+    print "baseline saved to $baseFile\n";
+} elsif (!%base) {
+    print "no baseline in $baseFile, use -s to save one\n";
+} elsif ($regressions) {
+    print "$regressions regression(s) beyond ", $tol * 100, "%\n";
+    exit 1;
+}
+exit 0;
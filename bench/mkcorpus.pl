@@ -0,0 +1,125 @@
+#! /usr/bin/perl
+# mkcorpus.pl - generate the benchmark corpus for mklbr
+#
+# usage: mkcorpus.pl [-s] [dir]
+#   dir defaults to corpus, which is replaced if it exists
+#   -s generates a small corpus, for checking the harness rather than for timing
+#
+# The corpus exercises the hot paths of mklbr
+#   tiny/     65534 files of at most 128 bytes, a third of them empty, the most an lbr allows
+#   big/      3 members close to the 8M limit, one of them exactly the largest possible
+#   medium/   1024 files of 1k to 121k, split over 16 recipes for batch mode
+#   deep/     files at the end of paths over 1000 characters long
+# along with a recipe for each and the manifest batch.lst. The recipes mix the recipe
+# forms, <> quoting, renames and explicit timestamps, so parsing is exercised too.
+#
+# Contents, names and timestamps come from a private random number generator, so the
+# same corpus is produced on every run and every platform and results can be compared.
+use strict;
+use warnings;
+use File::Path qw(make_path remove_tree);
+
+my $small = @ARGV && $ARGV[0] eq '-s' && shift;
+my $dir   = shift // 'corpus';
+my $MAXSECTORS = 65535;         # an lbr directory entry counts sectors in 16 bits
+my $MAXMEMBER  = $MAXSECTORS * 128;
+
+my $seed = 0x2545f491;
+sub rnd {                       # xorshift32
+    $seed ^= ($seed << 13) & 0xffffffff;
+    $seed ^= $seed >> 17;
+    $seed ^= ($seed << 5) & 0xffffffff;
+    return $seed;
+}
+
+# len bytes of random data, or of repeated text when compressible
+sub content {
+    my ($len, $compressible) = @_;
+    my $data;
+    if ($compressible) {
+        my $line = sprintf "%08X\tLD\tA,(IX+%d)\t; generated line\r\n", rnd(), rnd() % 128;
+        $data = $line x int($len / length($line) + 1);
+    } else {
+        $data = pack 'V*', map { rnd() } 1 .. int($len / 4 + 1);
+    }
+    return substr $data, 0, $len;
+}
+
+sub writeFile {
+    my ($path, $data) = @_;
+    open my $out, '>:raw', $path or die "cannot create $path: $!\n";
+    print $out $data;
+    close $out or die "error writing $path: $!\n";
+}
+
+sub timeStamp {
+    my @t = gmtime(315532800 + rnd() % 1300000000);    # 1980 onwards
+    return sprintf "%04d-%02d-%02d %02d:%02d:%02d", $t[5] + 1900, $t[4] + 1, @t[3, 2, 1, 0];
+}
+
+# one recipe line for path, in a form chosen by n
+sub recipeLine {
+    my ($path, $n, $rename) = @_;
+    my $src = $n % 5 == 1 ? "<$path>" : $path;
+    $src .= "|$rename" if $rename;
+    return $n % 7 == 3 ? "$src " . timeStamp() . "\n"
+         : $n % 7 == 5 ? "$src - " . timeStamp() . "\n"
+         : $n % 11 == 0 ? "$src *\n"
+         : "$src\n";
+}
+
+remove_tree($dir);
+make_path($dir) or die "cannot create $dir\n";
+chdir $dir or die "cannot use $dir\n";
+
+# tiny
+my $nTiny = $small ? 1000 : $MAXSECTORS - 1;
+my @recipe = ("tiny.lbr\n");
+for my $i (0 .. $nTiny - 1) {
+    my $sub  = sprintf "tiny/%02x", $i >> 10;
+    my $path = sprintf "%s/t%04x.dat", $sub, $i;
+    make_path($sub) if $i % 1024 == 0;
+    writeFile($path, $i % 3 ? content(1 + rnd() % 128, $i & 1) : '');
+    push @recipe, recipeLine($path, $i, $i % 13 == 0 ? sprintf("R%04X.DAT", $i) : undef);
+}
+writeFile('tiny.rcp', join '', @recipe);
+
+# big
+make_path('big');
+my @bigSize = ($MAXMEMBER, $MAXMEMBER - 77, 8000000);
+@bigSize = map { int($_ / 64) } @bigSize if $small;
+for my $i (1 .. 3) {
+    writeFile("big/b$i.bin", content($bigSize[$i - 1], $i == 2));
+    writeFile("big$i.rcp", "big$i.lbr " . timeStamp() . "\nbig/b$i.bin\n");
+}
+
+# medium, 16 libraries of 64 members
+my @manifest;
+for my $lib (0 .. 15) {
+    my $sub = sprintf "medium/m%02d", $lib;
+    make_path($sub);
+    @recipe = ("med$lib.lbr\n");
+    for my $i (0 .. 63) {
+        my $path = sprintf "%s/f%03d.bin", $sub, $i;
+        writeFile($path, content(1024 + rnd() % ($small ? 4096 : 120 * 1024), $i % 4 == 0));
+        push @recipe, recipeLine($path, $i);
+    }
+    writeFile("med$lib.rcp", join '', @recipe);
+    push @manifest, "med$lib.rcp\n";
+}
+writeFile('batch.lst', join '', @manifest);
+
+# deep, 16 levels of 63 character directory names
+my $path = 'deep';
+@recipe  = ("deep.lbr\n");
+for my $level (0 .. 15) {
+    $path .= sprintf "/level%02d_%s", $level, 'x' x 55;
+    make_path($path);
+    for my $i (0 .. 15) {
+        my $file = sprintf "%s/d%02d%02d.txt", $path, $level, $i;
+        writeFile($file, content(rnd() % 2048, 1));
+        push @recipe, recipeLine($file, $i);
+    }
+}
+writeFile('deep.rcp', join '', @recipe);
+print "corpus generated in $dir\n";
@@ -0,0 +1,671 @@
+/* mklbr - create .lbr archives from recipes
+ * Copyright (C) - 2020-2023 Mark Ogden
+ *
+ * catalog.c - index of the members of many libraries
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * The catalog is one file, mapped to answer queries in place
+ *   header
+ *   libs[nLibs]         each library, sorted by path, with its size and modify time
+ *   members[nMembers]   the active directory entries of each library in turn
+ *   byName[nMembers]    member numbers sorted by name, then library
+ *   byCrc[nMembers]     member numbers sorted by CRC, then name
+ *   strings             the library paths
+ * so a name or CRC is found with a binary search, and a wildcard name by a scan of the
+ * names. An update walks the trees named for .lbr files, keeping the members of libraries
+ * whose size and modify time are unchanged and reading only the directory sectors of the
+ * others, spread over jobs threads. Libraries outside the trees named are kept as they are.
+ * The new catalog is written to a temporary file and renamed into place, so readers with
+ * the old one mapped are unaffected. As with the CRC cache, records are in native byte
+ * order.
+ */
+#include "lbrdir.h"
+#include "mklbr.h"
+#include "outfile.h"
+#include "statbatch.h"
+#include "walk.h"
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <threads.h>
+#ifdef _WIN32
+#include <direct.h>
+#define S_ISDIR(m) (((m) & _S_IFMT) == _S_IFDIR)
+#define S_ISREG(m) (((m) & _S_IFMT) == _S_IFREG)
+#define getcwd     _getcwd
+#define isSep(c)   ((c) == '/' || (c) == '\\')
+#define rootLen(p) ((p)[0] && (p)[1] == ':' ? 2 : 0) // drive
+#else
+#define isSep(c)   ((c) == '/')
+#define rootLen(p) 0
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#pragma warning(disable : 4996)
+
+#define CATMAGIC   "LBRX"
+#define CATVERSION 1
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t nLibs;
+    uint32_t nMembers;
+    uint64_t strSize;
+} catHdr_t;
+
+typedef struct {
+    uint64_t path;  // offset in the strings
+    uint64_t size;
+    int64_t mtime;  // nanoseconds where the file system supports it
+    uint32_t first; // its members
+    uint32_t count;
+} catLib_t;
+
+typedef struct {
+    uint8_t name[11]; // as in the directory
+    uint8_t padCnt;
+    uint32_t lib;
+    uint16_t index;
+    uint16_t length;
+    uint16_t crc;
+    uint8_t dates[8]; // CreateDate to ChangeTime, as in the directory, see getDate
+    uint8_t filler[2];
+} catMember_t;
+
+typedef struct {
+    void *base;
+    size_t size;
+    catHdr_t const *hdr;
+    catLib_t const *libs;
+    catMember_t const *members;
+    uint32_t const *byName;
+    uint32_t const *byCrc;
+    char const *strings;
+} catalog_t;
+
+static void unmapCatalog(catalog_t *c) {
+    if (c->base)
+#ifdef _WIN32
+        free(c->base);
+#else
+        munmap(c->base, c->size);
+#endif
+    memset(c, 0, sizeof(*c));
+}
+
+static bool validCatalog(catalog_t *c) {
+    catHdr_t const *hdr = c->base;
+    if (c->size < sizeof(catHdr_t) || memcmp(hdr->magic, CATMAGIC, 4) != 0 ||
+        hdr->version != CATVERSION ||
+        c->size != sizeof(catHdr_t) + hdr->nLibs * sizeof(catLib_t) +
+                       (uint64_t)hdr->nMembers * (sizeof(catMember_t) + 2 * sizeof(uint32_t)) +
+                       hdr->strSize ||
+        (hdr->strSize && ((char const *)c->base)[c->size - 1] != '\0'))
+        return false;
+    c->hdr     = hdr;
+    c->libs    = (catLib_t const *)(hdr + 1);
+    c->members = (catMember_t const *)(c->libs + hdr->nLibs);
+    c->byName  = (uint32_t const *)(c->members + hdr->nMembers);
+    c->byCrc   = c->byName + hdr->nMembers;
+    c->strings = (char const *)(c->byCrc + hdr->nMembers);
+    for (uint32_t i = 0; i < hdr->nLibs; i++)
+        if (c->libs[i].path >= hdr->strSize || c->libs[i].first > hdr->nMembers ||
+            c->libs[i].count > hdr->nMembers - c->libs[i].first)
+            return false;
+    for (uint32_t k = 0; k < hdr->nMembers; k++) // indexes the lookups follow
+        if (c->members[k].lib >= hdr->nLibs || c->byName[k] >= hdr->nMembers ||
+            c->byCrc[k] >= hdr->nMembers)
+            return false;
+    return true;
+}
+
+// map the catalog, returning false if it is missing or, with a message, invalid
+static bool mapCatalog(catalog_t *c, char const *path) {
+    memset(c, 0, sizeof(*c));
+#ifdef _WIN32
+    FILE *fp = fopen(path, "rb");
+    if (!fp)
+        return false;
+    fseek(fp, 0, SEEK_END);
+    c->size = ftell(fp);
+    rewind(fp);
+    if ((c->base = malloc(c->size ? c->size : 1)) && fread(c->base, 1, c->size, fp) != c->size) {
+        free(c->base);
+        c->base = NULL;
+    }
+    fclose(fp);
+#else
+    struct stat stbuf;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+    if (fstat(fd, &stbuf) == 0 && (c->size = stbuf.st_size) != 0 &&
+        (c->base = mmap(NULL, c->size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+        c->base = NULL;
+    close(fd);
+#endif
+    if (!c->base || !validCatalog(c)) {
+        fprintf(stderr, "ignoring invalid catalog %s\n", path);
+        unmapCatalog(c);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * updating. The libraries found are sorted by path and matched against the old catalog,
+ * and those that are new or changed are read by the workers
+ */
+typedef struct {
+    fileMeta_t meta;
+    int old;      // its entry in the old catalog, -1 if read
+    dir_t *dir;   // directory read, NULL if not a valid library
+    int entries;
+} scanLib_t;
+
+typedef struct {
+    scanLib_t *libs;
+    int count;
+    int next; // next library for a worker
+    bool noMem; // a directory could not be read for want of memory
+    mtx_t lock;
+} scan_t;
+
+static int cmpScanLib(void const *a, void const *b) {
+    return strcmp(((scanLib_t const *)a)->meta.path, ((scanLib_t const *)b)->meta.path);
+}
+
+static bool addLib(scan_t *s, int *size, fileMeta_t const *f) {
+    if (s->count == *size) {
+        int n          = *size ? *size * 2 : 1024;
+        scanLib_t *libs = realloc(s->libs, n * sizeof(scanLib_t));
+        if (!libs)
+            return false;
+        s->libs = libs;
+        *size   = n;
+    }
+    s->libs[s->count++] = (scanLib_t){ *f, -1 };
+    return true;
+}
+
+static int readWorker(void *arg) {
+    scan_t *s = arg;
+    for (;;) {
+        mtx_lock(&s->lock);
+        while (s->next < s->count && s->libs[s->next].old >= 0)
+            s->next++;
+        int i = s->next++;
+        mtx_unlock(&s->lock);
+        if (i >= s->count)
+            return 0;
+        scanLib_t *l = &s->libs[i];
+        lbrDir_t d;
+        FILE *fp = fopen(l->meta.path, "rb");
+        if (fp && readDir(&d, fp)) { // reads only the directory sectors
+            free(d.hash);
+            l->dir     = d.dir;
+            l->entries = d.entries;
+        } else if (fp && d.noMem) {
+            mtx_lock(&s->lock);
+            s->noMem = true;
+            mtx_unlock(&s->lock);
+        }
+        if (fp)
+            fclose(fp);
+    }
+}
+
+// the old library with path, -1 if none
+static int findLib(catalog_t const *c, char const *path) {
+    int lo = 0, hi = c->hdr ? (int)c->hdr->nLibs : 0;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        int cmp = strcmp(c->strings + c->libs[mid].path, path);
+        if (cmp == 0)
+            return mid;
+        if (cmp < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return -1;
+}
+
+// path with . and empty components removed, .. resolved textually and / separators,
+// relative to the current directory if within it, so that cat, ./cat/ and its absolute
+// path name the same tree. . for the current directory, NULL if out of memory
+static char *normPath(char const *path) {
+    char cwd[4096];
+    char *norm = malloc(strlen(path) + 2);
+    if (!norm)
+        return NULL;
+    size_t root = rootLen(path);
+    if ((root || isSep(*path)) && getcwd(cwd, sizeof(cwd))) {
+        size_t n = strlen(cwd);
+        while (n && isSep(cwd[n - 1])) // the root directory
+            n--;
+        if (strncmp(path, cwd, n) == 0 && (path[n] == '\0' || isSep(path[n])))
+            root = 0, path += n + (path[n] != '\0'); // within it
+    }
+    memcpy(norm, path, root);
+    path += root;
+    bool absolute = isSep(*path);
+    char *start   = norm + root + absolute; // the components
+    char *t       = start;
+    if (absolute)
+        start[-1] = '/';
+    while (*path) {
+        while (isSep(*path))
+            path++;
+        size_t len = 0;
+        while (path[len] && !isSep(path[len]))
+            len++;
+        char *last = t; // start of the last component kept
+        while (last > start && last[-1] != '/')
+            last--;
+        bool dotDot = len == 2 && path[0] == '.' && path[1] == '.';
+        if (dotDot && t > start && !(t - last == 2 && last[0] == '.' && last[1] == '.'))
+            t = last > start ? last - 1 : start; // drop it
+        else if (len && !(len == 1 && *path == '.') && !(dotDot && absolute)) {
+            if (t > start)
+                *t++ = '/';
+            memcpy(t, path, len);
+            t += len;
+        }
+        path += len;
+    }
+    if (t == norm)
+        *t++ = '.';
+    *t = '\0';
+    return norm;
+}
+
+// true if path is tree, or within it, both being as normPath returns
+static bool inTree(char const *path, char const *tree) {
+    size_t len = strlen(tree);
+    if (strcmp(tree, ".") == 0) // any relative path that does not go above it
+        return !isSep(*path) && !rootLen(path) &&
+               !(path[0] == '.' && path[1] == '.' && (path[2] == '\0' || isSep(path[2])));
+    return strncmp(path, tree, len) == 0 &&
+           (path[len] == '\0' || isSep(path[len]) || isSep(tree[len - 1]));
+}
+
+static catMember_t const *sortMembers; // for the qsort comparisons
+
+static int cmpByName(void const *a, void const *b) {
+    catMember_t const *x = &sortMembers[*(uint32_t const *)a];
+    catMember_t const *y = &sortMembers[*(uint32_t const *)b];
+    int cmp              = memcmp(x->name, y->name, 11);
+    if (cmp)
+        return cmp;
+    if (x->lib != y->lib)
+        return x->lib < y->lib ? -1 : 1;
+    return *(uint32_t const *)a < *(uint32_t const *)b ? -1 : 1;
+}
+
+static int cmpByCrc(void const *a, void const *b) {
+    catMember_t const *x = &sortMembers[*(uint32_t const *)a];
+    catMember_t const *y = &sortMembers[*(uint32_t const *)b];
+    if (x->crc != y->crc)
+        return x->crc < y->crc ? -1 : 1;
+    return cmpByName(a, b);
+}
+
+static bool growBuf(void **buf, size_t *size, size_t need, size_t elem) {
+    if (need <= *size)
+        return true;
+    size_t n = *size ? *size : 1024;
+    while (n < need)
+        n *= 2;
+    void *t = realloc(*buf, n * elem);
+    if (!t)
+        return false;
+    *buf  = t;
+    *size = n;
+    return true;
+}
+
+// the catalog being built
+typedef struct {
+    catHdr_t hdr;
+    catLib_t *libs;
+    catMember_t *members;
+    char *strings;
+    size_t libsSize;
+    size_t membersSize;
+    size_t stringsSize;
+} newCat_t;
+
+// add a library to the new catalog, with the members of old library from, or if it is
+// -1 the active entries of the directory read into l
+static bool addCatLib(newCat_t *cat, char const *path, uint64_t size, int64_t mtime,
+                      catalog_t const *old, int from, scanLib_t const *l) {
+    catHdr_t *hdr = &cat->hdr;
+    size_t len    = strlen(path) + 1;
+    catLib_t lib  = { hdr->strSize, size, mtime, hdr->nMembers };
+
+    if (!growBuf((void **)&cat->strings, &cat->stringsSize, hdr->strSize + len, 1) ||
+        !growBuf((void **)&cat->libs, &cat->libsSize, hdr->nLibs + 1, sizeof(catLib_t)))
+        return false;
+    memcpy(cat->strings + hdr->strSize, path, len);
+    hdr->strSize += len;
+    if (from >= 0) {
+        catLib_t const *o = &old->libs[from];
+        if (!growBuf((void **)&cat->members, &cat->membersSize, hdr->nMembers + o->count,
+                     sizeof(catMember_t)))
+            return false;
+        for (uint32_t k = 0; k < o->count; k++) {
+            cat->members[hdr->nMembers]       = old->members[o->first + k];
+            cat->members[hdr->nMembers++].lib = hdr->nLibs;
+        }
+    } else
+        for (int k = 1; l->dir && k < l->entries; k++) {
+            dir_t const *e = &l->dir[k];
+            if ((*e)[Status] != ACTIVE)
+                continue;
+            if (!growBuf((void **)&cat->members, &cat->membersSize, hdr->nMembers + 1,
+                         sizeof(catMember_t)))
+                return false;
+            catMember_t *m = &cat->members[hdr->nMembers++];
+            memset(m, 0, sizeof(catMember_t));
+            memcpy(m->name, &(*e)[Name], 11);
+            memcpy(m->dates, &(*e)[CreateDate], 8);
+            m->padCnt = (*e)[PadCnt];
+            m->lib    = hdr->nLibs;
+            m->index  = WORD(&(*e)[Index]);
+            m->length = WORD(&(*e)[Length]);
+            m->crc    = WORD(&(*e)[Crc]);
+        }
+    lib.count              = hdr->nMembers - lib.first;
+    cat->libs[hdr->nLibs++] = lib;
+    return true;
+}
+
+static bool writeCatalog(char const *path, catHdr_t *hdr, catLib_t const *libs,
+                         catMember_t const *members, uint32_t const *byName,
+                         uint32_t const *byCrc, char const *strings) {
+    char *tmpName;
+    FILE *fp = createTemp(path, &tmpName);
+    if (!fp) {
+        fprintf(stderr, "cannot create %s\n", path);
+        return false;
+    }
+    bool ok = fwrite(hdr, sizeof(catHdr_t), 1, fp) == 1 &&
+              fwrite(libs, sizeof(catLib_t), hdr->nLibs, fp) == hdr->nLibs &&
+              fwrite(members, sizeof(catMember_t), hdr->nMembers, fp) == hdr->nMembers &&
+              fwrite(byName, sizeof(uint32_t), hdr->nMembers, fp) == hdr->nMembers &&
+              fwrite(byCrc, sizeof(uint32_t), hdr->nMembers, fp) == hdr->nMembers &&
+              fwrite(strings, 1, hdr->strSize, fp) == hdr->strSize;
+    if (fclose(fp) != 0)
+        ok = false;
+    if (!ok || !replaceFile(tmpName, path, false)) {
+        fprintf(stderr, "cannot write %s\n", path);
+        remove(tmpName);
+        ok = false;
+    }
+    free(tmpName);
+    return ok;
+}
+
+int catalogUpdate(char const *catalog, char **trees, int nTrees) {
+    scan_t s          = { 0 };
+    int size          = 0;
+    match_t *matches  = calloc(nTrees, sizeof(match_t));
+    char **norm       = calloc(nTrees, sizeof(char *)); // the trees as normPath returns
+    catalog_t old     = { 0 };
+    struct timespec start;
+    bool ok = matches && norm;
+
+    timespec_get(&start, TIME_UTC);
+    // every .lbr file in the trees, or the library named
+    for (int i = 0; ok && i < nTrees; i++) {
+        struct stat st;
+        fileMeta_t f = { norm[i] = normPath(trees[i]) };
+        if (!norm[i])
+            ok = false;
+        else if (stat(norm[i], &st) != 0)
+            fprintf(stderr, "cannot find %s\n", trees[i]);
+        else if (S_ISREG(st.st_mode)) {
+            setMeta(&f, &st);
+            ok = addLib(&s, &size, &f);
+        } else if (S_ISDIR(st.st_mode)) {
+            char *pattern = malloc(strlen(norm[i]) + 20);
+            if ((ok = pattern != NULL)) {
+                if (strcmp(norm[i], ".") == 0) // so the paths do not start ./
+                    strcpy(pattern, "**/*.[Ll][Bb][Rr]");
+                else // only the root ends in /
+                    sprintf(pattern, "%s%s**/*.[Ll][Bb][Rr]", norm[i],
+                            norm[i][strlen(norm[i]) - 1] == '/' ? "" : "/");
+                ok = expandPattern(pattern, &matches[i]);
+                free(pattern);
+            }
+            for (size_t j = 0; ok && j < matches[i].count; j++)
+                ok = addLib(&s, &size, &matches[i].files[j]);
+        }
+    }
+    if (!ok) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    if (s.count)
+        qsort(s.libs, s.count, sizeof(scanLib_t), cmpScanLib);
+    int n = 0;
+    for (int i = 0; i < s.count; i++) // a tree can be named twice, or within another
+        if (n == 0 || strcmp(s.libs[n - 1].meta.path, s.libs[i].meta.path) != 0)
+            s.libs[n++] = s.libs[i];
+    s.count = n;
+
+    // unchanged libraries keep their members, the rest are read
+    mapCatalog(&old, catalog);
+    int nRead = 0;
+    for (int i = 0; i < s.count; i++) {
+        scanLib_t *l = &s.libs[i];
+        int j        = findLib(&old, l->meta.path);
+        if (j >= 0 && old.libs[j].size == l->meta.size && old.libs[j].mtime == l->meta.mtimeNs)
+            l->old = j;
+        else
+            nRead++;
+    }
+    mtx_init(&s.lock, mtx_plain);
+    int nThreads    = jobs < nRead ? jobs : nRead;
+    thrd_t *threads = nThreads > 1 ? malloc((nThreads - 1) * sizeof(thrd_t)) : NULL;
+    int started     = 0;
+    while (started < nThreads - 1 && threads &&
+           thrd_create(&threads[started], readWorker, &s) == thrd_success)
+        started++;
+    readWorker(&s); // main thread reads too
+    for (int i = 0; i < started; i++)
+        thrd_join(threads[i], NULL);
+    free(threads);
+    mtx_destroy(&s.lock);
+    ok = ok && !s.noMem; // reported below
+
+    // merge with the old libraries, both being sorted by path
+    newCat_t cat = { { CATMAGIC, CATVERSION } };
+    int nOld     = old.hdr ? (int)old.hdr->nLibs : 0;
+    int kept = 0, removed = 0, invalid = 0;
+    for (int i = 0, j = 0; ok && (i < s.count || j < nOld);) {
+        char const *oldPath = j < nOld ? old.strings + old.libs[j].path : NULL;
+        scanLib_t *l        = i < s.count ? &s.libs[i] : NULL;
+        int cmp             = !oldPath ? 1 : !l ? -1 : strcmp(oldPath, l->meta.path);
+        if (cmp < 0) { // not found, so kept only if outside the trees
+            char *oldNorm = normPath(oldPath); // in case an older version stored ./cat
+            bool outside  = true;
+            if (!(ok = oldNorm != NULL))
+                break;
+            for (int k = 0; outside && k < nTrees; k++)
+                outside = !inTree(oldNorm, norm[k]);
+            free(oldNorm);
+            if (outside) {
+                ok = addCatLib(&cat, oldPath, old.libs[j].size, old.libs[j].mtime, &old, j, NULL);
+                kept++;
+            } else
+                removed++;
+            j++;
+            continue;
+        }
+        j += cmp == 0;
+        i++;
+        if (l->old >= 0)
+            kept++;
+        else if (!l->dir) {
+            fprintf(stderr, "%s is not a valid library\n", l->meta.path);
+            invalid++;
+        }
+        ok = addCatLib(&cat, l->meta.path, l->meta.size, l->meta.mtimeNs, &old, l->old, l);
+    }
+    unmapCatalog(&old); // before it is replaced, which windows requires
+
+    uint32_t *byName = malloc((cat.hdr.nMembers ? cat.hdr.nMembers : 1) * sizeof(uint32_t));
+    uint32_t *byCrc  = malloc((cat.hdr.nMembers ? cat.hdr.nMembers : 1) * sizeof(uint32_t));
+    if (!ok || !byName || !byCrc) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    for (uint32_t k = 0; k < cat.hdr.nMembers; k++)
+        byName[k] = byCrc[k] = k;
+    sortMembers = cat.members;
+    qsort(byName, cat.hdr.nMembers, sizeof(uint32_t), cmpByName);
+    qsort(byCrc, cat.hdr.nMembers, sizeof(uint32_t), cmpByCrc);
+    ok = writeCatalog(catalog, &cat.hdr, cat.libs, cat.members, byName, byCrc, cat.strings);
+    if (ok)
+        printf("%s: %u libraries, %u members, %d read, %d unchanged, %d removed\n", catalog,
+               cat.hdr.nLibs, cat.hdr.nMembers, nRead - invalid, kept, removed);
+    if (ok && verbose)
+        printf("updated in %.3fs\n", elapsed(&start));
+
+    for (int i = 0; i < s.count; i++)
+        free(s.libs[i].dir);
+    free(s.libs);
+    for (int i = 0; i < nTrees; i++) {
+        freeMatch(&matches[i]);
+        free(norm[i]);
+    }
+    free(matches);
+    free(norm);
+    free(cat.libs);
+    free(cat.members);
+    free(cat.strings);
+    free(byName);
+    free(byCrc);
+    return !ok;
+}
+
+/*
+ * queries. A name is found in byName and a CRC, given as crc=xxxx, in byCrc, each with a
+ * binary search for the first match. A name with wildcards is matched against every name,
+ * in byName order
+ */
+static void showMember(catalog_t const *c, uint32_t k) {
+    catMember_t const *m = &c->members[k];
+    char name[13];
+    size_t size = m->length * (size_t)128;
+
+    unpackName(name, m->name);
+    printf("%-12s %7zu  %04X  %5u  ", name, size >= m->padCnt ? size - m->padCnt : 0, m->crc,
+           m->index);
+    time_t mtime = getDate(m->dates + 2);
+    if (mtime)
+        displayDate(mtime);
+    else
+        printf("%-19s", "");
+    printf("  %s\n", c->strings + c->libs[m->lib].path);
+}
+
+// first of the n entries of order whose key is not below key
+static uint32_t lowerBound(catalog_t const *c, uint32_t const *order, uint32_t n,
+                           uint8_t const *name, int crc) {
+    uint32_t lo = 0, hi = n;
+    while (lo < hi) {
+        uint32_t mid         = lo + (hi - lo) / 2;
+        catMember_t const *m = &c->members[order[mid]];
+        if (crc >= 0 ? m->crc < crc : memcmp(m->name, name, 11) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static int findQuery(catalog_t const *c, char const *query) {
+    uint32_t n = c->hdr->nMembers;
+    int found  = 0;
+    char *end;
+
+    if (strncmp(query, "crc=", 4) == 0) {
+        unsigned long crc = strtoul(query + 4, &end, 16);
+        if (end == query + 4 || *end || crc > 0xffff) {
+            fprintf(stderr, "invalid CRC %s\n", query + 4);
+            return -1;
+        }
+        for (uint32_t i = lowerBound(c, c->byCrc, n, NULL, (int)crc);
+             i < n && c->members[c->byCrc[i]].crc == crc; i++, found++)
+            showMember(c, c->byCrc[i]);
+    } else if (strpbrk(query, "*?[")) {
+        char pattern[FILENAME_MAX];
+        char name[13];
+        int j = 0;
+        for (; query[j] && j < FILENAME_MAX - 1; j++)
+            pattern[j] = toupper((uint8_t)query[j]);
+        pattern[j] = '\0';
+        for (uint32_t i = 0; i < n; i++) {
+            unpackName(name, c->members[c->byName[i]].name);
+            if (globMatch(pattern, name)) {
+                showMember(c, c->byName[i]);
+                found++;
+            }
+        }
+    } else {
+        uint8_t key[11];
+        packName(key, query);
+        for (uint32_t i = lowerBound(c, c->byName, n, key, -1);
+             i < n && memcmp(c->members[c->byName[i]].name, key, 11) == 0;
+             i++, found++)
+            showMember(c, c->byName[i]);
+    }
+    return found;
+}
+
+int catalogFind(char const *catalog, char **queries, int nQueries) {
+    catalog_t c;
+    int errors = 0;
+
+    if (!mapCatalog(&c, catalog)) {
+        fprintf(stderr, "cannot open catalog %s\n", catalog);
+        return 1;
+    }
+    printf("%-12s %7s  %-4s  %5s  %-19s  %s\n", "Name", "Size", "CRC", "Index", "Modify Time",
+           "Library");
+    for (int i = 0; i < nQueries; i++) {
+        struct timespec start;
+        timespec_get(&start, TIME_UTC);
+        int found = findQuery(&c, queries[i]);
+        if (found == 0)
+            fprintf(stderr, "%s not found\n", queries[i]);
+        if (found <= 0)
+            errors++;
+        else if (verbose)
+            printf("%s: %d found in %.3fms\n", queries[i], found, elapsed(&start) * 1000);
+    }
+    unmapCatalog(&c);
+    return errors != 0;
+}
@@ -0,0 +1,271 @@
+/* mklbr - create .lbr archives from recipes
+ * Copyright (C) - 2020-2023 Mark Ogden
+ *
+ * crc16.c - CRC-16 engines with runtime selection
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include "crc16.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define HAVE_CLMUL 1
+#include <emmintrin.h>
+#include <tmmintrin.h>
+#include <wmmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define CLMUL_TARGET
+#else
+#define CLMUL_TARGET __attribute__((target("pclmul,ssse3")))
+#endif
+#endif
+
+#define POLY 0x11021
+
+static uint16_t crcTab[8][256]; // slicing tables, crcTab[k][b] is b followed by k zero bytes
+static bool tabReady;
+
+// the original calcCrc from mklbr.c, kept as the reference all others are checked against
+uint16_t crc16Ref(uint16_t crc, uint8_t const *buf, size_t len) {
+    uint8_t x;
+
+    while (len-- > 0) {
+        x = (crc >> 8) ^ *buf++;
+        x ^= x >> 4;
+        crc = (crc << 8) ^ (x << 12) ^ (x << 5) ^ x;
+    }
+    return crc;
+}
+
+static void initTables() {
+    for (int b = 0; b < 256; b++) {
+        uint8_t c = (uint8_t)b;
+        crcTab[0][b] = crc16Ref(0, &c, 1);
+    }
+    for (int k = 1; k < 8; k++)
+        for (int b = 0; b < 256; b++)
+            crcTab[k][b] = (crcTab[k - 1][b] << 8) ^ crcTab[0][crcTab[k - 1][b] >> 8];
+    tabReady = true;
+}
+
+static uint16_t crc16Slice8(uint16_t crc, uint8_t const *buf, size_t len) {
+    while (len >= 8) {
+        crc = crcTab[7][buf[0] ^ (crc >> 8)] ^ crcTab[6][buf[1] ^ (crc & 0xff)] ^
+              crcTab[5][buf[2]] ^ crcTab[4][buf[3]] ^ crcTab[3][buf[4]] ^ crcTab[2][buf[5]] ^
+              crcTab[1][buf[6]] ^ crcTab[0][buf[7]];
+        buf += 8;
+        len -= 8;
+    }
+    while (len-- > 0)
+        crc = (crc << 8) ^ crcTab[0][(crc >> 8) ^ *buf++];
+    return crc;
+}
+
+#ifdef HAVE_CLMUL
+/*
+ * carry-less multiply folding. The data is treated as a polynomial with the first byte most
+ * significant, so each 16 byte block is byte reversed into a 128 bit value. Blocks are
+ * folded forward by multiplying each 64 bit half by x^n mod P for the distance moved,
+ * which leaves a 128 bit remainder congruent to the data. Its CRC, computed with the tables,
+ * is the CRC of the data consumed, and any tail is then handled by the tables as normal.
+ */
+static uint64_t kFold4[2]; // x^(512+64), x^512 mod P
+static uint64_t kFold1[2]; // x^(128+64), x^128 mod P
+
+static uint64_t xPowMod(int n) {
+    uint32_t r = 1;
+    while (n-- > 0)
+        if ((r <<= 1) & 0x10000)
+            r ^= POLY;
+    return r;
+}
+
+CLMUL_TARGET static inline __m128i fold(__m128i acc, __m128i k, __m128i next) {
+    __m128i hi = _mm_clmulepi64_si128(acc, k, 0x01); // acc high * k low
+    __m128i lo = _mm_clmulepi64_si128(acc, k, 0x10); // acc low * k high
+    return _mm_xor_si128(_mm_xor_si128(hi, lo), next);
+}
+
+CLMUL_TARGET static uint16_t crc16Clmul(uint16_t crc, uint8_t const *buf, size_t len) {
+    if (len < 128)
+        return crc16Slice8(crc, buf, len);
+
+    __m128i const swap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    __m128i const k4   = _mm_set_epi64x(kFold4[1], kFold4[0]);
+    __m128i const k1   = _mm_set_epi64x(kFold1[1], kFold1[0]);
+    __m128i a[4];
+
+    for (int i = 0; i < 4; i++)
+        a[i] = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const *)(buf + i * 16)), swap);
+    // the incoming crc is equivalent to xoring it into the first two bytes
+    a[0] = _mm_xor_si128(a[0], _mm_set_epi64x((int64_t)((uint64_t)crc << 48), 0));
+    buf += 64;
+    len -= 64;
+
+    while (len >= 64) {
+        for (int i = 0; i < 4; i++)
+            a[i] = fold(a[i], k4,
+                        _mm_shuffle_epi8(_mm_loadu_si128((__m128i const *)(buf + i * 16)), swap));
+        buf += 64;
+        len -= 64;
+    }
+    __m128i acc = fold(fold(fold(a[0], k1, a[1]), k1, a[2]), k1, a[3]);
+    while (len >= 16) {
+        acc = fold(acc, k1, _mm_shuffle_epi8(_mm_loadu_si128((__m128i const *)buf), swap));
+        buf += 16;
+        len -= 16;
+    }
+    uint8_t rem[16];
+    _mm_storeu_si128((__m128i *)rem, _mm_shuffle_epi8(acc, swap));
+    return crc16Slice8(crc16Slice8(0, rem, 16), buf, len);
+}
+
+static bool haveClmul() {
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 1);
+    return (info[2] & (1 << 1)) && (info[2] & (1 << 9)); // PCLMULQDQ and SSSE3
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("ssse3");
+#endif
+}
+#endif
+
+typedef struct {
+    char const *name;
+    crcFn_t fn;
+} engine_t;
+
+static engine_t engines[] = {
+    { "ref", crc16Ref },
+    { "slice8", crc16Slice8 },
+#ifdef HAVE_CLMUL
+    { "clmul", crc16Clmul },
+#endif
+};
+#define NENGINES ((int)(sizeof(engines) / sizeof(engines[0])))
+
+static engine_t *current;
+
+static bool usable(engine_t const *e) {
+#ifdef HAVE_CLMUL
+    if (e->fn == crc16Clmul && !haveClmul())
+        return false;
+#endif
+    return true;
+}
+
+static void initEngines() {
+    if (!tabReady)
+        initTables();
+#ifdef HAVE_CLMUL
+    kFold4[0] = xPowMod(512 + 64);
+    kFold4[1] = xPowMod(512);
+    kFold1[0] = xPowMod(128 + 64);
+    kFold1[1] = xPowMod(128);
+#endif
+}
+
+// first call selects the best engine then forwards
+static uint16_t crc16Auto(uint16_t crc, uint8_t const *buf, size_t len) {
+    crcSelect("auto");
+    return crc16(crc, buf, len);
+}
+
+crcFn_t crc16 = crc16Auto;
+
+bool crcSelect(char const *name) {
+    initEngines();
+    if (strcmp(name, "auto") == 0) {
+        for (int i = NENGINES; i-- > 0;) // last usable is the fastest
+            if (usable(&engines[i])) {
+                current = &engines[i];
+                break;
+            }
+    } else {
+        int i;
+        for (i = 0; i < NENGINES && strcmp(engines[i].name, name) != 0; i++)
+            ;
+        if (i == NENGINES || !usable(&engines[i]))
+            return false;
+        current = &engines[i];
+    }
+    crc16 = current->fn;
+    return true;
+}
+
+char const *crcEngine() {
+    if (!current)
+        crcSelect("auto");
+    return current->name;
+}
+
+// check every usable engine against the reference over a range of lengths,
+// alignments and starting values. Optionally show the throughput of each
+bool crcSelfTest(bool timing) {
+    enum { TESTSIZE = 4096 + 64, TIMESIZE = 16 * 1024 * 1024 };
+    static uint8_t const check[] = "123456789";
+    bool ok                      = true;
+
+    initEngines();
+    uint8_t *buf = malloc(TIMESIZE);
+    if (!buf) {
+        fprintf(stderr, "out of memory\n");
+        return false;
+    }
+    srand(1);
+    for (int i = 0; i < TIMESIZE; i++)
+        buf[i] = rand() & 0xff;
+
+    for (int e = 0; e < NENGINES; e++) {
+        engine_t *eng = &engines[e];
+        if (!usable(eng)) {
+            printf("%-8s not supported on this cpu\n", eng->name);
+            continue;
+        }
+        bool pass = eng->fn(0, check, 9) == 0x31c3; // standard XMODEM check value
+        for (int len = 0; pass && len <= TESTSIZE - 64; len += len < 300 ? 1 : 61)
+            for (int align = 0; pass && align < 16; align += 5) {
+                uint16_t init = (uint16_t)(len * 2654435761u >> 16);
+                pass = eng->fn(init, buf + align, len) == crc16Ref(init, buf + align, len);
+            }
+        // split processing must match a single call
+        for (int split = 0; pass && split < TESTSIZE; split += 997)
+            pass = eng->fn(eng->fn(0, buf, split), buf + split, TESTSIZE - split) ==
+                   crc16Ref(0, buf, TESTSIZE);
+        printf("%-8s %s", eng->name, pass ? "ok  " : "FAIL");
+        if (timing && pass) {
+            clock_t start = clock();
+            int passes    = 0;
+            do {
+                eng->fn(0, buf, TIMESIZE);
+                passes++;
+            } while (clock() - start < CLOCKS_PER_SEC / 4);
+            double secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+            printf("  %8.1f MB/s", passes * (TIMESIZE / 1048576.0) / secs);
+        }
+        putchar('\n');
+        ok &= pass;
+    }
+    free(buf);
+    printf("selected engine: %s\n", crcEngine());
+    return ok;
+}
@@ -0,0 +1,39 @@
+/* mklbr - create .lbr archives from recipes
+ * Copyright (C) - 2020-2023 Mark Ogden
+ *
+ * crc16.h - CRC-16 (CCITT/XMODEM) engine used for lbr members
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef _CRC16_H_
+#define _CRC16_H_
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// all engines compute the same CRC, polynomial 0x1021, msb first
+// crc is the running value, 0 for a new member, so a member can be processed
+// in pieces by passing the previous result back in
+typedef uint16_t (*crcFn_t)(uint16_t crc, uint8_t const *buf, size_t len);
+
+extern crcFn_t crc16;                                  // currently selected engine
+uint16_t crc16Ref(uint16_t crc, uint8_t const *buf, size_t len); // original bit twiddling
+
+bool crcSelect(char const *name); // "auto", or one of the engine names
+char const *crcEngine(void);      // name of selected engine
+bool crcSelfTest(bool timing);    // check all engines against crc16Ref
+
+#endif
@@ -0,0 +1,339 @@
+/* mklbr - create .lbr archives from recipes
+ * Copyright (C) - 2020-2023 Mark Ogden
+ *
+ * crccache.c - persistent cache of member CRCs
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * The cache file is a header followed by fixed size records sorted on the hash of the
+ * absolute path, so it can be mapped and searched in place. A record is only used if the
+ * device, inode, size and modify time all match, otherwise the file has changed.
+ * New records are held in memory and merged into the file at the end of the run. The merge
+ * is done under an exclusive lock on a separate lock file, rereading the current cache so
+ * updates from concurrent runs are kept, and the result is renamed into place. Readers that
+ * have the old file mapped are unaffected.
+ * Records are in native byte order as the cache is local to the machine.
+ */
+#include "crccache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+#ifdef _WIN32
+#include <direct.h>
+#include <fcntl.h>
+#include <io.h>
+#include <sys/locking.h>
+#include <sys/stat.h>
+#define getcwd _getcwd
+#else
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define CACHEMAGIC   "LBRC"
+#define CACHEVERSION 1
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint64_t count;
+} cacheHdr_t;
+
+typedef struct {
+    uint64_t pathHash;
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime;
+    uint16_t crc;
+    uint8_t filler[6];
+} cacheRec_t;
+
+unsigned cacheHits, cacheMisses;
+
+static char const *cacheName;
+static void *mapBase; // the whole file
+static size_t mapSize;
+static cacheRec_t const *recs; // records within the mapping
+static uint64_t nRecs;
+static cacheRec_t *added;
+static size_t nAdded, addedSize;
+static char cwd[4096];
+static mtx_t cacheLock; // lookups and stores can come from concurrent library builds
+static once_flag lockOnce = ONCE_FLAG_INIT;
+
+static void initLock(void) {
+    mtx_init(&cacheLock, mtx_plain);
+}
+
+static uint64_t fnv(uint64_t h, char const *s) {
+    while (*s)
+        h = (h ^ (uint8_t)*s++) * 1099511628211ull; // FNV-1a
+    return h;
+}
+
+// relative paths are hashed as though prefixed by the current directory
+static uint64_t hashPath(char const *path) {
+    uint64_t h = 14695981039346656037ull;
+#ifdef _WIN32
+    bool absolute = path[0] == '\\' || path[0] == '/' || (path[0] && path[1] == ':');
+#else
+    bool absolute = path[0] == '/';
+#endif
+    if (!absolute)
+        h = fnv(fnv(h, cwd), "/");
+    return fnv(h, path);
+}
+
+static bool validCache(void const *base, size_t size) {
+    cacheHdr_t const *hdr = base;
+    return size >= sizeof(cacheHdr_t) && memcmp(hdr->magic, CACHEMAGIC, 4) == 0 &&
+           hdr->version == CACHEVERSION &&
+           hdr->count == (size - sizeof(cacheHdr_t)) / sizeof(cacheRec_t);
+}
+
+// load the current cache file, mapped where supported. returns NULL if missing or invalid
+static void *loadCache(size_t *size) {
+    void *base = NULL;
+#ifdef _WIN32
+    FILE *fp = fopen(cacheName, "rb");
+    if (!fp)
+        return NULL;
+    fseek(fp, 0, SEEK_END);
+    *size = ftell(fp);
+    rewind(fp);
+    if ((base = malloc(*size ? *size : 1)) && fread(base, 1, *size, fp) != *size) {
+        free(base);
+        base = NULL;
+    }
+    fclose(fp);
+#else
+    struct stat stbuf;
+    int fd = open(cacheName, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &stbuf) == 0 && (*size = stbuf.st_size) != 0 &&
+        (base = mmap(NULL, *size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+        base = NULL;
+    close(fd);
+#endif
+    if (base && !validCache(base, *size)) {
+        fprintf(stderr, "ignoring invalid CRC cache %s\n", cacheName);
+#ifdef _WIN32
+        free(base);
+#else
+        munmap(base, *size);
+#endif
+        base = NULL;
+    }
+    return base;
+}
+
+static void unloadCache(void *base, size_t size) {
+    if (base)
+#ifdef _WIN32
+        free(base);
+#else
+        munmap(base, size);
+#endif
+}
+
+// can be called again, e.g. after crcCacheSave in watch mode, to map the cache afresh
+bool crcCacheOpen(char const *cacheFile) {
+    call_once(&lockOnce, initLock);
+    unloadCache(mapBase, mapSize); // if still open
+    mapBase   = NULL;
+    recs      = NULL;
+    nRecs     = 0;
+    cacheName = cacheFile;
+    if (!getcwd(cwd, sizeof(cwd))) {
+        fprintf(stderr, "cannot determine current directory for CRC cache\n");
+        return false;
+    }
+    if ((mapBase = loadCache(&mapSize))) {
+        recs  = (cacheRec_t const *)((cacheHdr_t const *)mapBase + 1);
+        nRecs = ((cacheHdr_t const *)mapBase)->count;
+    }
+    return true;
+}
+
+static cacheRec_t const *findRec(cacheRec_t const *base, uint64_t n, uint64_t hash) {
+    while (n) { // binary search
+        uint64_t mid = n / 2;
+        if (base[mid].pathHash == hash)
+            return &base[mid];
+        if (base[mid].pathHash < hash) {
+            base += mid + 1;
+            n -= mid + 1;
+        } else
+            n = mid;
+    }
+    return NULL;
+}
+
+bool crcCacheLookup(fileKey_t const *key, uint16_t *crc) {
+    cacheRec_t const *rec = findRec(recs, nRecs, hashPath(key->path));
+    if (rec && rec->dev == key->dev && rec->ino == key->ino && rec->size == key->size &&
+        rec->mtime == key->mtime) {
+        *crc = rec->crc;
+        mtx_lock(&cacheLock);
+        cacheHits++;
+        mtx_unlock(&cacheLock);
+        return true;
+    }
+    mtx_lock(&cacheLock);
+    cacheMisses++;
+    mtx_unlock(&cacheLock);
+    return false;
+}
+
+bool crcCacheStore(fileKey_t const *key, uint16_t crc) {
+    if (!cacheName)
+        return true;
+    uint64_t hash = hashPath(key->path);
+    mtx_lock(&cacheLock);
+    if (nAdded == addedSize) {
+        size_t size      = addedSize ? addedSize * 2 : 256;
+        cacheRec_t *recs = realloc(added, size * sizeof(cacheRec_t));
+        if (!recs) {
+            mtx_unlock(&cacheLock);
+            return false;
+        }
+        added     = recs;
+        addedSize = size;
+    }
+    cacheRec_t *rec = &added[nAdded++];
+    memset(rec, 0, sizeof(*rec));
+    rec->pathHash = hash;
+    rec->dev      = key->dev;
+    rec->ino      = key->ino;
+    rec->size     = key->size;
+    rec->mtime    = key->mtime;
+    rec->crc      = crc;
+    mtx_unlock(&cacheLock);
+    return true;
+}
+
+static int cmpRec(void const *a, void const *b) {
+    uint64_t ha = ((cacheRec_t const *)a)->pathHash;
+    uint64_t hb = ((cacheRec_t const *)b)->pathHash;
+    return ha < hb ? -1 : ha > hb;
+}
+
+// merge the current cache with the new records, which replace any with the same path
+static bool writeMerged(FILE *fp, cacheRec_t const *cur, uint64_t nCur) {
+    cacheHdr_t hdr = { CACHEMAGIC, CACHEVERSION, 0 };
+    uint64_t i = 0, j = 0;
+
+    if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1)
+        return false;
+    while (i < nCur || j < nAdded) {
+        cacheRec_t const *rec;
+        if (j < nAdded && (i >= nCur || added[j].pathHash <= cur[i].pathHash)) {
+            if (i < nCur && added[j].pathHash == cur[i].pathHash)
+                i++;
+            rec = &added[j++];
+            while (j < nAdded && added[j].pathHash == rec->pathHash) // same path twice
+                rec = &added[j++];
+        } else
+            rec = &cur[i++];
+        if (fwrite(rec, sizeof(*rec), 1, fp) != 1)
+            return false;
+        hdr.count++;
+    }
+    rewind(fp);
+    return fwrite(&hdr, sizeof(hdr), 1, fp) == 1;
+}
+
+bool crcCacheSave() {
+    bool ok = true;
+
+    unloadCache(mapBase, mapSize);
+    mapBase = NULL;
+    recs    = NULL;
+    nRecs   = 0;
+    if (!cacheName || nAdded == 0)
+        return true;
+    qsort(added, nAdded, sizeof(cacheRec_t), cmpRec); // a repeated path has the same CRC
+
+    size_t len     = strlen(cacheName);
+    char *lockName = malloc(len + 6);
+    char *tmpName  = malloc(len + 6);
+    if (!lockName || !tmpName) {
+        fprintf(stderr, "out of memory\n");
+        free(lockName);
+        free(tmpName);
+        free(added); // as after a failed save
+        added  = NULL;
+        nAdded = addedSize = 0;
+        return false;
+    }
+    strcat(strcpy(lockName, cacheName), ".lock");
+    strcat(strcpy(tmpName, cacheName), ".tmp");
+#ifdef _WIN32
+    int lockFd = _open(lockName, _O_CREAT | _O_RDWR, _S_IREAD | _S_IWRITE);
+    if (lockFd < 0 || _locking(lockFd, _LK_LOCK, 1) != 0) {
+#else
+    int lockFd = open(lockName, O_CREAT | O_RDWR, 0666);
+    if (lockFd < 0 || flock(lockFd, LOCK_EX) != 0) {
+#endif
+        fprintf(stderr, "cannot lock CRC cache %s\n", cacheName);
+        ok = false;
+    } else {
+        size_t curSize;
+        void *cur = loadCache(&curSize); // may have been updated since it was opened
+        FILE *fp  = fopen(tmpName, "wb");
+        if (!fp || !writeMerged(fp, cur ? (cacheRec_t const *)((cacheHdr_t *)cur + 1) : NULL,
+                                cur ? ((cacheHdr_t *)cur)->count : 0)) {
+            fprintf(stderr, "cannot write CRC cache %s\n", tmpName);
+            ok = false;
+        }
+        if (fp && fclose(fp) != 0)
+            ok = false;
+        unloadCache(cur, curSize);
+#ifdef _WIN32
+        if (ok)
+            remove(cacheName); // windows rename will not replace an existing file
+#endif
+        if (ok && rename(tmpName, cacheName) != 0) {
+            fprintf(stderr, "cannot replace CRC cache %s\n", cacheName);
+            ok = false;
+        }
+        if (!ok)
+            remove(tmpName);
+    }
+#ifdef _WIN32
+    if (lockFd >= 0) {
+        _lseek(lockFd, 0, SEEK_SET);
+        _locking(lockFd, _LK_UNLCK, 1);
+        _close(lockFd);
+    }
+#else
+    if (lockFd >= 0)
+        close(lockFd); // releases the lock
+#endif
+    free(lockName);
+    free(tmpName);
+    free(added);
+    added  = NULL;
+    nAdded = addedSize = 0;
+    return ok;
+}
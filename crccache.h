@@ -0,0 +1,42 @@
+/* mklbr - create .lbr archives from recipes
+ * Copyright (C) - 2020-2023 Mark Ogden
+ *
+ * crccache.h - persistent cache of member CRCs
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef _CRCCACHE_H_
+#define _CRCCACHE_H_
+#include <stdbool.h>
+#include <stdint.h>
+
+// identifies a particular version of a source file
+typedef struct {
+    char const *path;
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime; // nanoseconds where the file system supports it
+} fileKey_t;
+
+bool crcCacheOpen(char const *cacheFile); // map the cache, a missing file is an empty cache
+bool crcCacheLookup(fileKey_t const *key, uint16_t *crc); // CRC of the 0x1a padded file
+bool crcCacheStore(fileKey_t const *key, uint16_t crc); // false if out of memory
+bool crcCacheSave(void); // merge new entries into the cache file and close it
+
+extern unsigned cacheHits, cacheMisses;
+
+#endif
@@ -0,0 +1,2809 @@
+/* mklbr - create .lbr archives from recipes
+ * Copyright (C) - 2020-2023 Mark Ogden
+ *
+ * lbr.c - build .lbr archives, the library behind mklbr
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#if _MSC_VER
+#include <io.h>
+#define timegm             _mkgmtime
+#define gmtime_r(t, tm)    gmtime_s(tm, t)
+#define localtime_r(t, tm) localtime_s(tm, t)
+#define S_ISREG(m)         (((m) & _S_IFMT) == _S_IFREG)
+#endif
+
+#include "crc16.h"
+#include "crccache.h"
+#include "lbr.h"
+#include "lbrcache.h"
+#include "lbrdir.h"
+#include "outfile.h"
+#include "procstat.h"
+#include "squeeze.h"
+#include "statbatch.h"
+#include "vecio.h"
+#include "walk.h"
+#include "zcopy.h"
+#include <ctype.h>
+#include <threads.h>
+
+#pragma warning(disable : 4996)
+
+#define MAXITEM 65535 // maximum number of items the lbr directory supports, including itself
+#define MAXSIZE (0xffff * (size_t)128) // largest member, as its sector count is 16 bits
+
+#ifdef _WIN32
+#define DIRSEP ":\\/"
+#else
+#define DIRSEP "/"
+#endif
+
+#define BADCHAR     " =?*:;<>" // illegal in CP/M 2 & 3
+#define PROBLEMCHAR ",_[]|"    // illegal dependent on version of CP/M
+
+char const *phaseNames[NPHASES] = { "parse",  "lookup", "squeeze", "dedup",
+                                     "header", "copy",   "finish" };
+
+enum { SRC_FILE, SRC_MEM, SRC_CALLBACK }; // where a member's data comes from
+
+typedef struct {
+    char *loc;  // source file, or for other members the name
+    char *name;
+    size_t fileSize;
+    uint16_t secCnt;
+    time_t ctime; // times are stored in utc format
+    time_t mtime;
+    time_t reqCtime; // times as added, -1 being resolved from the file, see setTimes
+    time_t reqMtime;
+    int reuse; // matching entry in the existing lbr when incremental, else 0
+    bool crcKnown;    // CRC found in the CRC cache
+    bool squeeze;     // squeeze the member when the library is finished
+    bool squeezed;    // data is the squeezed member, named as such by setName
+    int dupOf;        // earlier item with the same data, whose sectors it shares, else 0
+    fileKey_t key;    // identifies the version of the file for the CRC cache
+    int64_t changed;  // status change time of a file member in ns, see findReusable
+    fileMeta_t const *meta; // already looked up when expanded from a pattern, else NULL
+    int kind;
+    uint8_t const *data; // SRC_MEM
+    bool ownsData;       // data was read from a callback, so is freed with the library
+    bool fromFile;       // a SRC_FILE member read into memory by dedup, see isFile
+    lbrReadFn read;      // SRC_CALLBACK
+    void *ctx;
+} item_t;
+
+// a file member, including one dedup read into memory, whose CRC can be cached and that
+// can be copied from the file directly
+static bool isFile(item_t const *item) {
+    return item->kind == SRC_FILE || item->fromFile;
+}
+
+// I/O counts, kept separately by each parallel copy worker
+typedef struct {
+    uint64_t bytesRead;
+    uint64_t reads;
+    uint64_t opens;
+    uint64_t crcBytes;
+    double crcSecs;
+    uint64_t squeezeIn; // sizes of the members squeezed, before and after
+    uint64_t squeezeOut;
+    uint64_t dedupBytes; // bytes not written as the members duplicate others
+    int dedupMembers;
+} ioCount_t;
+
+// state of a parallel copy worker, see copyParallel
+typedef struct {
+    lbr_t *lb;
+    thrd_t thread;
+    mtx_t lock;
+    cnd_t changed;
+    uint8_t *buf[2];
+    size_t len[2];
+    bool last[2];   // chunk completes the item
+    bool direct[2]; // item CRC already known, writer to use kernelCopy
+    int head;     // slot the writer takes next
+    int filled;   // slots waiting for the writer
+    bool abort;   // copy abandoned, guarded by lock
+    ioCount_t io; // added to the library's once the worker is joined
+} worker_t;
+
+// where the library is written
+typedef struct {
+    FILE *fp;
+    uint8_t *mem; // memory, grown as it is written
+    size_t len;
+    size_t size;
+    lbrWriteFn write; // callback, written in one pass
+    void *ctx;
+} sink_t;
+
+// names are copied into blocks that never move, as items point to them
+typedef struct strBlock {
+    struct strBlock *next;
+    size_t used;
+    size_t size;
+    char text[];
+} strBlock_t;
+
+/*
+ * everything needed to build one library. Nothing here is shared between libraries, so
+ * several can be built at once
+ */
+struct lbr {
+    lbrOptions_t opts;
+    item_t *items;  // list of items to add, item 0 is the header
+    int cnt;
+    int itemsSize;  // allocated size of items
+    int entries;
+    dir_t *hdr;     // constructed header, entries long
+    uint8_t *ioBuf;
+    bool zeroCopy;   // opts.zeroCopy and the sink is a file
+    lbrDir_t oldDir; // directory of the existing lbr
+    FILE *oldFp;
+    int64_t oldTime; // when the existing lbr was written, its status change time in ns
+    sink_t sink;
+    strBlock_t *strings;
+    match_t *matches; // files matching patterns, expanded items point into these
+    char **patterns;  // the pattern each of matches is for
+    int nMatches;
+    char **missing;   // source files left out as they could not be found
+    int nMissing;
+    char **removals;  // members lbrFinishUpdate deletes
+    int nRemovals;
+    bool finished;
+    bool squeezeNext; // squeeze the members added next, see lbrSetSqueeze
+    int nextSqueeze;  // next item for a squeeze worker, guarded by dispatchLock
+    bool onePass; // the sink cannot seek, so the header is complete before it is written
+    bool keyed;   // key identifies the library in the library cache
+    bool patchable; // finished to a library file, which lbrPatch can update
+    lbrKey_t key;
+    int status;
+    // parallel copy
+    worker_t *workers;
+    int nWorkers;
+    int *owner; // worker handling each item, -1 until claimed
+    int nextItem;
+    mtx_t dispatchLock;
+    cnd_t dispatched;
+    bool abort; // guarded by dispatchLock
+    // statistics
+    lbrStats_t stats;
+    ioCount_t io;
+    int phase; // phase being timed, NPHASES if none
+    struct timespec phaseStart;
+    double phaseCpu; // CPU time at phaseStart
+    // messages
+    mtx_t reportLock;
+    char *msgs;
+    size_t msgsLen;
+    size_t msgsSize;
+};
+
+/*
+ * messages are printed immediately or kept with the library, so that several libraries
+ * being built at once each have their own report
+ */
+static void message(lbr_t *lb, char const *fmt, va_list args) {
+    mtx_lock(&lb->reportLock);
+    if (lb->opts.printMessages)
+        vfprintf(stderr, fmt, args);
+    else {
+        va_list copy;
+        va_copy(copy, args);
+        int len = vsnprintf(NULL, 0, fmt, copy);
+        va_end(copy);
+        if (len >= 0 && lb->msgsLen + len + 1 > lb->msgsSize) {
+            size_t size = lb->msgsSize ? lb->msgsSize : 256;
+            while (lb->msgsLen + len + 1 > size)
+                size *= 2;
+            char *buf = realloc(lb->msgs, size);
+            if (buf) {
+                lb->msgs     = buf;
+                lb->msgsSize = size;
+            }
+        }
+        if (len >= 0 && lb->msgsLen + len + 1 <= lb->msgsSize) {
+            vsnprintf(lb->msgs + lb->msgsLen, len + 1, fmt, args);
+            lb->msgsLen += len;
+        }
+    }
+    mtx_unlock(&lb->reportLock);
+}
+
+void lbrWarn(lbr_t *lb, char const *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    message(lb, fmt, args);
+    va_end(args);
+}
+
+// report an error that stops the library being built, always returns false
+static bool errorMsg(lbr_t *lb, int status, char const *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    message(lb, fmt, args);
+    va_end(args);
+    mtx_lock(&lb->reportLock);
+    if (lb->status == LBR_OK)
+        lb->status = status;
+    mtx_unlock(&lb->reportLock);
+    return false;
+}
+
+static bool failed(lbr_t *lb) {
+    mtx_lock(&lb->reportLock);
+    bool f = lb->status != LBR_OK;
+    mtx_unlock(&lb->reportLock);
+    return f;
+}
+
+static char *saveString(lbr_t *lb, char const *s) {
+    size_t len     = strlen(s) + 1;
+    strBlock_t *b  = lb->strings;
+    if (!b || b->used + len > b->size) {
+        size_t size = len > 0x10000 ? len : 0x10000;
+        if ((b = malloc(sizeof(strBlock_t) + size)) == NULL)
+            return NULL;
+        b->next     = lb->strings;
+        b->used     = 0;
+        b->size     = size;
+        lb->strings = b;
+    }
+    char *t = memcpy(b->text + b->used, s, len);
+    b->used += len;
+    return t;
+}
+
+/*
+ * shared stat results, used by builders with shareStats set, as in batch mode where
+ * libraries often have source files in common. The table is open addressed on the hash of
+ * the path and grows when half full. The lock is not held while files are looked up, so
+ * occasionally two libraries will both look up a path, in which case the first result is
+ * kept. Failures are cached too.
+ */
+typedef struct {
+    char *path; // NULL if the slot is free
+    uint64_t hash;
+    fileMeta_t meta;
+} statEnt_t;
+
+static statEnt_t *statTab;
+static size_t statSize, statUsed; // statSize is a power of 2
+static mtx_t statLock;
+static once_flag sharedOnce = ONCE_FLAG_INIT;
+
+static void initShared(void) {
+    mtx_init(&statLock, mtx_plain);
+    crcEngine(); // select the CRC engine before any copy threads use it
+}
+
+static uint64_t hashPath(char const *s) {
+    uint64_t h = 14695981039346656037ull;
+    while (*s)
+        h = (h ^ (uint8_t)*s++) * 1099511628211ull; // FNV-1a
+    return h;
+}
+
+static statEnt_t *findStat(statEnt_t *tab, size_t size, char const *path, uint64_t hash) {
+    size_t i = hash & (size - 1);
+    while (tab[i].path && (tab[i].hash != hash || strcmp(tab[i].path, path) != 0))
+        i = (i + 1) & (size - 1);
+    return &tab[i];
+}
+
+static bool growStats() {
+    size_t size    = statSize ? statSize * 2 : 1024;
+    statEnt_t *tab = calloc(size, sizeof(statEnt_t));
+    if (!tab)
+        return false;
+    for (size_t i = 0; i < statSize; i++)
+        if (statTab[i].path)
+            *findStat(tab, size, statTab[i].path, statTab[i].hash) = statTab[i];
+    free(statTab);
+    statTab  = tab;
+    statSize = size;
+    return true;
+}
+
+// fill in f from the shared results if it has already been looked up
+static bool lookupStat(fileMeta_t *f) {
+    uint64_t hash = hashPath(f->path);
+    statEnt_t *e;
+    bool found = false;
+
+    mtx_lock(&statLock);
+    if (statSize && (e = findStat(statTab, statSize, f->path, hash))->path) {
+        char const *path = f->path;
+        *f               = e->meta;
+        f->path          = path;
+        found            = true;
+    }
+    mtx_unlock(&statLock);
+    return found;
+}
+
+static void storeStat(fileMeta_t const *f) {
+    uint64_t hash = hashPath(f->path);
+    statEnt_t *e;
+
+    mtx_lock(&statLock);
+    if (((statUsed + 1) * 2 <= statSize || growStats()) &&
+        !(e = findStat(statTab, statSize, f->path, hash))->path && (e->path = strdup(f->path))) {
+        e->hash = hash;
+        e->meta = *f;
+        statUsed++;
+    }
+    mtx_unlock(&statLock);
+}
+
+void lbrFreeShared(void) {
+    call_once(&sharedOnce, initShared);
+    mtx_lock(&statLock);
+    for (size_t i = 0; i < statSize; i++)
+        free(statTab[i].path);
+    free(statTab);
+    statTab  = NULL;
+    statSize = statUsed = 0;
+    mtx_unlock(&statLock);
+}
+
+static char *basename(char *path) {
+    char *s;
+#ifdef _WIN32
+    if (path[0] && path[1] == ':') // skip leading device
+        path += 2;
+#endif
+    while ((s = strpbrk(path, DIRSEP))) // skip all directory components
+        path = s + 1;
+    return path;
+}
+
+bool lbrValidName(lbr_t *lb, char const *name) {
+    char *s;
+    if (!*name || strpbrk(name, BADCHAR) ||
+        ((s = strchr(name, '.')) && (!s[1] || strchr(s + 1, '.')))) {
+        lbrWarn(lb, "Bad CP/M name '%s'\n", name);
+        return false;
+    }
+    if (strpbrk(name, PROBLEMCHAR))
+        lbrWarn(lb, "Warning: Version dependent CP/M name '%s'\n", name);
+    return true;
+}
+
+// local time of t, expressed as though it were utc
+static time_t localAsUtc(time_t t) {
+    struct tm tbuf;
+    localtime_r(&t, &tbuf);
+#ifdef _MSC_VER
+    return timegm(&tbuf);
+#else
+    return t + tbuf.tm_gmtoff; // same as timegm but without a second time zone lookup
+#endif
+}
+
+time_t lbrLocalTime(time_t t) {
+    return localAsUtc(t);
+}
+
+static double elapsed(struct timespec const *start) {
+    struct timespec now;
+    timespec_get(&now, TIME_UTC);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// add the time since the current phase started to it, then start phase, NPHASES for none
+static void setPhase(lbr_t *lb, int phase) {
+    double cpu = cpuTime(lb->opts.threadCpu);
+    if (lb->phase < NPHASES) {
+        lb->stats.wall[lb->phase] += elapsed(&lb->phaseStart);
+        lb->stats.cpu[lb->phase] += cpu - lb->phaseCpu;
+    }
+    lb->phase    = phase;
+    lb->phaseCpu = cpu;
+    timespec_get(&lb->phaseStart, TIME_UTC);
+}
+
+// make room for another item
+static bool growItems(lbr_t *lb) {
+    if (lb->cnt >= lb->itemsSize) { // missing files are dropped later, so no limit here
+        int size      = lb->itemsSize ? 2 * lb->itemsSize : 64;
+        item_t *items = realloc(lb->items, size * sizeof(item_t));
+        if (items == NULL)
+            return errorMsg(lb, LBR_NOMEM, "out of memory\n");
+        lb->items     = items;
+        lb->itemsSize = size;
+    }
+    return true;
+}
+
+lbr_t *lbrNew(lbrOptions_t const *opts) {
+    lbr_t *lb = calloc(1, sizeof(lbr_t));
+    if (!lb)
+        return NULL;
+    call_once(&sharedOnce, initShared);
+    if (opts)
+        lb->opts = *opts;
+    if (lb->opts.ioBufSize < 128)
+        lb->opts.ioBufSize = 64 * 1024;
+    lb->opts.ioBufSize &= ~(size_t)127;
+    lb->entries     = 4;
+    lb->phase       = NPHASES;
+    lb->squeezeNext = lb->opts.squeeze;
+    mtx_init(&lb->reportLock, mtx_plain);
+    if (!growItems(lb)) {
+        lbrFree(lb);
+        return NULL;
+    }
+    memset(&lb->items[0], 0, sizeof(item_t)); // the header
+    lb->items[0].loc   = "";
+    lb->items[0].mtime = lb->items[0].ctime = -1;
+    lb->items[0].reqMtime = lb->items[0].reqCtime = -1;
+    lb->cnt            = 1;
+    setPhase(lb, PH_PARSE);
+    return lb;
+}
+
+void lbrFree(lbr_t *lb) {
+    if (!lb)
+        return;
+    for (int i = 1; i < lb->cnt; i++)
+        if (lb->items[i].ownsData)
+            free((void *)lb->items[i].data);
+    free(lb->items);
+    free(lb->hdr);
+    free(lb->ioBuf);
+    free(lb->sink.mem);
+    for (int i = 0; i < lb->nMatches; i++)
+        freeMatch(&lb->matches[i]);
+    free(lb->matches);
+    free(lb->patterns);
+    free(lb->missing);
+    free(lb->removals);
+    while (lb->strings) {
+        strBlock_t *next = lb->strings->next;
+        free(lb->strings);
+        lb->strings = next;
+    }
+    free(lb->msgs);
+    mtx_destroy(&lb->reportLock);
+    free(lb);
+}
+
+// add an item for a member of the given kind, loc and name already saved
+static item_t *newItem(lbr_t *lb, int kind, char *loc, char *name, time_t mtime, time_t ctime) {
+    if (!growItems(lb))
+        return NULL;
+    item_t *item = &lb->items[lb->cnt++];
+    memset(item, 0, sizeof(item_t));
+    item->kind  = kind;
+    item->loc   = loc;
+    item->name  = name;
+    item->mtime    = mtime;
+    item->ctime    = ctime;
+    item->reqMtime = mtime;
+    item->reqCtime = ctime;
+    item->squeeze = lb->squeezeNext;
+    return item;
+}
+
+int lbrAddFile(lbr_t *lb, char const *path, char const *name, time_t mtime, time_t ctime) {
+    if (lb->finished)
+        return LBR_STATE;
+    char *loc = saveString(lb, path);
+    if (!loc)
+        return errorMsg(lb, LBR_NOMEM, "out of memory\n"), LBR_NOMEM;
+    char *cpmName = name ? saveString(lb, name) : basename(loc);
+    if (!cpmName)
+        return errorMsg(lb, LBR_NOMEM, "out of memory\n"), LBR_NOMEM;
+    if (!lbrValidName(lb, cpmName))
+        return LBR_BADNAME;
+    return newItem(lb, SRC_FILE, loc, cpmName, mtime, ctime) ? LBR_OK : LBR_NOMEM;
+}
+
+/*
+ * an item for each matching file, in path order, named after the file and with the
+ * given timestamps. The walk also looks up the files, see walk.c, so resolveItems has
+ * nothing more to do for them
+ */
+int lbrAddPattern(lbr_t *lb, char const *pattern, time_t mtime, time_t ctime) {
+    match_t m;
+
+    if (lb->finished)
+        return LBR_STATE;
+    if (!expandPattern(pattern, &m))
+        return errorMsg(lb, LBR_NOMEM, "out of memory\n"), LBR_NOMEM;
+    // kept even if empty, so lbrPatch can tell when the files matching change
+    match_t *matches = realloc(lb->matches, (lb->nMatches + 1) * sizeof(match_t));
+    if (matches)
+        lb->matches = matches;
+    char **patterns = matches ? realloc(lb->patterns, (lb->nMatches + 1) * sizeof(char *)) : NULL;
+    if (patterns)
+        lb->patterns = patterns;
+    if (!patterns || (patterns[lb->nMatches] = saveString(lb, pattern)) == NULL) {
+        freeMatch(&m);
+        return errorMsg(lb, LBR_NOMEM, "out of memory\n"), LBR_NOMEM;
+    }
+    lb->matches[lb->nMatches++] = m;
+    if (m.count == 0) {
+        lbrWarn(lb, "%s matches no files -- ignoring\n", pattern);
+        return LBR_NOMATCH;
+    }
+    int status                  = LBR_OK;
+    for (size_t j = 0; j < m.count; j++) {
+        char *loc = (char *)m.files[j].path;
+        item_t *item;
+        if (!lbrValidName(lb, basename(loc)))
+            status = LBR_BADNAME;
+        else if ((item = newItem(lb, SRC_FILE, loc, basename(loc), mtime, ctime)) == NULL)
+            return LBR_NOMEM;
+        else
+            item->meta = &m.files[j];
+    }
+    return status;
+}
+
+int lbrAddMem(lbr_t *lb, char const *name, void const *data, size_t len, time_t mtime,
+              time_t ctime) {
+    if (lb->finished)
+        return LBR_STATE;
+    char *cpmName = saveString(lb, name);
+    item_t *item;
+    if (!cpmName)
+        return errorMsg(lb, LBR_NOMEM, "out of memory\n"), LBR_NOMEM;
+    if (!lbrValidName(lb, cpmName))
+        return LBR_BADNAME;
+    if ((item = newItem(lb, SRC_MEM, cpmName, cpmName, mtime, ctime)) == NULL)
+        return LBR_NOMEM;
+    item->data     = data;
+    item->fileSize = len;
+    return LBR_OK;
+}
+
+int lbrAddCallback(lbr_t *lb, char const *name, size_t size, lbrReadFn read, void *ctx,
+                   time_t mtime, time_t ctime) {
+    if (lb->finished)
+        return LBR_STATE;
+    char *cpmName = saveString(lb, name);
+    item_t *item;
+    if (!cpmName)
+        return errorMsg(lb, LBR_NOMEM, "out of memory\n"), LBR_NOMEM;
+    if (!lbrValidName(lb, cpmName))
+        return LBR_BADNAME;
+    if ((item = newItem(lb, SRC_CALLBACK, cpmName, cpmName, mtime, ctime)) == NULL)
+        return LBR_NOMEM;
+    item->read     = read;
+    item->ctx      = ctx;
+    item->fileSize = size;
+    return LBR_OK;
+}
+
+int lbrRemove(lbr_t *lb, char const *name) {
+    if (lb->finished)
+        return LBR_STATE;
+    char **removals = realloc(lb->removals, (lb->nRemovals + 1) * sizeof(char *));
+    if (removals)
+        lb->removals = removals;
+    if (!removals || (removals[lb->nRemovals] = saveString(lb, name)) == NULL)
+        return errorMsg(lb, LBR_NOMEM, "out of memory\n"), LBR_NOMEM;
+    lb->nRemovals++;
+    return LBR_OK;
+}
+
+void lbrSetSqueeze(lbr_t *lb, bool squeeze) {
+    lb->squeezeNext = squeeze;
+}
+
+void lbrSetTimes(lbr_t *lb, time_t mtime, time_t ctime) {
+    lb->items[0].mtime = lb->items[0].reqMtime = mtime;
+    lb->items[0].ctime = lb->items[0].reqCtime = ctime;
+}
+
+// resolve the times of item from the times it was added with and, for a file member, the
+// file f, other members taking the current time now
+static void setTimes(lbr_t *lb, item_t *item, fileMeta_t const *f, time_t now) {
+    bool autoCtime = item->reqCtime == -1;
+
+    item->ctime = item->reqCtime;
+    item->mtime = item->reqMtime;
+    if (!f) {
+        if (autoCtime)
+            item->ctime = now;
+        if (item->mtime == -1)
+            item->mtime = item->ctime;
+    } else {
+        if (autoCtime)
+            item->ctime = localAsUtc(f->ctime);
+        if (item->mtime == -1)
+            item->mtime = f->mtime == f->ctime && autoCtime ? item->ctime : localAsUtc(f->mtime);
+    }
+    if (0 < item->mtime && item->mtime < item->ctime) {
+        if (!autoCtime)
+            lbrWarn(lb, "%s: modify time before create time. Setting both to earliest timestamp\n",
+                    item->loc);
+        item->ctime = item->mtime;
+    }
+}
+
+/*
+ * metadata phase. Once all the members are added the source files are looked up
+ * together, see statbatch.c, rather than one at a time as each is added. Items whose
+ * files are missing are then dropped, in the order added.
+ */
+static bool resolveItems(lbr_t *lb) {
+    item_t *items = lb->items;
+    int n         = lb->cnt - 1; // the lbr itself is not looked up
+    int nTodo     = 0;
+    struct timespec start;
+    time_t now = localAsUtc(time(NULL));
+
+    timespec_get(&start, TIME_UTC);
+    fileMeta_t *meta  = calloc(n > 0 ? n : 1, sizeof(fileMeta_t));
+    fileMeta_t *todo  = calloc(n > 0 ? n : 1, sizeof(fileMeta_t));
+    if (!meta || !todo) {
+        free(meta);
+        free(todo);
+        return errorMsg(lb, LBR_NOMEM, "out of memory\n");
+    }
+    for (int i = 0; i < n; i++) {
+        meta[i].path = items[i + 1].loc;
+        if (items[i + 1].kind != SRC_FILE)
+            continue;
+        if (items[i + 1].meta)
+            meta[i] = *items[i + 1].meta; // found by lbrAddPattern
+        else if (!lb->opts.shareStats || !lookupStat(&meta[i]))
+            todo[nTodo++].path = meta[i].path;
+    }
+    lb->stats.lookupMethod = statBatch(todo, nTodo);
+    for (int i = 0, j = 0; i < n; i++)
+        if (j < nTodo && meta[i].path == todo[j].path) {
+            meta[i] = todo[j++];
+            if (lb->opts.shareStats)
+                storeStat(&meta[i]);
+        }
+    lb->stats.lookups = nTodo;
+
+    int cnt  = 1;
+    bool ok  = true;
+    for (int i = 1; i <= n; i++) {
+        item_t *item  = &items[i];
+        fileMeta_t *f = &meta[i - 1];
+        if (item->kind != SRC_FILE)
+            setTimes(lb, item, NULL, now);
+        else if (f->err) {
+            lbrWarn(lb, "cannot find %s -- ignoring\n", item->loc);
+            if (!item->meta && ok) { // lbrPatch checks whether it has appeared
+                char **missing = realloc(lb->missing, (lb->nMissing + 1) * sizeof(char *));
+                if (missing) {
+                    lb->missing                 = missing;
+                    lb->missing[lb->nMissing++] = item->loc;
+                } else
+                    ok = errorMsg(lb, LBR_NOMEM, "out of memory\n");
+            }
+            continue;
+        } else {
+            item->fileSize  = f->size;
+            item->key.path  = item->loc;
+            item->key.dev   = f->dev;
+            item->key.ino   = f->ino;
+            item->key.size  = f->size;
+            item->key.mtime = f->mtimeNs;
+            item->changed   = f->ctimeNs;
+            setTimes(lb, item, f, now);
+        }
+        if (item->fileSize > MAXSIZE && !item->squeeze) { // squeezeItem checks the rest
+            ok = errorMsg(lb, LBR_TOOLARGE, "%s is too large, a member is limited to %zu bytes\n",
+                          item->loc, MAXSIZE);
+            continue;
+        }
+        item->secCnt = (uint16_t)((item->fileSize + 127) / 128);
+        items[cnt++] = *item;
+    }
+    free(meta);
+    free(todo);
+    if (!ok)
+        return false;
+    lb->cnt              = cnt;
+    lb->stats.lookupSecs = elapsed(&start);
+    if (cnt > MAXITEM)
+        return errorMsg(lb, LBR_TOOMANY, "Too many files, an lbr is limited to %d\n",
+                        MAXITEM - 1);
+    return true;
+}
+
+static void setName(lbr_t *lb, int i) {
+    char *s       = &lb->hdr[i][Name];
+    const char *t = lb->items[i].name;
+
+    memset(s, ' ', 11);
+    if (i == 0)
+        return;
+    for (int j = 0; j < 8 && *t && *t != '.'; j++)
+        *s++ = toupper(*t++);
+
+    if (*t && *t != '.')
+        lbrWarn(lb, "Truncating %s to 8 char name\n", lb->items[i].name);
+    while (*t && *t++ != '.')
+        ;
+    s = &lb->hdr[i][Ext];
+    for (int j = 0; j < 3 && *t; j++)
+        *s++ = toupper(*t++);
+
+    if (*t)
+        lbrWarn(lb, "Truncating %s to 3 char extent\n", lb->items[i].name);
+    if (lb->items[i].squeezed) { // the middle letter of the extension becomes Q
+        uint8_t *ext = &lb->hdr[i][Ext];
+        if (ext[0] == ' ')
+            memcpy(ext, "QQQ", 3);
+        else
+            ext[1] = 'Q';
+    }
+}
+
+static void setDate(uint8_t *d, time_t tval) {
+    // store the date in utc format, so what user enters matches
+    struct tm timestamp;
+    gmtime_r(&tval, &timestamp); // get raw utc time
+    uint16_t lbrDay =
+        (uint16_t)(tval / 86400 - CPMDAY0); //  adjust for CP/M day 0
+    uint16_t lbrTime =
+        (timestamp.tm_hour << 11) + (timestamp.tm_min << 5) + timestamp.tm_sec / 2;
+
+    // note lbr day and time are split
+    d[0] = lbrDay % 256;
+    d[1] = lbrDay / 256;
+    d[4] = lbrTime % 256;
+    d[5] = lbrTime / 256;
+}
+
+// the times of the library itself, by default those of its newest member
+static void setLbrTimes(lbr_t *lb, bool warn) {
+    item_t *items = lb->items;
+
+    items[0].mtime = items[0].reqMtime;
+    items[0].ctime = items[0].reqCtime;
+    if (items[0].mtime < 0) {
+        for (int i = 1; i < lb->cnt; i++)
+            if (items[0].mtime < items[i].mtime)
+                items[0].mtime = items[i].mtime;
+        if (items[0].mtime < 0)
+            items[0].mtime = time(NULL);
+    }
+    if (items[0].ctime < 0)
+        items[0].ctime = items[0].mtime;
+    else if (items[0].ctime > items[0].mtime) {
+        if (warn)
+            lbrWarn(lb, "library create time later than modify time, setting to modify time\n");
+        items[0].ctime = items[0].mtime;
+    }
+}
+
+// directory entries for cnt items, with the reserve option's unused entries, whole sectors
+static int dirEntries(lbr_t const *lb, int cnt) {
+    int n = lb->opts.reserve > 0 ? cnt + lb->opts.reserve : cnt;
+    if (n > MAXITEM)
+        n = cnt > MAXITEM ? cnt : MAXITEM;
+    return (n + 3) / 4 * 4;
+}
+
+static bool initHdr(lbr_t *lb) {
+    item_t *items  = lb->items;
+    int cnt        = lb->cnt;
+    uint32_t index = 0;
+    lb->entries    = dirEntries(lb, cnt);
+    items[0].fileSize = lb->entries * DIRSIZE;
+    items[0].secCnt   = lb->entries * DIRSIZE / 128;
+
+    if ((lb->hdr = calloc(lb->entries, DIRSIZE)) == NULL)
+        return errorMsg(lb, LBR_NOMEM, "out of memory\n");
+    dir_t *hdr = lb->hdr;
+
+    setLbrTimes(lb, true);
+
+    for (int i = 0; i < cnt; i++) {
+        if (index > 0xffff) // sector index is 16 bits
+            return errorMsg(lb, LBR_TOOLARGE, "Library too large, %s is beyond the 8M limit\n",
+                            items[i].loc);
+        hdr[i][Status] = 0;
+        setName(lb, i);
+        setDate(&hdr[i][CreateDate], items[i].ctime);
+        setDate(&hdr[i][ChangeDate], items[i].mtime);
+        if (items[i].dupOf) { // shares the sectors of the member it duplicates
+            memcpy(&hdr[i][Index], &hdr[items[i].dupOf][Index], 4);
+            hdr[i][PadCnt] = hdr[items[i].dupOf][PadCnt];
+            continue;
+        }
+        hdr[i][Index]      = index % 256;
+        hdr[i][Index + 1]  = index / 256;
+        hdr[i][Length]     = items[i].secCnt % 256;
+        hdr[i][Length + 1] = items[i].secCnt / 256;
+        hdr[i][PadCnt]     = (uint8_t)(items[i].secCnt * 128 - items[i].fileSize);
+        index += items[i].secCnt;
+    }
+
+    for (int i = cnt; i < lb->entries; i++)
+        hdr[i][0] = 0xff;
+
+    // different source names, from patterns in particular, can give the same CP/M name
+    lbrDir_t d  = { hdr, cnt };
+    bool unique = true;
+    if (!indexDir(&d) && d.noMem)
+        unique = errorMsg(lb, LBR_NOMEM, "out of memory\n");
+    else if (!d.noMem)
+        for (int i = 1; i < cnt; i++) {
+            int j = findEntry(&d, &hdr[i][Name]);
+            if (j != i) {
+                char cpmName[13];
+                unpackName(cpmName, &hdr[i][Name]);
+                unique = errorMsg(lb, LBR_DUPNAME, "%s and %s both map to CP/M name %s\n",
+                                  items[j].loc, items[i].loc, cpmName);
+            }
+        }
+    free(d.hash);
+    return unique;
+}
+
+/*
+ * reading members. A file member that fits the copy buffer is read whole with readWhole,
+ * larger ones with stdio, memory members are copied and callback members read through
+ * their callback
+ */
+typedef struct {
+    FILE *fp;   // large file members
+    size_t pos; // memory members
+} reader_t;
+
+// read the whole of file item i into buf
+static bool readFile(lbr_t *lb, int i, uint8_t *buf, size_t len, ioCount_t *io) {
+    io->opens++;
+    switch (readWhole(lb->items[i].loc, buf, len)) {
+    case VEC_OK:
+        return true;
+    case VEC_OPENERR:
+        return errorMsg(lb, LBR_READ, "cannot read %s\n", lb->items[i].loc);
+    default:
+        return errorMsg(lb, LBR_READ, "error reading %s\n", lb->items[i].loc);
+    }
+}
+
+static bool openSource(lbr_t *lb, int i, reader_t *r, ioCount_t *io) {
+    r->fp  = NULL;
+    r->pos = 0;
+    if (lb->items[i].kind != SRC_FILE || lb->items[i].fileSize <= lb->opts.ioBufSize)
+        return true; // a small file is read by readChunk
+    io->opens++;
+    if ((r->fp = fopen(lb->items[i].loc, "rb")) == NULL)
+        return errorMsg(lb, LBR_READ, "cannot read %s\n", lb->items[i].loc);
+    return true;
+}
+
+static void closeSource(reader_t *r) {
+    if (r->fp)
+        fclose(r->fp);
+}
+
+// read exactly len bytes through item's callback
+static bool readCallback(item_t const *item, uint8_t *buf, size_t len) {
+    for (size_t done = 0; done < len;) {
+        long n = item->read(item->ctx, buf + done, len - done);
+        if (n <= 0)
+            return false;
+        done += n;
+    }
+    return true;
+}
+
+// account for the chunk read into buf, padding the last sector with 0x1a
+static bool padChunk(uint8_t *buf, size_t chunk, size_t *remaining, size_t *len) {
+    *remaining -= chunk;
+    if (*remaining == 0 && chunk % 128) {
+        memset(buf + chunk, 0x1a, 128 - chunk % 128);
+        chunk += 128 - chunk % 128;
+    }
+    *len = chunk;
+    return true;
+}
+
+// read the next chunk of item i into buf, padding the last sector with 0x1a
+// sets *len to the padded length of the chunk
+static bool readChunk(lbr_t *lb, int i, reader_t *r, uint8_t *buf, size_t *remaining,
+                      size_t *len, ioCount_t *io) {
+    item_t const *item = &lb->items[i];
+    size_t chunk       = *remaining < lb->opts.ioBufSize ? *remaining : lb->opts.ioBufSize;
+    bool ok            = true;
+
+    io->reads++;
+    io->bytesRead += chunk;
+    if (item->kind == SRC_FILE && !r->fp) // the whole file, see openSource
+        return readFile(lb, i, buf, chunk, io) && padChunk(buf, chunk, remaining, len);
+    if (item->kind == SRC_FILE)
+        ok = fread(buf, 1, chunk, r->fp) == chunk;
+    else if (item->kind == SRC_MEM) {
+        memcpy(buf, item->data + r->pos, chunk);
+        r->pos += chunk;
+    } else
+        ok = readCallback(item, buf, chunk);
+    if (!ok)
+        return errorMsg(lb, LBR_READ, "error reading %s\n", item->loc);
+    return padChunk(buf, chunk, remaining, len);
+}
+
+/*
+ * squeeze phase. Members marked to be squeezed are compressed by a pool of jobs threads,
+ * each claiming the next item, before the header is built, as the offsets depend on the
+ * squeezed sizes. The squeezed data is kept in memory for the copy, and a member that
+ * does not get smaller is stored as it is, under its own name
+ */
+static bool squeezeItem(lbr_t *lb, int i, ioCount_t *io) {
+    item_t *item  = &lb->items[i];
+    uint8_t *data = (uint8_t *)item->data;
+    uint8_t name11[11];
+    char name[13];
+    uint8_t *sq;
+    size_t sqLen;
+
+    if (item->kind != SRC_MEM) {
+        if ((data = malloc(item->fileSize ? item->fileSize : 1)) == NULL)
+            return errorMsg(lb, LBR_NOMEM, "out of memory\n");
+        io->reads++;
+        io->bytesRead += item->fileSize;
+        bool ok = item->kind == SRC_FILE
+                      ? readFile(lb, i, data, item->fileSize, io)
+                      : readCallback(item, data, item->fileSize) ||
+                            errorMsg(lb, LBR_READ, "error reading %s\n", item->loc);
+        if (!ok) {
+            free(data);
+            return false;
+        }
+        if (item->kind == SRC_CALLBACK) { // a callback can only be read once
+            item->kind     = SRC_MEM;
+            item->data     = data;
+            item->ownsData = true;
+        }
+    }
+    packName(name11, item->name);
+    unpackName(name, name11);
+    if (!squeeze(data, item->fileSize, name, &sq, &sqLen)) {
+        if (data != item->data)
+            free(data);
+        return errorMsg(lb, LBR_NOMEM, "out of memory\n");
+    }
+    if (data != item->data)
+        free(data);
+    if (sqLen >= item->fileSize) {
+        free(sq);
+        return item->fileSize <= MAXSIZE ||
+               errorMsg(lb, LBR_TOOLARGE, "%s is too large, a member is limited to %zu bytes\n",
+                        item->loc, MAXSIZE);
+    }
+    if (sqLen > MAXSIZE) {
+        free(sq);
+        return errorMsg(lb, LBR_TOOLARGE,
+                        "%s is too large squeezed, a member is limited to %zu bytes\n", item->loc,
+                        MAXSIZE);
+    }
+    io->squeezeIn += item->fileSize;
+    io->squeezeOut += sqLen;
+    if (item->ownsData)
+        free((void *)item->data);
+    item->kind     = SRC_MEM;
+    item->data     = sq;
+    item->ownsData = true;
+    item->squeezed = true;
+    item->fileSize = sqLen;
+    item->secCnt   = (uint16_t)((sqLen + 127) / 128);
+    return true;
+}
+
+static int squeezeWorker(void *arg) {
+    lbr_t *lb    = arg;
+    ioCount_t io = { 0 };
+
+    for (;;) {
+        mtx_lock(&lb->dispatchLock);
+        while (lb->nextSqueeze < lb->cnt && !lb->items[lb->nextSqueeze].squeeze)
+            lb->nextSqueeze++;
+        int i = lb->nextSqueeze < lb->cnt && !lb->abort ? lb->nextSqueeze++ : lb->cnt;
+        mtx_unlock(&lb->dispatchLock);
+        if (i >= lb->cnt || !squeezeItem(lb, i, &io))
+            break;
+    }
+    mtx_lock(&lb->dispatchLock);
+    if (failed(lb))
+        lb->abort = true;
+    lb->io.bytesRead += io.bytesRead;
+    lb->io.reads += io.reads;
+    lb->io.opens += io.opens;
+    lb->io.squeezeIn += io.squeezeIn;
+    lb->io.squeezeOut += io.squeezeOut;
+    mtx_unlock(&lb->dispatchLock);
+    return 0;
+}
+
+static bool squeezeItems(lbr_t *lb) {
+    int nSqueeze    = 0;
+    thrd_t *threads = NULL;
+    int started     = 0;
+
+    setPhase(lb, PH_SQUEEZE);
+    for (int i = 1; i < lb->cnt; i++)
+        nSqueeze += lb->items[i].squeeze;
+    if (nSqueeze == 0)
+        return true;
+    int nThreads = lb->opts.jobs < nSqueeze ? lb->opts.jobs : nSqueeze;
+    lb->nextSqueeze = 1;
+    lb->abort       = false;
+    mtx_init(&lb->dispatchLock, mtx_plain);
+    if (nThreads > 1 && (threads = malloc((nThreads - 1) * sizeof(thrd_t))) != NULL)
+        while (started < nThreads - 1 &&
+               thrd_create(&threads[started], squeezeWorker, lb) == thrd_success)
+            started++;
+    squeezeWorker(lb); // calling thread squeezes too
+    for (int i = 0; i < started; i++)
+        thrd_join(threads[i], NULL);
+    free(threads);
+    mtx_destroy(&lb->dispatchLock);
+    return !failed(lb);
+}
+
+/*
+ * dedup phase, enabled by the dedup option. Members with the same data share one extent,
+ * their directory entries having the same index, length and CRC, so the data is written,
+ * and read and its CRC calculated, only once. Only members of the same size can match.
+ * Those that are the same file, by device, inode and modify time, match without being
+ * read, the others are read into memory, where they are then copied from, and matched on
+ * a hash of their data confirmed by comparing it. The first member of each set keeps the
+ * data
+ */
+typedef struct {
+    size_t size;
+    uint64_t hash;
+    int item;
+} dupKey_t;
+
+static int cmpDupKey(void const *a, void const *b) {
+    dupKey_t const *x = a, *y = b;
+    if (x->size != y->size)
+        return x->size < y->size ? -1 : 1;
+    if (x->hash != y->hash)
+        return x->hash < y->hash ? -1 : 1;
+    return x->item - y->item;
+}
+
+static bool sameFile(item_t const *a, item_t const *b) {
+    return a->kind == SRC_FILE && b->kind == SRC_FILE && a->key.dev == b->key.dev &&
+           a->key.ino == b->key.ino && a->key.mtime == b->key.mtime;
+}
+
+// read item i into memory if it is not there already
+static bool loadItem(lbr_t *lb, int i) {
+    item_t *item = &lb->items[i];
+    uint8_t *data;
+
+    if (item->kind == SRC_MEM)
+        return true;
+    if ((data = malloc(item->fileSize)) == NULL)
+        return errorMsg(lb, LBR_NOMEM, "out of memory\n");
+    lb->io.reads++;
+    lb->io.bytesRead += item->fileSize;
+    bool ok = item->kind == SRC_FILE
+                  ? readFile(lb, i, data, item->fileSize, &lb->io)
+                  : readCallback(item, data, item->fileSize) ||
+                        errorMsg(lb, LBR_READ, "error reading %s\n", item->loc);
+    if (!ok) {
+        free(data);
+        return false;
+    }
+    item->fromFile = item->kind == SRC_FILE;
+    item->kind     = SRC_MEM;
+    item->data     = data;
+    item->ownsData = true;
+    return true;
+}
+
+static void setDup(lbr_t *lb, int i, int of) {
+    lb->items[i].dupOf = lb->items[of].dupOf ? lb->items[of].dupOf : of;
+    lb->io.dedupBytes += lb->items[i].secCnt * 128;
+    lb->io.dedupMembers++;
+}
+
+static bool dedupItems(lbr_t *lb) {
+    int cnt = lb->cnt;
+    dupKey_t *keys;
+
+    setPhase(lb, PH_DEDUP);
+    if (!lb->opts.dedup || cnt < 3)
+        return true;
+    if ((keys = malloc((cnt - 1) * sizeof(dupKey_t))) == NULL)
+        return errorMsg(lb, LBR_NOMEM, "out of memory\n");
+    for (int i = 1; i < cnt; i++)
+        keys[i - 1] = (dupKey_t){ lb->items[i].fileSize, 0, i };
+    qsort(keys, cnt - 1, sizeof(dupKey_t), cmpDupKey);
+
+    bool ok = true;
+    for (int g = 0, end; ok && g < cnt - 1; g = end) {
+        for (end = g + 1; end < cnt - 1 && keys[end].size == keys[g].size; end++)
+            ;
+        if (end - g < 2 || keys[g].size == 0)
+            continue;
+        // the same file needs no reading, the rest of the group are hashed
+        int nHash = 0;
+        for (int j = g; j < end; j++) {
+            item_t *item = &lb->items[keys[j].item];
+            int k        = g;
+            while (k < j && !sameFile(&lb->items[keys[k].item], item))
+                k++;
+            if (k < j)
+                setDup(lb, keys[j].item, keys[k].item);
+            else
+                nHash++;
+        }
+        if (nHash < 2)
+            continue;
+        for (int j = g; ok && j < end; j++) {
+            item_t *item = &lb->items[keys[j].item];
+            if (item->dupOf)
+                keys[j].hash = ~0ull; // sorted after the others, and not compared
+            else if ((ok = loadItem(lb, keys[j].item))) {
+                uint64_t h = 14695981039346656037ull;
+                for (size_t n = 0; n < item->fileSize; n++)
+                    h = (h ^ item->data[n]) * 1099511628211ull; // FNV-1a
+                keys[j].hash = h == ~0ull ? 0 : h;
+            }
+        }
+        if (!ok)
+            break;
+        qsort(keys + g, end - g, sizeof(dupKey_t), cmpDupKey);
+        for (int j = g + 1; j < end && keys[j].hash != ~0ull; j++)
+            for (int k = j - 1; k >= g && keys[k].hash == keys[j].hash; k--) {
+                item_t *a = &lb->items[keys[k].item], *b = &lb->items[keys[j].item];
+                if (!a->dupOf && memcmp(a->data, b->data, a->fileSize) == 0) {
+                    setDup(lb, keys[j].item, keys[k].item);
+                    break;
+                }
+            }
+    }
+    free(keys);
+    return ok;
+}
+
+// duplicates share the CRC of the member they duplicate, once it is known
+static void setDupCrcs(lbr_t *lb) {
+    for (int i = 1; i < lb->cnt; i++)
+        if (lb->items[i].dupOf)
+            memcpy(&lb->hdr[i][Crc], &lb->hdr[lb->items[i].dupOf][Crc], 2);
+}
+
+static bool sinkWrite(lbr_t *lb, void const *buf, size_t len) {
+    sink_t *s = &lb->sink;
+    lb->stats.writes++;
+    lb->stats.bytesWritten += len;
+    if (s->fp)
+        return fwrite(buf, 1, len, s->fp) == len;
+    if (s->write)
+        return s->write(s->ctx, buf, len);
+    if (s->len + len > s->size) {
+        size_t size = s->size ? s->size : 0x10000;
+        while (s->len + len > size)
+            size *= 2;
+        uint8_t *mem = realloc(s->mem, size);
+        if (!mem)
+            return false;
+        s->mem  = mem;
+        s->size = size;
+    }
+    memcpy(s->mem + s->len, buf, len);
+    s->len += len;
+    return true;
+}
+
+static void setCrc(lbr_t *lb, int i, uint16_t crc) {
+    lb->hdr[i][Crc]     = crc % 256;
+    lb->hdr[i][Crc + 1] = crc / 256;
+}
+
+// crc16 of buf, timed when the options ask for the CRC speed
+static uint16_t countCrc(lbr_t *lb, ioCount_t *io, uint16_t crc, uint8_t const *buf,
+                         size_t len) {
+    if (!lb->opts.timing)
+        return crc16(crc, buf, len);
+    struct timespec start;
+    timespec_get(&start, TIME_UTC);
+    crc = crc16(crc, buf, len);
+    io->crcSecs += elapsed(&start);
+    io->crcBytes += len;
+    return crc;
+}
+
+// as mapCrc for item i, timed when the options ask for the CRC speed
+static bool countMapCrc(lbr_t *lb, int i, uint16_t *crc, ioCount_t *io) {
+    struct timespec start;
+    if (lb->opts.timing)
+        timespec_get(&start, TIME_UTC);
+    if (!mapCrc(lb->items[i].loc, lb->items[i].fileSize, lb->items[i].key.mtime, crc))
+        return false;
+    if (lb->opts.timing) {
+        io->crcSecs += elapsed(&start); // includes faulting the file in
+        io->crcBytes += lb->items[i].fileSize;
+    }
+    return true;
+}
+
+static bool writeChunk(lbr_t *lb, int i, uint8_t *buf, size_t len) {
+    if (!sinkWrite(lb, buf, len))
+        return errorMsg(lb, LBR_WRITE, "error writing %s to lbr\n", lb->items[i].loc);
+    return true;
+}
+
+// copy item i to the lbr in ioBufSize chunks using buf and record its CRC
+static bool copyMember(lbr_t *lb, int i, uint8_t *buf) {
+    item_t *item     = &lb->items[i];
+    uint16_t crc     = 0;
+    size_t remaining = item->fileSize;
+    reader_t r;
+    bool ok = openSource(lb, i, &r, &lb->io);
+    while (ok && remaining) {
+        size_t chunk;
+        if ((ok = readChunk(lb, i, &r, buf, &remaining, &chunk, &lb->io) &&
+                  writeChunk(lb, i, buf, chunk)) &&
+            !item->crcKnown)
+            crc = countCrc(lb, &lb->io, crc, buf, chunk);
+    }
+    closeSource(&r);
+    if (ok && !item->crcKnown)
+        setCrc(lb, i, crc);
+    return ok;
+}
+
+// copy item i using kernelCopy, falling back to copyMember if it is not supported
+static bool directCopy(lbr_t *lb, int i) {
+    uint64_t before = lb->stats.zcBytes;
+    item_t const *item = &lb->items[i];
+    switch (kernelCopy(item->loc, item->fileSize, item->key.mtime, lb->sink.fp,
+                       &lb->stats.zcBytes)) {
+    case ZC_OK:
+        lb->io.opens++;
+        lb->io.reads++;
+        lb->stats.writes++;
+        lb->io.bytesRead += lb->stats.zcBytes - before;
+        lb->stats.bytesWritten += lb->stats.zcBytes - before;
+        return true;
+    case ZC_UNSUPPORTED:
+        return copyMember(lb, i, lb->ioBuf); // recalculated CRC is the same
+    case ZC_READERR:
+        return errorMsg(lb, LBR_READ, "error reading %s\n", lb->items[i].loc);
+    default:
+        return errorMsg(lb, LBR_WRITE, "error writing %s to lbr\n", lb->items[i].loc);
+    }
+}
+
+/*
+ * CRC cache support, enabled by the crcCache option
+ * Before copying, file items whose CRC is in the cache have it set in the header, and the
+ * copy then skips calculating it. Afterwards the CRCs calculated are added to the cache,
+ * which the caller saves once all libraries are built.
+ */
+static void lookupCrcs(lbr_t *lb) {
+    for (int i = 1; i < lb->cnt; i++) {
+        uint16_t crc;
+        if (isFile(&lb->items[i]) && !lb->items[i].reuse &&
+            crcCacheLookup(&lb->items[i].key, &crc)) {
+            setCrc(lb, i, crc);
+            lb->items[i].crcKnown = true;
+        }
+    }
+}
+
+static bool storeCrcs(lbr_t *lb) {
+    for (int i = 1; i < lb->cnt; i++)
+        if (isFile(&lb->items[i]) && !lb->items[i].reuse && !lb->items[i].crcKnown &&
+            !crcCacheStore(&lb->items[i].key, WORD(&lb->hdr[i][Crc])))
+            return errorMsg(lb, LBR_NOMEM, "out of memory\n");
+    return true;
+}
+
+/*
+ * incremental support, enabled by the incremental option when finishing to a file
+ * An item is reused if the existing lbr has an entry with the same name, size and
+ * timestamps, in which case its sectors and CRC are copied from there. As the new lbr
+ * is written to a temporary file, the existing one can be read while building.
+ * The entry only shows the file was the same size with the same 2 second dates, so the
+ * file must also be unchanged: its CRC in the CRC cache, keyed on its identity, matching
+ * the entry's, or with its times taken from the file, the file not modified or changed
+ * since the existing lbr was written. Other members are always written again.
+ */
+static bool unchanged(lbr_t *lb, item_t const *item, dir_t const *old) {
+    if (!item->key.path) // not a file member
+        return false;
+    if (item->crcKnown && !item->squeezed)
+        return WORD(&(*old)[Crc]) == WORD(&lb->hdr[item - lb->items][Crc]);
+    return item->reqMtime == -1 && item->reqCtime == -1 && item->changed < lb->oldTime &&
+           item->key.mtime < lb->oldTime;
+}
+
+static void findReusable(lbr_t *lb) {
+    lbrDir_t *oldDir = &lb->oldDir;
+    dir_t *hdr       = lb->hdr;
+
+    lb->stats.reused = 0;
+    for (int i = 1; i < lb->cnt; i++) {
+        int j = findEntry(oldDir, &hdr[i][Name]);
+        lb->items[i].reuse =
+            j && !lb->items[i].dupOf && memcmp(&oldDir->dir[j][Length], &hdr[i][Length], 2) == 0 &&
+                    oldDir->dir[j][PadCnt] == hdr[i][PadCnt] &&
+                    memcmp(&oldDir->dir[j][CreateDate], &hdr[i][CreateDate], 8) == 0 &&
+                    unchanged(lb, &lb->items[i], &oldDir->dir[j])
+                ? j
+                : 0;
+        if (lb->items[i].reuse)
+            lb->stats.reused++;
+    }
+}
+
+static bool copyOld(lbr_t *lb, int i) {
+    dir_t *old       = &lb->oldDir.dir[lb->items[i].reuse];
+    size_t remaining = WORD(&(*old)[Length]) * 128;
+
+    if (fseek(lb->oldFp, WORD(&(*old)[Index]) * 128L, SEEK_SET) != 0)
+        return errorMsg(lb, LBR_READ, "cannot reuse %s from existing library\n",
+                        lb->items[i].loc);
+    while (remaining) {
+        size_t chunk = remaining < lb->opts.ioBufSize ? remaining : lb->opts.ioBufSize;
+        lb->io.reads++;
+        lb->io.bytesRead += chunk;
+        if (fread(lb->ioBuf, 1, chunk, lb->oldFp) != chunk)
+            return errorMsg(lb, LBR_READ, "cannot reuse %s from existing library\n",
+                            lb->items[i].loc);
+        if (!writeChunk(lb, i, lb->ioBuf, chunk))
+            return false;
+        remaining -= chunk;
+    }
+    memcpy(&lb->hdr[i][Crc], &(*old)[Crc], 2);
+    return true;
+}
+
+/*
+ * small members, padded to at most a quarter of the copy buffer, are batched when writing
+ * to a file or stream. File and callback members are read into the copy buffer, memory
+ * members used where they are with only their padded last sector copied, and the batch is
+ * written with one vectored write when the buffer fills or a larger member follows, so a
+ * run of small files costs an open, read and close each and a write per batch
+ */
+static bool isSmall(lbr_t *lb, item_t const *item) {
+    return lb->sink.fp && !item->reuse && item->secCnt * (size_t)128 <= lb->opts.ioBufSize / 4;
+}
+
+static bool flushBatch(lbr_t *lb, vecBatch_t *b) {
+    if (!b->n)
+        return true;
+    lb->stats.writes++;
+    lb->stats.bytesWritten += b->len;
+    if (!vecWrite(b, lb->sink.fp))
+        return errorMsg(lb, LBR_WRITE, "error writing library\n");
+    return true;
+}
+
+// add small item i to the batch, *used being the part of the copy buffer it holds
+static bool batchMember(lbr_t *lb, int i, vecBatch_t *b, size_t *used) {
+    item_t *item = &lb->items[i];
+    size_t len   = item->secCnt * 128;
+    size_t full  = item->kind == SRC_MEM ? item->fileSize & ~(size_t)127 : 0; // used in place
+    uint16_t crc = 0;
+
+    if (*used + len - full > lb->opts.ioBufSize || vecFull(b)) {
+        if (!flushBatch(lb, b))
+            return false;
+        *used = 0;
+    }
+    uint8_t *buf = lb->ioBuf + *used;
+    if (item->fileSize) { // an empty member is not opened
+        lb->io.reads++;
+        lb->io.bytesRead += item->fileSize;
+        if (item->kind == SRC_FILE) {
+            if (!readFile(lb, i, buf, item->fileSize, &lb->io))
+                return false;
+        } else if (item->kind == SRC_CALLBACK) {
+            if (!readCallback(item, buf, item->fileSize))
+                return errorMsg(lb, LBR_READ, "error reading %s\n", item->loc);
+        } else {
+            vecAdd(b, item->data, full);
+            if (!item->crcKnown)
+                crc = countCrc(lb, &lb->io, crc, item->data, full);
+            memcpy(buf, item->data + full, item->fileSize - full);
+        }
+    }
+    memset(buf + item->fileSize - full, 0x1a, len - item->fileSize);
+    vecAdd(b, buf, len - full);
+    *used += len - full;
+    if (!item->crcKnown)
+        setCrc(lb, i, countCrc(lb, &lb->io, crc, buf, len - full));
+    return true;
+}
+
+static bool copySerial(lbr_t *lb) {
+    vecBatch_t batch = { 0 };
+    size_t used      = 0;
+
+    for (int i = 1; i < lb->cnt; i++) {
+        item_t *item = &lb->items[i];
+        uint16_t crc = WORD(&lb->hdr[i][Crc]);
+        bool ok;
+        if (item->dupOf) // shares the data already written
+            continue;
+        if (isSmall(lb, item)) {
+            if (!batchMember(lb, i, &batch, &used))
+                return false;
+            continue;
+        }
+        if (!flushBatch(lb, &batch))
+            return false;
+        used = 0;
+        if (item->reuse)
+            ok = copyOld(lb, i);
+        else if (lb->zeroCopy && isFile(item) &&
+                 (item->crcKnown || countMapCrc(lb, i, &crc, &lb->io))) {
+            setCrc(lb, i, crc);
+            ok = directCopy(lb, i);
+        } else
+            ok = copyMember(lb, i, lb->ioBuf);
+        if (!ok)
+            return false;
+    }
+    return flushBatch(lb, &batch);
+}
+
+/*
+ * parallel copy, used when jobs > 1
+ * Each worker claims the next unclaimed item, reads it and calculates its CRC, handing the
+ * chunks to the writer through its own two slot queue. The writer, the calling thread,
+ * takes the items in order from whichever worker claimed them, so the lbr is written
+ * sequentially. As a worker only blocks waiting for the writer to drain its own queue, the
+ * worker holding the item being written can always progress. Memory use is limited to 2
+ * buffers per worker. On an error the copy is abandoned by setting the abort flags, which
+ * every wait checks.
+ */
+static void abortCopy(lbr_t *lb) {
+    mtx_lock(&lb->dispatchLock);
+    lb->abort = true;
+    cnd_broadcast(&lb->dispatched);
+    mtx_unlock(&lb->dispatchLock);
+    for (int j = 0; j < lb->nWorkers; j++) {
+        worker_t *w = &lb->workers[j];
+        mtx_lock(&w->lock);
+        w->abort = true;
+        cnd_broadcast(&w->changed);
+        mtx_unlock(&w->lock);
+    }
+}
+
+static int readWorker(void *arg) {
+    worker_t *w   = arg;
+    lbr_t *lb     = w->lb;
+    item_t *items = lb->items;
+    int cnt       = lb->cnt;
+    int slot      = 0;
+
+    for (;;) {
+        mtx_lock(&lb->dispatchLock);
+        // the writer copies reused members, and duplicates are not written
+        while (lb->nextItem < cnt && (items[lb->nextItem].reuse || items[lb->nextItem].dupOf))
+            lb->nextItem++;
+        int i = lb->nextItem < cnt && !lb->abort ? lb->nextItem++ : cnt;
+        if (i < cnt) {
+            lb->owner[i] = (int)(w - lb->workers);
+            cnd_broadcast(&lb->dispatched);
+        }
+        mtx_unlock(&lb->dispatchLock);
+        if (i >= cnt)
+            return 0;
+
+        uint16_t crc     = 0;
+        bool known       = items[i].crcKnown;
+        bool direct      = lb->zeroCopy && isFile(&items[i]) &&
+                      (known || countMapCrc(lb, i, &crc, &w->io));
+        size_t remaining = direct ? 0 : items[i].fileSize;
+        reader_t r       = { NULL };
+        bool ok          = direct || openSource(lb, i, &r, &w->io);
+        while (ok) { // empty and direct items still pass a last chunk to the writer
+            mtx_lock(&w->lock);
+            while (w->filled == 2 && !w->abort)
+                cnd_wait(&w->changed, &w->lock);
+            ok = !w->abort;
+            mtx_unlock(&w->lock);
+
+            size_t chunk = 0;
+            if (!ok ||
+                (!direct && !(ok = readChunk(lb, i, &r, w->buf[slot], &remaining, &chunk, &w->io))))
+                break;
+            if (!known)
+                crc = countCrc(lb, &w->io, crc, w->buf[slot], chunk);
+            w->len[slot]    = chunk;
+            w->last[slot]   = remaining == 0;
+            w->direct[slot] = direct;
+
+            mtx_lock(&w->lock);
+            w->filled++;
+            cnd_signal(&w->changed);
+            mtx_unlock(&w->lock);
+            slot ^= 1;
+            if (remaining == 0)
+                break;
+        }
+        closeSource(&r);
+        if (!ok) {
+            abortCopy(lb);
+            return 0;
+        }
+        if (!known)
+            setCrc(lb, i, crc);
+    }
+}
+
+static bool copyParallel(lbr_t *lb) {
+    int cnt      = lb->cnt;
+    int nWorkers = lb->opts.jobs < cnt - 1 ? lb->opts.jobs : cnt - 1;
+    int started  = 0;
+    bool ok      = true;
+
+    lb->workers  = calloc(nWorkers, sizeof(worker_t));
+    lb->owner    = malloc(cnt * sizeof(int));
+    lb->nextItem = 1;
+    lb->abort    = false;
+    if (!lb->workers || !lb->owner) {
+        free(lb->workers);
+        free(lb->owner);
+        return errorMsg(lb, LBR_NOMEM, "out of memory\n");
+    }
+    for (int i = 0; i < cnt; i++)
+        lb->owner[i] = -1;
+    mtx_init(&lb->dispatchLock, mtx_plain);
+    cnd_init(&lb->dispatched);
+    // all workers are set up before any start, as an abort touches them all
+    for (lb->nWorkers = 0; lb->nWorkers < nWorkers; lb->nWorkers++) {
+        worker_t *w = &lb->workers[lb->nWorkers];
+        w->lb       = lb;
+        mtx_init(&w->lock, mtx_plain);
+        cnd_init(&w->changed);
+        if (!(w->buf[0] = malloc(lb->opts.ioBufSize)) || !(w->buf[1] = malloc(lb->opts.ioBufSize))) {
+            ok = errorMsg(lb, LBR_NOMEM, "cannot allocate %zu byte buffers\n", lb->opts.ioBufSize);
+            lb->nWorkers++;
+            break;
+        }
+    }
+    for (; ok && started < lb->nWorkers; started++)
+        if (thrd_create(&lb->workers[started].thread, readWorker, &lb->workers[started]) !=
+            thrd_success)
+            ok = errorMsg(lb, LBR_NOMEM, "cannot create worker thread\n");
+
+    for (int i = 1; ok && i < cnt; i++) {
+        if (lb->items[i].dupOf)
+            continue;
+        if (lb->items[i].reuse) {
+            ok = copyOld(lb, i);
+            continue;
+        }
+        mtx_lock(&lb->dispatchLock);
+        while (lb->owner[i] < 0 && !lb->abort)
+            cnd_wait(&lb->dispatched, &lb->dispatchLock);
+        worker_t *w = lb->abort ? NULL : &lb->workers[lb->owner[i]];
+        mtx_unlock(&lb->dispatchLock);
+        if (!w) {
+            ok = false;
+            break;
+        }
+
+        bool last = false;
+        while (ok && !last) {
+            mtx_lock(&w->lock);
+            while (w->filled == 0 && !w->abort)
+                cnd_wait(&w->changed, &w->lock);
+            ok = !w->abort;
+            mtx_unlock(&w->lock);
+            if (!ok)
+                break;
+
+            if (!w->direct[w->head])
+                ok = writeChunk(lb, i, w->buf[w->head], w->len[w->head]);
+            else
+                ok = directCopy(lb, i);
+            last = w->last[w->head];
+
+            mtx_lock(&w->lock);
+            w->head ^= 1;
+            w->filled--;
+            cnd_signal(&w->changed);
+            mtx_unlock(&w->lock);
+        }
+    }
+    if (!ok)
+        abortCopy(lb);
+
+    for (int j = 0; j < lb->nWorkers; j++) {
+        worker_t *w = &lb->workers[j];
+        if (j < started)
+            thrd_join(w->thread, NULL);
+        lb->io.bytesRead += w->io.bytesRead;
+        lb->io.reads += w->io.reads;
+        lb->io.opens += w->io.opens;
+        lb->io.crcBytes += w->io.crcBytes;
+        lb->io.crcSecs += w->io.crcSecs;
+        mtx_destroy(&w->lock);
+        cnd_destroy(&w->changed);
+        free(w->buf[0]);
+        free(w->buf[1]);
+    }
+    mtx_destroy(&lb->dispatchLock);
+    cnd_destroy(&lb->dispatched);
+    free(lb->workers);
+    free(lb->owner);
+    lb->workers  = NULL;
+    lb->owner    = NULL;
+    lb->nWorkers = 0;
+    return ok && !failed(lb);
+}
+
+/*
+ * a write callback, pipe or other stream gets the library in one pass, so the header, with
+ * the CRCs, has to be complete before any member is written. The CRC of every member not
+ * already known from the CRC cache is calculated first, over a mapping of the file where
+ * supported. As a callback can only be read once those members are kept in memory for the
+ * copy
+ */
+static bool calcCrcs(lbr_t *lb) {
+    for (int i = 1; i < lb->cnt; i++) {
+        item_t *item = &lb->items[i];
+        if (item->crcKnown || item->reuse || item->dupOf)
+            continue;
+        if (item->kind == SRC_CALLBACK) {
+            uint8_t *data = malloc(item->fileSize ? item->fileSize : 1);
+            if (!data)
+                return errorMsg(lb, LBR_NOMEM, "out of memory\n");
+            if (!readCallback(item, data, item->fileSize)) {
+                free(data);
+                return errorMsg(lb, LBR_READ, "error reading %s\n", item->loc);
+            }
+            item->kind     = SRC_MEM;
+            item->data     = data;
+            item->ownsData = true;
+        }
+        size_t remaining = item->fileSize;
+        uint16_t crc     = 0;
+        reader_t r       = { NULL };
+        bool ok          = item->kind == SRC_FILE && countMapCrc(lb, i, &crc, &lb->io);
+        if (ok)
+            remaining = 0;
+        else
+            ok = openSource(lb, i, &r, &lb->io);
+        while (ok && remaining) {
+            size_t chunk;
+            if ((ok = readChunk(lb, i, &r, lb->ioBuf, &remaining, &chunk, &lb->io)))
+                crc = countCrc(lb, &lb->io, crc, lb->ioBuf, chunk);
+        }
+        closeSource(&r);
+        if (!ok)
+            return false;
+        setCrc(lb, i, crc);
+        if (isFile(item) && lb->opts.crcCache && !crcCacheStore(&item->key, crc))
+            return errorMsg(lb, LBR_NOMEM, "out of memory\n");
+        item->crcKnown = true;
+    }
+    return true;
+}
+
+/*
+ * other than in one pass, the header is written once, after the members. As initHdr fixes
+ * the size of the library, a file is preallocated to it and a memory buffer allocated
+ * at its full size, the members being written after the space left for the header
+ */
+static bool reserveSink(lbr_t *lb) {
+    sink_t *s      = &lb->sink;
+    size_t size    = lb->items[0].fileSize;
+    size_t hdrSize = lb->entries * DIRSIZE;
+
+    if (s->fp) {
+        if (!preallocate(s->fp, size))
+            return errorMsg(lb, LBR_WRITE, "no space for the %zu byte library\n", size);
+        if (fseek(s->fp, (long)hdrSize, SEEK_SET) != 0)
+            return errorMsg(lb, LBR_WRITE, "cannot write header\n");
+        return true;
+    }
+    if ((s->mem = malloc(size)) == NULL)
+        return errorMsg(lb, LBR_NOMEM, "out of memory\n");
+    s->size = size;
+    s->len  = hdrSize;
+    return true;
+}
+
+// write the members to the sink and the header with its CRC, before them in one pass
+static bool writeLbr(lbr_t *lb) {
+    size_t hdrSize;
+
+    setPhase(lb, PH_HEADER);
+    if (!initHdr(lb))
+        return false;
+    if (lb->opts.crcCache) // first, as a cached CRC shows a file is unchanged
+        lookupCrcs(lb);
+    if (lb->oldFp)
+        findReusable(lb);
+    hdrSize               = lb->entries * DIRSIZE;
+    lb->items[0].fileSize = 0;
+    for (int i = 0; i < lb->cnt; i++)
+        if (!lb->items[i].dupOf)
+            lb->items[0].fileSize += lb->items[i].secCnt * 128;
+    if ((lb->ioBuf = malloc(lb->opts.ioBufSize)) == NULL)
+        return errorMsg(lb, LBR_NOMEM, "cannot allocate %zu byte buffer\n", lb->opts.ioBufSize);
+    lb->zeroCopy = lb->opts.zeroCopy && lb->sink.fp;
+    setPhase(lb, PH_COPY);
+    if (lb->onePass) {
+        if (!calcCrcs(lb))
+            return false;
+        setDupCrcs(lb);
+        setCrc(lb, 0, countCrc(lb, &lb->io, 0, lb->hdr[0], hdrSize));
+        if (!sinkWrite(lb, lb->hdr, hdrSize))
+            return errorMsg(lb, LBR_WRITE, "cannot write header\n");
+    } else if (!reserveSink(lb))
+        return false;
+    bool ok = lb->opts.jobs > 1 && lb->cnt > 2 ? copyParallel(lb) : copySerial(lb);
+    free(lb->ioBuf);
+    lb->ioBuf = NULL;
+    if (!ok)
+        return false;
+    setPhase(lb, PH_FINISH);
+    setDupCrcs(lb);
+    if (lb->opts.crcCache && !storeCrcs(lb))
+        return false;
+    if (lb->onePass)
+        return true;
+    // now calculate the headers own CRC and write it
+    setCrc(lb, 0, countCrc(lb, &lb->io, 0, lb->hdr[0], hdrSize));
+    lb->stats.writes++;
+    lb->stats.bytesWritten += hdrSize;
+    if (lb->sink.mem) {
+        memcpy(lb->sink.mem, lb->hdr, hdrSize);
+        return true;
+    }
+    if (!writeAt(lb->sink.fp, lb->hdr, hdrSize, 0))
+        return errorMsg(lb, LBR_WRITE, "cannot write header\n");
+    return true;
+}
+
+/*
+ * a library file is built in a temporary file in the same directory, preallocated by
+ * writeLbr, then renamed over the library, so that a failed build leaves the existing
+ * library as it was and readers never see a partial one. With the fsync option the
+ * temporary file, and then the directory, are flushed to disk first
+ * a pipe or device, which may already exist, is written in one pass
+ */
+static bool buildLbr(lbr_t *lb) {
+    const char *lbrname = lb->items[0].loc;
+    char *tmpName       = NULL;
+    struct stat st;
+    bool ok;
+
+    setPhase(lb, PH_HEADER);
+    lb->onePass = stat(lbrname, &st) == 0 && !S_ISREG(st.st_mode);
+    if (lb->onePass)
+        lb->sink.fp = fopen(lbrname, "wb");
+    else {
+        if (lb->opts.incremental && (lb->oldFp = fopen(lbrname, "rb")) &&
+            !readDir(&lb->oldDir, lb->oldFp)) {
+            fclose(lb->oldFp);
+            lb->oldFp = NULL;
+            if (lb->oldDir.noMem)
+                return errorMsg(lb, LBR_NOMEM, "out of memory\n");
+            lbrWarn(lb, "%s is not a valid library, rebuilding\n", lbrname);
+        }
+        if (lb->oldFp) {
+            fileMeta_t old = { 0 };
+            if (fstat(fileno(lb->oldFp), &st) == 0)
+                setMeta(&old, &st);
+            lb->oldTime = old.ctimeNs;
+        }
+        lb->sink.fp = createTemp(lbrname, &tmpName);
+    }
+    if (!lb->sink.fp)
+        ok = errorMsg(lb, LBR_WRITE, "cannot create %s\n", lbrname);
+    else {
+        ok = writeLbr(lb);
+        if (ok && tmpName && lb->items[0].mtime)
+            setFileTime(tmpName, lb->items[0].mtime);
+        if (ok && tmpName && lb->opts.fsync != LBR_FSYNC_NONE && !syncFile(lb->sink.fp))
+            ok = errorMsg(lb, LBR_WRITE, "cannot flush %s to disk\n", tmpName);
+        if (fclose(lb->sink.fp) != 0 && ok)
+            ok = errorMsg(lb, LBR_WRITE, "error writing %s\n", tmpName ? tmpName : lbrname);
+        lb->sink.fp = NULL;
+    }
+    if (lb->oldFp) { // closed first, as windows cannot replace an open file
+        fclose(lb->oldFp);
+        lb->oldFp = NULL;
+        freeDir(&lb->oldDir);
+    }
+    if (tmpName) {
+        if (ok && !replaceFile(tmpName, lbrname, lb->opts.fsync == LBR_FSYNC_FULL))
+            ok = errorMsg(lb, LBR_WRITE, "cannot replace %s with %s\n", lbrname, tmpName);
+        if (!ok)
+            remove(tmpName); // gone already if only the directory flush failed
+        free(tmpName);
+    }
+    return ok;
+}
+
+/*
+ * library cache, enabled by the lbrCache option when finishing to a file, see lbrcache.c
+ * The key covers the options that change the library, its times and each member's name,
+ * times, squeeze flag and a fingerprint of its data, for a file the identity the CRC cache
+ * uses, for a memory member a hash of the data. A callback member cannot be fingerprinted
+ * without reading it, so a library with one is not cached, nor is one taking the current
+ * time as it has no newer member
+ */
+static bool cacheKey(lbr_t *lb) {
+    item_t *items = lb->items;
+    time_t newest = -1;
+    uint8_t flags = lb->opts.dedup;
+
+    for (int i = 1; i < lb->cnt; i++) {
+        if (items[i].kind == SRC_CALLBACK)
+            return false;
+        if (items[i].mtime > newest)
+            newest = items[i].mtime;
+    }
+    if (items[0].mtime < 0) { // as initHdr would set it
+        if (newest < 0)
+            return false;
+        items[0].mtime = newest;
+    }
+    lbrKeyInit(&lb->key);
+    lbrKeyAdd(&lb->key, "mklbr 1", 8); // changed if the library layout changes
+    lbrKeyAdd(&lb->key, &flags, 1);
+    lbrKeyAdd(&lb->key, &lb->opts.reserve, sizeof(int));
+    lbrKeyAdd(&lb->key, &items[0].mtime, sizeof(time_t));
+    lbrKeyAdd(&lb->key, &items[0].ctime, sizeof(time_t));
+    for (int i = 1; i < lb->cnt; i++) {
+        item_t *item = &items[i];
+        flags        = item->squeeze;
+        lbrKeyAdd(&lb->key, item->name, strlen(item->name) + 1);
+        lbrKeyAdd(&lb->key, &item->mtime, sizeof(time_t));
+        lbrKeyAdd(&lb->key, &item->ctime, sizeof(time_t));
+        lbrKeyAdd(&lb->key, &flags, 1);
+        lbrKeyAdd(&lb->key, &item->fileSize, sizeof(size_t));
+        if (item->kind == SRC_FILE) {
+            lbrKeyAdd(&lb->key, &item->key.dev, sizeof(uint64_t));
+            lbrKeyAdd(&lb->key, &item->key.ino, sizeof(uint64_t));
+            lbrKeyAdd(&lb->key, &item->key.mtime, sizeof(int64_t));
+        } else
+            lbrKeyAdd(&lb->key, item->data, item->fileSize);
+    }
+    return lb->keyed = true;
+}
+
+// put the cached library in place, returning false to build it instead
+static bool fetchCached(lbr_t *lb) {
+    char const *lbrname = lb->items[0].loc;
+    int entries         = dirEntries(lb, lb->cnt);
+    struct stat st;
+    lbrDir_t d;
+
+    if (!lb->opts.lbrCache || !lbrCacheEnabled() ||
+        (stat(lbrname, &st) == 0 && !S_ISREG(st.st_mode)) || !cacheKey(lb))
+        return false;
+    setPhase(lb, PH_FINISH);
+    char *cached = lbrCacheLookup(&lb->key, entries, &d);
+    if (!cached) {
+        if (d.noMem)
+            errorMsg(lb, LBR_NOMEM, "out of memory\n");
+        return false;
+    }
+    if (!lbrCachePlace(cached, lbrname, lb->items[0].mtime, lb->opts.fsync)) {
+        lbrWarn(lb, "cannot use cached %s for %s, rebuilding\n", cached, lbrname);
+        free(cached);
+        freeDir(&d);
+        return false;
+    }
+    free(cached);
+    // the directory of the placed library answers the queries
+    free(d.hash);
+    lb->hdr               = d.dir;
+    lb->entries           = entries;
+    lb->items[0].fileSize = 0;
+    for (int i = 0; i < lb->cnt; i++) {
+        size_t end = (WORD(&d.dir[i][Index]) + WORD(&d.dir[i][Length])) * 128;
+        if (i)
+            lb->items[i].fileSize = WORD(&d.dir[i][Length]) * 128 - d.dir[i][PadCnt];
+        if (end > lb->items[0].fileSize)
+            lb->items[0].fileSize = end;
+    }
+    lb->stats.cached = true;
+    return true;
+}
+
+// the common start and end of finishing, the members are looked up in between
+static bool startFinish(lbr_t *lb) {
+    if (lb->finished)
+        return false;
+    lb->finished = true;
+    setPhase(lb, PH_LOOKUP);
+    return true;
+}
+
+static int endFinish(lbr_t *lb) {
+    setPhase(lb, NPHASES);
+    lb->stats.bytesRead = lb->io.bytesRead;
+    lb->stats.reads     = lb->io.reads;
+    lb->stats.opens     = lb->io.opens;
+    lb->stats.crcBytes  = lb->io.crcBytes;
+    lb->stats.crcSecs   = lb->io.crcSecs;
+    lb->stats.squeezeIn    = lb->io.squeezeIn;
+    lb->stats.squeezeOut   = lb->io.squeezeOut;
+    lb->stats.dedupBytes   = lb->io.dedupBytes;
+    lb->stats.dedupMembers = lb->io.dedupMembers;
+    return lb->status;
+}
+
+int lbrFinishFile(lbr_t *lb, char const *path) {
+    if (!startFinish(lb))
+        return LBR_STATE;
+    if ((lb->items[0].loc = saveString(lb, path)) == NULL)
+        errorMsg(lb, LBR_NOMEM, "out of memory\n");
+    else if (!failed(lb) && resolveItems(lb) && !fetchCached(lb) && !failed(lb) &&
+             squeezeItems(lb) && dedupItems(lb) && buildLbr(lb) && lb->keyed && !lb->onePass &&
+             !lbrCacheStore(&lb->key, lb->items[0].loc))
+        lbrWarn(lb, "cannot add %s to the library cache\n", lb->items[0].loc);
+    lb->patchable = !failed(lb) && !lb->onePass && !lb->stats.cached;
+    return endFinish(lb);
+}
+
+int lbrFinishMem(lbr_t *lb, uint8_t **data, size_t *len) {
+    if (!startFinish(lb))
+        return LBR_STATE;
+    *data = NULL;
+    *len  = 0;
+    if (!failed(lb) && resolveItems(lb) && squeezeItems(lb) && dedupItems(lb) && writeLbr(lb)) {
+        *data        = lb->sink.mem;
+        *len         = lb->sink.len;
+        lb->sink.mem = NULL;
+    }
+    return endFinish(lb);
+}
+
+int lbrFinishStream(lbr_t *lb, FILE *fp) {
+    if (!startFinish(lb))
+        return LBR_STATE;
+    lb->sink.fp = fp;
+    lb->onePass = true;
+    if (!failed(lb) && resolveItems(lb) && squeezeItems(lb) && dedupItems(lb) && writeLbr(lb) && fflush(fp) != 0)
+        errorMsg(lb, LBR_WRITE, "error writing library\n");
+    lb->sink.fp = NULL;
+    return endFinish(lb);
+}
+
+int lbrFinishCallback(lbr_t *lb, lbrWriteFn write, void *ctx) {
+    if (!startFinish(lb))
+        return LBR_STATE;
+    lb->sink.write = write;
+    lb->sink.ctx   = ctx;
+    lb->onePass    = true;
+    if (!failed(lb) && resolveItems(lb) && squeezeItems(lb) && dedupItems(lb))
+        writeLbr(lb);
+    return endFinish(lb);
+}
+
+/*
+ * patching, see lbrPatch. The source files are looked up again and every member whose
+ * file has changed is read, and squeezed if it was, before anything is written. If each
+ * still needs the sectors it has, its data is written over them, its directory entry
+ * updated and the header, with its new CRC, rewritten in place. Anything that would move
+ * data needs the library rebuilt: a member crossing a sector boundary, a squeezed member
+ * that no longer gets smaller or the reverse, a source file or a pattern match appearing
+ * or disappearing, or any change with dedup, as members may then share data differently.
+ * So does a library that is not as it was built, or that has another link, such as a
+ * hard link to it in the library cache
+ */
+typedef struct {
+    int item;
+    fileMeta_t meta;
+    uint8_t *data; // padded to whole sectors
+    size_t len;    // without the padding
+    bool squeezed;
+} patch_t;
+
+// true if the patterns still match the files they did and no missing file has appeared
+static bool sameSources(lbr_t *lb) {
+    for (int k = 0; k < lb->nMatches; k++) {
+        match_t m;
+        if (!expandPattern(lb->patterns[k], &m))
+            return false;
+        bool same = m.count == lb->matches[k].count;
+        for (size_t j = 0; same && j < m.count; j++)
+            same = strcmp(m.files[j].path, lb->matches[k].files[j].path) == 0;
+        freeMatch(&m);
+        if (!same)
+            return false;
+    }
+    struct stat st;
+    for (int i = 0; i < lb->nMissing; i++)
+        if (stat(lb->missing[i], &st) == 0)
+            return false;
+    return true;
+}
+
+// read the new data of the changed member p->item, returning false if it will not fit
+static bool loadPatch(lbr_t *lb, patch_t *p) {
+    item_t *item  = &lb->items[p->item];
+    size_t size   = p->meta.size;
+    uint8_t *data = malloc(size ? size : 1);
+
+    if (!data)
+        return false;
+    if (!item->squeeze && (size + 127) / 128 != item->secCnt) {
+        free(data);
+        return false;
+    }
+    lb->io.opens++;
+    lb->io.reads++;
+    lb->io.bytesRead += size;
+    if (readWhole(item->loc, data, size) != VEC_OK) { // changing, left to a rebuild
+        free(data);
+        return false;
+    }
+    p->len = size;
+    if (item->squeeze) {
+        uint8_t name11[11];
+        char name[13];
+        uint8_t *sq;
+        size_t sqLen;
+        packName(name11, item->name);
+        unpackName(name, name11);
+        if (!squeeze(data, size, name, &sq, &sqLen)) {
+            free(data);
+            return false;
+        }
+        if ((p->squeezed = sqLen < size)) {
+            free(data);
+            data   = sq;
+            p->len = sqLen;
+        } else
+            free(sq);
+    }
+    size_t padded = item->secCnt * (size_t)128;
+    if (p->squeezed != item->squeezed || (p->len + 127) / 128 != item->secCnt ||
+        (p->data = realloc(data, padded ? padded : 1)) == NULL) {
+        free(data);
+        return false;
+    }
+    memset(p->data + p->len, 0x1a, padded - p->len);
+    return true;
+}
+
+// the changed members, in *patches, or LBR_RELAYOUT if the library needs rebuilding
+static int findPatches(lbr_t *lb, patch_t **patches, int *nPatches) {
+    fileMeta_t *meta = calloc(lb->cnt, sizeof(fileMeta_t));
+    int *from        = malloc(lb->cnt * sizeof(int));
+    int n            = 0;
+
+    *patches  = NULL;
+    *nPatches = 0;
+    if (!meta || !from) {
+        free(meta);
+        free(from);
+        return errorMsg(lb, LBR_NOMEM, "out of memory\n"), LBR_NOMEM;
+    }
+    for (int i = 1; i < lb->cnt; i++)
+        if (lb->items[i].key.path) { // a file member
+            from[n]        = i;
+            meta[n++].path = lb->items[i].loc;
+        }
+    lb->stats.lookupMethod = statBatch(meta, n);
+    lb->stats.lookups      = n;
+
+    int status = LBR_OK;
+    setPhase(lb, PH_SQUEEZE);
+    for (int j = 0; status == LBR_OK && j < n; j++) {
+        fileKey_t const *key = &lb->items[from[j]].key;
+        if (meta[j].err)
+            status = LBR_RELAYOUT;
+        else if (meta[j].dev != key->dev || meta[j].ino != key->ino ||
+                 meta[j].size != key->size || meta[j].mtimeNs != key->mtime) {
+            patch_t *p = realloc(*patches, (*nPatches + 1) * sizeof(patch_t));
+            if (!p) {
+                errorMsg(lb, LBR_NOMEM, "out of memory\n");
+                status = LBR_NOMEM;
+                break;
+            }
+            *patches = p;
+            p        = &p[*nPatches];
+            *p       = (patch_t){ from[j], meta[j] };
+            if (lb->opts.dedup || !loadPatch(lb, p))
+                status = LBR_RELAYOUT;
+            else
+                ++*nPatches;
+        }
+    }
+    free(meta);
+    free(from);
+    return status;
+}
+
+static void freePatches(patch_t *patches, int nPatches) {
+    for (int i = 0; i < nPatches; i++)
+        free(patches[i].data);
+    free(patches);
+}
+
+// the library file, open for update if it is as built, else NULL
+static FILE *openBuilt(lbr_t *lb) {
+    size_t hdrSize = lb->entries * DIRSIZE;
+    struct stat st;
+    FILE *fp;
+
+    if (stat(lb->items[0].loc, &st) != 0 || !S_ISREG(st.st_mode) || st.st_nlink != 1 ||
+        (uint64_t)st.st_size != lb->items[0].fileSize || !(fp = fopen(lb->items[0].loc, "r+b")))
+        return NULL;
+    uint8_t *dir = malloc(hdrSize);
+    bool same    = dir && fread(dir, 1, hdrSize, fp) == hdrSize && memcmp(dir, lb->hdr, hdrSize) == 0;
+    free(dir);
+    if (!same) {
+        fclose(fp);
+        return NULL;
+    }
+    return fp;
+}
+
+int lbrPatch(lbr_t *lb, int *patched) {
+    patch_t *patches;
+    int nPatches;
+    size_t hdrSize = lb->entries * DIRSIZE;
+    time_t now     = localAsUtc(time(NULL));
+    FILE *fp;
+
+    *patched = 0;
+    if (!lb->patchable || failed(lb))
+        return LBR_STATE;
+    memset(&lb->stats, 0, sizeof(lb->stats));
+    memset(&lb->io, 0, sizeof(lb->io));
+    setPhase(lb, PH_LOOKUP);
+    if (!sameSources(lb)) {
+        endFinish(lb);
+        return LBR_RELAYOUT;
+    }
+    int status = findPatches(lb, &patches, &nPatches);
+    if (status != LBR_OK || nPatches == 0) {
+        freePatches(patches, nPatches);
+        endFinish(lb);
+        return status;
+    }
+    setPhase(lb, PH_COPY);
+    if ((fp = openBuilt(lb)) == NULL) {
+        freePatches(patches, nPatches);
+        endFinish(lb);
+        return LBR_RELAYOUT;
+    }
+    bool ok = true;
+    for (int j = 0; ok && j < nPatches; j++) {
+        patch_t *p   = &patches[j];
+        item_t *item = &lb->items[p->item];
+        dir_t *d     = &lb->hdr[p->item];
+        size_t len   = item->secCnt * (size_t)128;
+        uint16_t crc = countCrc(lb, &lb->io, 0, p->data, len);
+
+        lb->stats.writes++;
+        lb->stats.bytesWritten += len;
+        if (!writeAt(fp, p->data, len, WORD(&(*d)[Index]) * 128ull)) {
+            ok = errorMsg(lb, LBR_WRITE, "error writing %s to lbr\n", item->loc);
+            break;
+        }
+        if (item->ownsData) // the old squeezed data
+            free((void *)item->data);
+        item->data      = NULL;
+        item->ownsData  = false;
+        item->fileSize  = p->len;
+        item->key.dev   = p->meta.dev;
+        item->key.ino   = p->meta.ino;
+        item->key.size  = p->meta.size;
+        item->key.mtime = p->meta.mtimeNs;
+        item->changed   = p->meta.ctimeNs;
+        setTimes(lb, item, &p->meta, now);
+        setCrc(lb, p->item, crc);
+        (*d)[PadCnt] = (uint8_t)(len - p->len);
+        setDate(&(*d)[CreateDate], item->ctime);
+        setDate(&(*d)[ChangeDate], item->mtime);
+        if (lb->opts.crcCache && !item->squeezed && !crcCacheStore(&item->key, crc)) {
+            ok = errorMsg(lb, LBR_NOMEM, "out of memory\n");
+            break;
+        }
+        ++*patched;
+    }
+    freePatches(patches, nPatches);
+    setPhase(lb, PH_FINISH);
+    if (ok) {
+        setLbrTimes(lb, false);
+        setDate(&lb->hdr[0][CreateDate], lb->items[0].ctime);
+        setDate(&lb->hdr[0][ChangeDate], lb->items[0].mtime);
+        setCrc(lb, 0, 0);
+        setCrc(lb, 0, countCrc(lb, &lb->io, 0, lb->hdr[0], hdrSize));
+        lb->stats.writes++;
+        lb->stats.bytesWritten += hdrSize;
+        if (!writeAt(fp, lb->hdr, hdrSize, 0))
+            ok = errorMsg(lb, LBR_WRITE, "cannot write header\n");
+        else if (lb->opts.fsync != LBR_FSYNC_NONE && !syncFile(fp))
+            ok = errorMsg(lb, LBR_WRITE, "cannot flush %s to disk\n", lb->items[0].loc);
+    }
+    if (fclose(fp) != 0 && ok)
+        ok = errorMsg(lb, LBR_WRITE, "error writing %s\n", lb->items[0].loc);
+    if (ok && lb->items[0].mtime)
+        setFileTime(lb->items[0].loc, lb->items[0].mtime);
+    lb->keyed = false; // no longer the library the key describes
+    return endFinish(lb);
+}
+
+/*
+ * updating, see lbrFinishUpdate. The members added are built into memory first, as a
+ * library of their own, and then spliced into the existing one. Each takes the entry of
+ * the member it replaces, or the first unused or deleted entry, and its data the first gap
+ * between the sectors the existing members use that holds it, else goes at the end. As
+ * data still in use is never written over, a replaced member keeping its sectors until the
+ * directory no longer refers to them, the new data is written, and flushed with the fsync
+ * option, before the directory sectors that changed. Gaps left by deleted or replaced
+ * members at the end of the library are cut off. A library that cannot be updated in place
+ * is rewritten to a temporary file, its members packed in directory order, the entries of
+ * members sharing data still sharing it, which is renamed over it as a build is
+ */
+typedef struct {
+    uint32_t start; // sector
+    uint32_t len;
+} extent_t;
+
+typedef struct {
+    dir_t *dir;         // the updated directory
+    int entries;
+    int *newItem;       // the new member each entry takes, else 0
+    uint8_t *touched;   // entries changed
+    uint8_t const *mem; // the new members, built as a library
+} update_t;
+
+static bool newUpdate(lbr_t *lb, update_t *u, lbrDir_t const *d, int entries) {
+    u->entries = entries;
+    u->dir     = malloc(entries * DIRSIZE);
+    u->newItem = calloc(entries, sizeof(int));
+    u->touched = calloc(entries, 1);
+    if (!u->dir || !u->newItem || !u->touched)
+        return errorMsg(lb, LBR_NOMEM, "out of memory\n");
+    memcpy(u->dir, d->dir, d->entries * DIRSIZE);
+    memset(u->dir + d->entries, 0, (entries - d->entries) * DIRSIZE);
+    for (int i = d->entries; i < entries; i++)
+        u->dir[i][Status] = UNUSED;
+    return true;
+}
+
+static void freeUpdate(update_t *u) {
+    free(u->dir);
+    free(u->newItem);
+    free(u->touched);
+    u->dir     = NULL;
+    u->newItem = NULL;
+    u->touched = NULL;
+}
+
+// delete the members removed and give each new member an entry, in u, a copy of the old
+// directory d. Returns LBR_RELAYOUT if there are not enough free entries
+static int planUpdate(lbr_t *lb, lbrDir_t const *d, update_t *u, bool replace) {
+    char const *lbrname = lb->items[0].loc;
+    int status          = LBR_OK;
+    uint8_t key[11];
+    char name[13];
+
+    lb->stats.added = lb->stats.replaced = lb->stats.deleted = 0;
+    for (int k = 0; k < lb->nRemovals; k++) {
+        packName(key, lb->removals[k]);
+        int j = findEntry(d, key);
+        if (j == 0 || u->dir[j][Status] != ACTIVE) {
+            unpackName(name, key);
+            errorMsg(lb, LBR_NOMEMBER, "%s is not in %s\n", name, lbrname);
+            status = LBR_NOMEMBER;
+        } else {
+            u->dir[j][Status] = DELETED;
+            u->touched[j]     = true;
+            lb->stats.deleted++;
+        }
+    }
+    for (int i = 1, slot = 1; i < lb->cnt; i++) {
+        int j = findEntry(d, &lb->hdr[i][Name]);
+        if (j && u->dir[j][Status] == ACTIVE) {
+            if (!replace) {
+                unpackName(name, &lb->hdr[i][Name]);
+                errorMsg(lb, LBR_DUPNAME, "%s is already in %s\n", name, lbrname);
+                status = LBR_DUPNAME;
+                continue;
+            }
+            lb->stats.replaced++;
+        } else {
+            while (slot < u->entries && u->dir[slot][Status] != UNUSED &&
+                   u->dir[slot][Status] != DELETED)
+                slot++;
+            if (slot == u->entries)
+                return status == LBR_OK ? LBR_RELAYOUT : status;
+            j = slot;
+            lb->stats.added++;
+        }
+        memcpy(u->dir[j], lb->hdr[i], DIRSIZE);
+        u->newItem[j] = i;
+        u->touched[j] = true;
+    }
+    return status;
+}
+
+static int cmpExtent(void const *a, void const *b) {
+    extent_t const *x = a, *y = b;
+    return x->start < y->start ? -1 : x->start > y->start;
+}
+
+// the sectors the active entries of dir use, the directory itself included, sorted and
+// merged, so that shared sectors count once. NULL if out of memory
+static extent_t *usedExtents(dir_t const *dir, int entries, int *n) {
+    extent_t *e = malloc(entries * sizeof(extent_t));
+    int cnt     = 0;
+
+    if (!e)
+        return NULL;
+    for (int i = 0; i < entries; i++)
+        if (dir[i][Status] == ACTIVE && WORD(&dir[i][Length]))
+            e[cnt++] = (extent_t){ WORD(&dir[i][Index]), WORD(&dir[i][Length]) };
+    qsort(e, cnt, sizeof(extent_t), cmpExtent);
+    *n = 0;
+    for (int k = 0; k < cnt; k++)
+        if (*n && e[k].start <= e[*n - 1].start + e[*n - 1].len) { // overlaps or adjoins
+            uint32_t end = e[k].start + e[k].len;
+            if (end > e[*n - 1].start + e[*n - 1].len)
+                e[*n - 1].len = end - e[*n - 1].start;
+        } else
+            e[(*n)++] = e[k];
+    return e;
+}
+
+// the sectors up to *end, the end of the last member, that no entry of u uses
+static bool unusedSectors(lbr_t *lb, update_t const *u, uint32_t *unused, uint32_t *end) {
+    int n;
+    extent_t *used = usedExtents(u->dir, u->entries, &n);
+
+    if (!used)
+        return errorMsg(lb, LBR_NOMEM, "out of memory\n");
+    *end    = used[n - 1].start + used[n - 1].len;
+    *unused = *end;
+    for (int k = 0; k < n; k++)
+        *unused -= used[k].len;
+    free(used);
+    return true;
+}
+
+// give the data of each new member the first gap between the sectors used by the old
+// directory d that holds it, else the end. Returns LBR_RELAYOUT if beyond the 8M limit
+static int placeMembers(lbr_t *lb, lbrDir_t const *d, update_t *u) {
+    int n;
+    extent_t *gaps = usedExtents(d->dir, d->entries, &n);
+
+    if (!gaps)
+        return errorMsg(lb, LBR_NOMEM, "out of memory\n"), LBR_NOMEM;
+    for (int k = 0; k < n; k++) { // each extent becomes the gap after it, the last unbounded
+        uint32_t end = gaps[k].start + gaps[k].len;
+        gaps[k]      = (extent_t){ end, k + 1 < n ? gaps[k + 1].start - end : UINT32_MAX - end };
+    }
+    int status = LBR_OK;
+    for (int j = 1; status == LBR_OK && j < u->entries; j++) {
+        if (!u->newItem[j])
+            continue;
+        uint32_t len = WORD(&u->dir[j][Length]);
+        int k        = 0;
+        while (gaps[k].len < len)
+            k++;
+        if (gaps[k].start > 0xffff) // sector index is 16 bits
+            status = LBR_RELAYOUT;
+        u->dir[j][Index]     = gaps[k].start % 256;
+        u->dir[j][Index + 1] = gaps[k].start / 256;
+        gaps[k].start += len;
+        gaps[k].len -= len;
+    }
+    free(gaps);
+    return status;
+}
+
+// the times of the updated library, as setLbrTimes sets them but keeping its create time,
+// and its CRC
+static void finishDir(lbr_t *lb, update_t *u) {
+    item_t *lbr = &lb->items[0];
+    dir_t *dir  = u->dir;
+
+    lbr->mtime = lbr->reqMtime;
+    lbr->ctime = lbr->reqCtime >= 0 ? lbr->reqCtime : getDate(&dir[0][CreateDate]);
+    if (lbr->mtime < 0) {
+        for (int i = 1; i < u->entries; i++)
+            if (dir[i][Status] == ACTIVE && lbr->mtime < getDate(&dir[i][ChangeDate]))
+                lbr->mtime = getDate(&dir[i][ChangeDate]);
+        if (lbr->mtime < 0)
+            lbr->mtime = time(NULL);
+    }
+    if (lbr->ctime > lbr->mtime) {
+        if (lbr->reqCtime >= 0)
+            lbrWarn(lb, "library create time later than modify time, setting to modify time\n");
+        lbr->ctime = lbr->mtime;
+    }
+    setDate(&dir[0][CreateDate], lbr->ctime);
+    setDate(&dir[0][ChangeDate], lbr->mtime);
+    dir[0][Crc] = dir[0][Crc + 1] = 0;
+    uint16_t crc    = countCrc(lb, &lb->io, 0, dir[0], u->entries * DIRSIZE);
+    dir[0][Crc]     = crc % 256;
+    dir[0][Crc + 1] = crc / 256;
+    u->touched[0]   = true;
+}
+
+static bool sectorTouched(update_t const *u, int s) {
+    return u->touched[s * 4] || u->touched[s * 4 + 1] || u->touched[s * 4 + 2] ||
+           u->touched[s * 4 + 3];
+}
+
+// write the update to the library fp, size bytes long, in place
+static bool writeInPlace(lbr_t *lb, FILE *fp, update_t *u, uint64_t size) {
+    char const *lbrname = lb->items[0].loc;
+    int sectors         = u->entries / 4;
+    uint32_t unused, end;
+
+    setPhase(lb, PH_COPY);
+    for (int j = 1; j < u->entries; j++) {
+        int i      = u->newItem[j];
+        size_t len = WORD(&u->dir[j][Length]) * (size_t)128;
+        if (!i || !len)
+            continue;
+        lb->stats.writes++;
+        lb->stats.bytesWritten += len;
+        if (!writeAt(fp, u->mem + WORD(&lb->hdr[i][Index]) * (size_t)128, len,
+                     WORD(&u->dir[j][Index]) * 128ull))
+            return errorMsg(lb, LBR_WRITE, "error writing %s to lbr\n", lb->items[i].loc);
+    }
+    if (lb->opts.fsync != LBR_FSYNC_NONE && !syncFile(fp))
+        return errorMsg(lb, LBR_WRITE, "cannot flush %s to disk\n", lbrname);
+    setPhase(lb, PH_FINISH);
+    finishDir(lb, u);
+    for (int s = 0; s < sectors; s++) { // the runs of sectors changed
+        if (!sectorTouched(u, s))
+            continue;
+        int e = s + 1;
+        while (e < sectors && sectorTouched(u, e))
+            e++;
+        lb->stats.writes++;
+        lb->stats.bytesWritten += (e - s) * 128;
+        if (!writeAt(fp, u->dir[s * 4], (e - s) * (size_t)128, s * 128ull))
+            return errorMsg(lb, LBR_WRITE, "cannot write header\n");
+        s = e;
+    }
+    if (!unusedSectors(lb, u, &unused, &end))
+        return false;
+    if (size > end * 128ull && !truncateFile(fp, end * 128ull))
+        lbrWarn(lb, "cannot remove the unused end of %s\n", lbrname);
+    lb->stats.unusedBytes = unused * 128ull;
+    if (lb->opts.fsync != LBR_FSYNC_NONE && !syncFile(fp))
+        return errorMsg(lb, LBR_WRITE, "cannot flush %s to disk\n", lbrname);
+    return true;
+}
+
+// an entry of the rewritten library, sorted to find the entries sharing data
+typedef struct {
+    uint32_t start; // sector in the old library or, for a new member, its own library
+    uint32_t len;
+    int entry;
+} source_t;
+
+static int cmpSource(void const *a, void const *b) {
+    source_t const *x = a, *y = b;
+    if (x->start != y->start)
+        return x->start < y->start ? -1 : 1;
+    if (x->len != y->len)
+        return x->len < y->len ? -1 : 1;
+    return x->entry - y->entry;
+}
+
+// copy len sectors at sector start of the old library fp to out
+static bool copySectors(lbr_t *lb, FILE *fp, FILE *out, uint32_t start, size_t len,
+                        uint8_t const *name) {
+    char member[13];
+    size_t remaining = len * 128;
+
+    unpackName(member, name);
+    if (fseek(fp, start * 128L, SEEK_SET) != 0)
+        return errorMsg(lb, LBR_READ, "cannot read %s from %s\n", member, lb->items[0].loc);
+    while (remaining) {
+        size_t chunk = remaining < lb->opts.ioBufSize ? remaining : lb->opts.ioBufSize;
+        lb->io.reads++;
+        lb->io.bytesRead += chunk;
+        if (fread(lb->ioBuf, 1, chunk, fp) != chunk)
+            return errorMsg(lb, LBR_READ, "cannot read %s from %s\n", member, lb->items[0].loc);
+        lb->stats.writes++;
+        lb->stats.bytesWritten += chunk;
+        if (fwrite(lb->ioBuf, 1, chunk, out) != chunk)
+            return errorMsg(lb, LBR_WRITE, "error writing %s to lbr\n", member);
+        remaining -= chunk;
+    }
+    return true;
+}
+
+// write the packed library of u to out, its data coming from the old library fp and the
+// new members
+static bool writePacked(lbr_t *lb, FILE *fp, FILE *out, update_t *u, source_t const *src,
+                        int cnt) {
+    size_t hdrSize = u->entries * DIRSIZE;
+    uint32_t end   = u->entries / 4;
+
+    for (int j = 1; j < cnt; j++)
+        if (WORD(&u->dir[j][Index]) == end)
+            end += WORD(&u->dir[j][Length]);
+    if (!preallocate(out, end * 128ull))
+        return errorMsg(lb, LBR_WRITE, "no space for the %llu byte library\n", end * 128ull);
+    if (fseek(out, (long)hdrSize, SEEK_SET) != 0)
+        return errorMsg(lb, LBR_WRITE, "cannot write header\n");
+    setPhase(lb, PH_COPY);
+    for (int j = 1, next = u->entries / 4; j < cnt; j++) {
+        size_t len = WORD(&u->dir[j][Length]);
+        bool ok;
+        if (WORD(&u->dir[j][Index]) != next) // shares the data of an earlier entry
+            continue;
+        next += (int)len;
+        if (!u->newItem[j])
+            ok = copySectors(lb, fp, out, src[j].start, len, &u->dir[j][Name]);
+        else {
+            lb->stats.writes++;
+            lb->stats.bytesWritten += len * 128;
+            ok = fwrite(u->mem + src[j].start * (size_t)128, 1, len * 128, out) == len * 128 ||
+                 errorMsg(lb, LBR_WRITE, "error writing %s to lbr\n",
+                          lb->items[u->newItem[j]].loc);
+        }
+        if (!ok)
+            return false;
+    }
+    setPhase(lb, PH_FINISH);
+    finishDir(lb, u);
+    lb->stats.writes++;
+    lb->stats.bytesWritten += hdrSize;
+    if (!writeAt(out, u->dir, hdrSize, 0))
+        return errorMsg(lb, LBR_WRITE, "cannot write header\n");
+    return true;
+}
+
+// rewrite the library of u to a temporary file without gaps, returning its name, which
+// the caller renames over the library, or NULL on failure
+static char *rewriteLbr(lbr_t *lb, FILE *fp, update_t *u) {
+    char const *lbrname = lb->items[0].loc;
+    source_t *src       = malloc(u->entries * sizeof(source_t));
+    source_t *order     = malloc(u->entries * sizeof(source_t));
+    int *shareOf        = calloc(u->entries, sizeof(int));
+    char *tmpName       = NULL;
+    int cnt             = 1;
+
+    if (!src || !order || !shareOf || (lb->ioBuf = malloc(lb->opts.ioBufSize)) == NULL) {
+        free(src);
+        free(order);
+        free(shareOf);
+        errorMsg(lb, LBR_NOMEM, "out of memory\n");
+        return NULL;
+    }
+    // the active entries move to the front, in order
+    for (int j = 1; j < u->entries; j++) {
+        if (u->dir[j][Status] != ACTIVE)
+            continue;
+        int i = u->newItem[j];
+        memmove(u->dir[cnt], u->dir[j], DIRSIZE);
+        u->newItem[cnt] = i;
+        src[cnt] = (source_t){ WORD(&(i ? lb->hdr[i] : u->dir[cnt])[Index]),
+                               WORD(&u->dir[cnt][Length]), cnt };
+        cnt++;
+    }
+    for (int j = cnt; j < u->entries; j++) {
+        memset(u->dir[j], 0, DIRSIZE);
+        u->dir[j][Status] = UNUSED;
+        u->newItem[j]     = 0;
+    }
+    memset(u->touched, true, u->entries);
+    u->dir[0][Length]     = (u->entries / 4) % 256;
+    u->dir[0][Length + 1] = (u->entries / 4) / 256;
+
+    // lay the data out in directory order, old entries that shared data still sharing it
+    int n = 0;
+    for (int j = 1; j < cnt; j++)
+        if (!u->newItem[j])
+            order[n++] = src[j];
+    qsort(order, n, sizeof(source_t), cmpSource);
+    for (int k = 1; k < n; k++) // each shares with the first entry with the same data
+        if (order[k].start == order[k - 1].start && order[k].len == order[k - 1].len)
+            shareOf[order[k].entry] =
+                shareOf[order[k - 1].entry] ? shareOf[order[k - 1].entry] : order[k - 1].entry;
+    uint32_t index = u->entries / 4;
+    bool ok        = true;
+    for (int j = 1; ok && j < cnt; j++) {
+        if (shareOf[j])
+            memcpy(&u->dir[j][Index], &u->dir[shareOf[j]][Index], 2);
+        else if (index > 0xffff)
+            ok = errorMsg(lb, LBR_TOOLARGE, "Library too large, %s is beyond the 8M limit\n",
+                          lbrname);
+        else {
+            u->dir[j][Index]     = index % 256;
+            u->dir[j][Index + 1] = index / 256;
+            index += src[j].len;
+        }
+    }
+    FILE *out = NULL;
+    if (ok && (out = createTemp(lbrname, &tmpName)) == NULL)
+        ok = errorMsg(lb, LBR_WRITE, "cannot create %s\n", lbrname);
+    if (ok)
+        ok = writePacked(lb, fp, out, u, src, cnt);
+    free(src);
+    free(order);
+    free(shareOf);
+    free(lb->ioBuf);
+    lb->ioBuf = NULL;
+    if (ok && lb->items[0].mtime)
+        setFileTime(tmpName, lb->items[0].mtime);
+    if (ok && lb->opts.fsync != LBR_FSYNC_NONE && !syncFile(out))
+        ok = errorMsg(lb, LBR_WRITE, "cannot flush %s to disk\n", tmpName);
+    if (out && fclose(out) != 0 && ok)
+        ok = errorMsg(lb, LBR_WRITE, "error writing %s\n", tmpName);
+    uint32_t unused, end;
+    if (ok && unusedSectors(lb, u, &unused, &end))
+        lb->stats.unusedBytes = unused * 128ull;
+    if (!ok && tmpName) {
+        remove(tmpName);
+        free(tmpName);
+        tmpName = NULL;
+    }
+    return tmpName;
+}
+
+// entries of the rewritten library, with room for the members added
+static int rewriteEntries(lbr_t *lb, lbrDir_t const *d, int flags) {
+    int need = lb->cnt - 1, n;
+
+    for (int i = 0; i < d->entries; i++)
+        if (d->dir[i][Status] == ACTIVE)
+            need++;
+    if (flags & LBR_COMPACT)
+        n = lb->opts.reserve > 0 ? need + lb->opts.reserve : need > d->entries ? need : d->entries;
+    else {
+        n = need + (lb->opts.reserve > d->entries / 4 ? lb->opts.reserve : d->entries / 4);
+        if (n < d->entries)
+            n = d->entries;
+    }
+    return ((n > MAXITEM ? MAXITEM : n) + 3) / 4 * 4;
+}
+
+int lbrFinishUpdate(lbr_t *lb, char const *path, int flags) {
+    struct stat st;
+    lbrDir_t d  = { 0 };
+    update_t u  = { 0 };
+    FILE *fp    = NULL;
+    int status  = LBR_RELAYOUT;
+
+    if (!startFinish(lb))
+        return LBR_STATE;
+    if ((lb->items[0].loc = saveString(lb, path)) == NULL) {
+        errorMsg(lb, LBR_NOMEM, "out of memory\n");
+        return endFinish(lb);
+    }
+    bool exists = stat(path, &st) == 0;
+    if (!exists && !lb->nRemovals && !(flags & LBR_COMPACT)) { // a new library
+        if (!failed(lb) && resolveItems(lb) && squeezeItems(lb) && dedupItems(lb) &&
+            buildLbr(lb))
+            lb->stats.added = lb->cnt - 1;
+        return endFinish(lb);
+    }
+    bool inPlace = exists && !(flags & LBR_COMPACT) && st.st_nlink == 1;
+    if (!exists || !S_ISREG(st.st_mode) || !(fp = fopen(path, inPlace ? "r+b" : "rb"))) {
+        errorMsg(lb, LBR_READ, "cannot open %s for update\n", path);
+        return endFinish(lb);
+    }
+    if (!readDir(&d, fp)) {
+        fclose(fp);
+        if (d.noMem)
+            errorMsg(lb, LBR_NOMEM, "out of memory\n");
+        else
+            errorMsg(lb, LBR_READ, "%s is not a valid library\n", path);
+        return endFinish(lb);
+    }
+    int reserve      = lb->opts.reserve; // the new members' own directory needs none
+    lb->opts.reserve = 0;
+    bool built       = !failed(lb) && resolveItems(lb) && squeezeItems(lb) && writeLbr(lb);
+    lb->opts.reserve = reserve;
+    lb->stats.writes = lb->stats.bytesWritten = 0; // those were to memory
+    u.mem            = lb->sink.mem;
+    setPhase(lb, PH_HEADER);
+    if (built && inPlace) {
+        if (!newUpdate(lb, &u, &d, d.entries))
+            status = LBR_NOMEM;
+        else if ((status = planUpdate(lb, &d, &u, flags & LBR_REPLACE)) == LBR_OK &&
+                 (status = placeMembers(lb, &d, &u)) == LBR_OK)
+            writeInPlace(lb, fp, &u, (uint64_t)st.st_size);
+    }
+    char *tmpName = NULL;
+    if (built && status == LBR_RELAYOUT) {
+        freeUpdate(&u);
+        if (newUpdate(lb, &u, &d, rewriteEntries(lb, &d, flags))) {
+            status = planUpdate(lb, &d, &u, flags & LBR_REPLACE);
+            if (status == LBR_RELAYOUT)
+                errorMsg(lb, LBR_TOOMANY, "Too many files, an lbr is limited to %d\n",
+                         MAXITEM - 1);
+            else if (status == LBR_OK && (tmpName = rewriteLbr(lb, fp, &u)))
+                lb->stats.compacted = true;
+        }
+    }
+    fclose(fp); // before the rename, as windows cannot replace an open file
+    if (tmpName) {
+        if (!replaceFile(tmpName, path, lb->opts.fsync == LBR_FSYNC_FULL)) {
+            errorMsg(lb, LBR_WRITE, "cannot replace %s with %s\n", path, tmpName);
+            remove(tmpName);
+        }
+        free(tmpName);
+    } else if (!failed(lb) && lb->items[0].mtime > 0)
+        setFileTime(path, lb->items[0].mtime);
+    freeUpdate(&u);
+    freeDir(&d);
+    return endFinish(lb);
+}
+
+int lbrStatus(lbr_t const *lb) {
+    return lb->status;
+}
+
+char const *lbrStrError(int status) {
+    static char const *msgs[] = { "ok",
+                                  "out of memory",
+                                  "bad CP/M name",
+                                  "pattern matched no files",
+                                  "too many members",
+                                  "library too large",
+                                  "duplicate CP/M name",
+                                  "error reading member",
+                                  "error writing library",
+                                  "library already finished",
+                                  "library needs rebuilding",
+                                  "member not in library" };
+    return status >= 0 && status <= LBR_NOMEMBER ? msgs[status] : "unknown error";
+}
+
+char const *lbrMessages(lbr_t const *lb) {
+    return lb->msgs ? lb->msgs : "";
+}
+
+int lbrCount(lbr_t const *lb) {
+    return lb->cnt;
+}
+
+bool lbrGetEntry(lbr_t const *lb, int i, lbrEntry_t *e) {
+    if (!lb->hdr || i < 0 || i >= lb->cnt)
+        return false;
+    if (i == 0)
+        e->name[0] = '\0';
+    else
+        unpackName(e->name, &lb->hdr[i][Name]);
+    e->size  = lb->items[i].fileSize;
+    e->crc   = WORD(&lb->hdr[i][Crc]);
+    e->mtime = lb->items[i].mtime;
+    e->ctime = lb->items[i].ctime;
+    e->path  = lb->items[i].key.path;
+    return true;
+}
+
+lbrStats_t const *lbrGetStats(lbr_t const *lb) {
+    return &lb->stats;
+}
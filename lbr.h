@@ -0,0 +1,213 @@
+/* mklbr - create .lbr archives from recipes
+ * Copyright (C) - 2020-2023 Mark Ogden
+ *
+ * lbr.h - build .lbr archives, the library behind mklbr
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * A library is built with a builder handle. Members are added from a file, a memory
+ * buffer or a read callback, then the library is finished into a file, a memory buffer or
+ * a write callback, after which only the query functions can be used. Every call returns
+ * LBR_OK or an error code, and the warnings and errors are kept as text by the builder
+ * unless printMessages is set. Builders are independent, so several can be used at once
+ * on different threads. The CRC cache, see crccache.h, and the shared file lookups are
+ * process wide, guarded by locks.
+ */
+#ifndef _LBR_H_
+#define _LBR_H_
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+typedef struct lbr lbr_t;
+
+enum {
+    LBR_OK,
+    LBR_NOMEM,
+    LBR_BADNAME,  // not a valid CP/M name, the member is not added
+    LBR_NOMATCH,  // a pattern matched no files
+    LBR_TOOMANY,  // more members than an lbr directory can hold
+    LBR_TOOLARGE, // beyond the 8M an lbr, or one of its members, can address
+    LBR_DUPNAME,  // two members have the same CP/M name
+    LBR_READ,     // a member could not be read
+    LBR_WRITE,    // the library could not be written
+    LBR_STATE,    // the builder has already been finished, or for lbrPatch has not been
+    LBR_RELAYOUT, // lbrPatch cannot update the library in place, it needs rebuilding
+    LBR_NOMEMBER  // lbrRemove named a member the library does not have
+};
+
+typedef struct {
+    size_t ioBufSize;   // copy buffer size, a multiple of 128, 0 for 64k
+    int jobs;           // threads reading members, 0 or 1 to copy them serially
+    bool zeroCopy;      // copy file members within the kernel where supported
+    bool incremental;   // reuse unchanged members of the existing lbr file
+    bool crcCache;      // look up and store the CRCs of file members in the CRC cache
+    bool shareStats;    // share file lookups with other builders doing the same
+    bool timing;        // time the CRC calculation, see lbrStats_t
+    bool threadCpu;     // phase CPU times are for the calling thread rather than the process
+    bool printMessages; // print warnings and errors to stderr rather than keeping them
+    bool squeeze;       // squeeze members, see lbrSetSqueeze
+    bool dedup;         // members with the same data share it, written once
+    int fsync;          // LBR_FSYNC_NONE, _DATA or _FULL, flushing a finished file to disk
+    bool lbrCache;      // take a library file from the library cache, see lbrcache.h, or
+                        // add it once built
+    int reserve;        // unused directory entries to leave, for lbrFinishUpdate to add
+                        // members without moving the data
+} lbrOptions_t;
+
+// lbrFinishUpdate flags
+enum {
+    LBR_REPLACE = 1, // a member replaces the one of the same name, which is otherwise an error
+    LBR_COMPACT = 2  // rewrite the library without gaps rather than updating it in place
+};
+
+// how much of a library file is flushed to disk before lbrFinishFile returns
+enum {
+    LBR_FSYNC_NONE, // left to the operating system
+    LBR_FSYNC_DATA, // the library, before it replaces the old one
+    LBR_FSYNC_FULL  // the library and then its directory, so the replacement is durable
+};
+
+// times of the phases of a build, parse covers adding the members
+enum { PH_PARSE, PH_LOOKUP, PH_SQUEEZE, PH_DEDUP, PH_HEADER, PH_COPY, PH_FINISH, NPHASES };
+extern char const *phaseNames[NPHASES];
+
+typedef struct {
+    double wall[NPHASES];
+    double cpu[NPHASES];
+    uint64_t bytesRead;
+    uint64_t bytesWritten;
+    uint64_t reads; // read calls, a file moved by the kernel counts as one
+    uint64_t writes;
+    uint64_t opens;
+    uint64_t crcBytes; // crcBytes and crcSecs only when timing
+    double crcSecs;
+    uint64_t zcBytes;       // bytes moved within the kernel
+    int lookups;            // files looked up, excluding any already known
+    double lookupSecs;
+    char const *lookupMethod; // "io_uring", "threads" or "serial"
+    int reused;               // members reused from the existing lbr
+    uint64_t squeezeIn;       // sizes of the members squeezed, before and after
+    uint64_t squeezeOut;
+    uint64_t dedupBytes;      // bytes saved by duplicate members sharing data
+    int dedupMembers;
+    bool cached;              // placed from the library cache, no member was read
+    int added;                // members added, replaced and deleted by lbrFinishUpdate
+    int replaced;
+    int deleted;
+    bool compacted;           // lbrFinishUpdate rewrote the library without gaps
+    uint64_t unusedBytes;     // sectors between the members that none uses, after an update
+} lbrStats_t;
+
+// a directory entry of the finished library, entry 0 is the library itself
+typedef struct {
+    char name[13];
+    size_t size;
+    uint16_t crc;
+    time_t mtime; // 0 if not set
+    time_t ctime;
+    char const *path; // source file of a file member, else NULL
+} lbrEntry_t;
+
+// returns bytes read, 0 at the end or -1 on error. Called from a copy thread if jobs > 1
+typedef long (*lbrReadFn)(void *ctx, void *buf, size_t len);
+// returns false on error
+typedef bool (*lbrWriteFn)(void *ctx, void const *buf, size_t len);
+
+lbr_t *lbrNew(lbrOptions_t const *opts); // NULL if out of memory, opts may be NULL
+void lbrFree(lbr_t *lb);
+
+/*
+ * members. Times are UTC, -1 for the file's own times, or the current time for other
+ * members, and 0 for none. name defaults to the filename part of path. Files are looked
+ * up when the library is finished, those that cannot be found are left out with a warning
+ */
+int lbrAddFile(lbr_t *lb, char const *path, char const *name, time_t mtime, time_t ctime);
+// each regular file matching pattern, see walk.h, named after the file
+int lbrAddPattern(lbr_t *lb, char const *pattern, time_t mtime, time_t ctime);
+// data must remain valid until the library is finished
+int lbrAddMem(lbr_t *lb, char const *name, void const *data, size_t len, time_t mtime,
+              time_t ctime);
+// read must return exactly size bytes
+int lbrAddCallback(lbr_t *lb, char const *name, size_t size, lbrReadFn read, void *ctx,
+                   time_t mtime, time_t ctime);
+// check name is usable as a CP/M name, warning if not
+bool lbrValidName(lbr_t *lb, char const *name);
+// squeeze the members added after this, in the CP/M SQ format, see squeeze.c. The middle
+// letter of the extension becomes Q, and a member that would not get smaller is left as is
+void lbrSetSqueeze(lbr_t *lb, bool squeeze);
+// times of the library itself, -1 for the newest member or if none the current time
+void lbrSetTimes(lbr_t *lb, time_t mtime, time_t ctime);
+// a file time as the times of file members are stored, local time expressed as though it
+// were UTC, for members taken from files by other means
+time_t lbrLocalTime(time_t t);
+
+/*
+ * finish the library. A file is built in a temporary file alongside it, preallocated to
+ * the library's size, which is renamed over it once complete, so readers only ever see a
+ * complete library and a failed build leaves the old one in place. A memory buffer
+ * is allocated and returned in *data, which the caller frees. A stream, such as stdout or
+ * a pipe, or a write callback is given the library in order in one pass, so the member
+ * CRCs are calculated first and callback members are read into memory to do so. A path
+ * naming an existing pipe or device is written in one pass too
+ */
+int lbrFinishFile(lbr_t *lb, char const *path);
+int lbrFinishMem(lbr_t *lb, uint8_t **data, size_t *len);
+int lbrFinishStream(lbr_t *lb, FILE *fp); // fp is flushed but not closed
+int lbrFinishCallback(lbr_t *lb, lbrWriteFn write, void *ctx);
+
+/*
+ * update the existing library file path in place, adding the members, replacing those of
+ * the same name with LBR_REPLACE, and deleting those named by lbrRemove. A new member takes
+ * an unused or deleted directory entry, and its data the first gap between the other
+ * members that holds it, else goes at the end, and only the directory sectors changed are
+ * rewritten. The new data is written before the directory, so an interrupted update leaves
+ * the library as it was unless the directory itself was being written. A library with no
+ * free entry, that would pass the 8M limit or that has other links is instead rewritten
+ * without gaps, its directory grown by the reserve option or a quarter, as it is with
+ * LBR_COMPACT, where reserve, if set, gives the free entries left. A library that does not
+ * exist is built, as lbrFinishFile would. The queries then describe the members added
+ */
+int lbrFinishUpdate(lbr_t *lb, char const *path, int flags);
+// a member of the existing library for lbrFinishUpdate to delete
+int lbrRemove(lbr_t *lb, char const *name);
+
+/*
+ * bring a library finished by lbrFinishFile up to date with its source files, without
+ * rebuilding it. Each file member that has changed but still needs the same number of
+ * sectors is written over its old data, and its directory entry and the header CRC are
+ * updated, in place. *patched is set to the number of members written. Returns
+ * LBR_RELAYOUT, having written nothing, if the data would move or the library file is
+ * not as built, in which case a new builder is needed. A library taken from the library
+ * cache is always rebuilt. The statistics are then those of the patch
+ */
+int lbrPatch(lbr_t *lb, int *patched);
+
+// queries
+int lbrStatus(lbr_t const *lb); // first error, or LBR_OK
+char const *lbrStrError(int status);
+char const *lbrMessages(lbr_t const *lb); // warnings and errors kept, "" if none
+void lbrWarn(lbr_t *lb, char const *fmt, ...); // add a warning to the messages
+int lbrCount(lbr_t const *lb); // entries including the library, missing files dropped once finished
+bool lbrGetEntry(lbr_t const *lb, int i, lbrEntry_t *e);
+lbrStats_t const *lbrGetStats(lbr_t const *lb);
+
+void lbrFreeShared(void); // release the shared file lookups once no builder is using them
+
+#endif
@@ -0,0 +1,304 @@
+/* mklbr - create .lbr archives from recipes
+ * Copyright (C) - 2020-2023 Mark Ogden
+ *
+ * lbrcache.c - cache of finished libraries keyed on their inputs
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * The cache is a directory of finished libraries, each named by the hash of everything
+ * that determines its content, see cacheKey in lbr.c, so a hit reads nothing but the
+ * cached directory. A library is put in place with a reflink where the file system
+ * supports one, otherwise a hard link or failing both a copy, always through a temporary
+ * file renamed over the target, the same way libraries are added to the cache. As mklbr
+ * only ever replaces a library, never writing into it, a hard link shared with the cache
+ * is not modified. Each use sets the access time, which orders eviction, leaving the
+ * modify time a hard link shares with the library placed.
+ */
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+#include "lbrcache.h"
+#include "lbr.h"
+#include "outfile.h"
+#include "walk.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <threads.h>
+#ifdef _WIN32
+#include <direct.h>
+#include <sys/utime.h>
+#define mkdir(dir, mode) _mkdir(dir)
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <linux/fs.h> // FICLONE
+#include <sys/ioctl.h>
+#endif
+
+#pragma warning(disable : 4996)
+
+static char *cacheDir;
+static uint64_t cacheMax;
+static mtx_t countLock; // libraries may be built on several threads
+unsigned lbrCacheHits, lbrCacheMisses, lbrCacheEvicted;
+uint64_t lbrCacheSize, lbrCacheEvictedBytes;
+
+void lbrKeyInit(lbrKey_t *k) {
+    k->hi = 0x6c62272e07bb0142ull; // FNV-1a 128 bit offset basis
+    k->lo = 0x62b821756295c58dull;
+}
+
+// each byte is multiplied by the prime, 2^88 + 0x13b, in 32 bit parts
+void lbrKeyAdd(lbrKey_t *k, void const *data, size_t len) {
+    uint8_t const *s = data;
+    uint64_t hi      = k->hi;
+    uint64_t lo      = k->lo;
+    for (size_t i = 0; i < len; i++) {
+        lo ^= s[i];
+        uint64_t p0 = (lo & 0xffffffff) * 0x13b;
+        uint64_t p1 = (lo >> 32) * 0x13b + (p0 >> 32);
+        hi          = hi * 0x13b + (p1 >> 32) + (lo << 24);
+        lo          = p1 << 32 | (p0 & 0xffffffff);
+    }
+    k->hi = hi;
+    k->lo = lo;
+}
+
+bool lbrCacheOpen(char const *dir, uint64_t maxSize) {
+    struct stat st;
+    if (stat(dir, &st) != 0 && mkdir(dir, 0777) != 0) {
+        fprintf(stderr, "cannot create library cache %s\n", dir);
+        return false;
+    }
+    if ((cacheDir = strdup(dir)) == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return false;
+    }
+    cacheMax = maxSize;
+    mtx_init(&countLock, mtx_plain);
+    return true;
+}
+
+bool lbrCacheEnabled(void) {
+    return cacheDir != NULL;
+}
+
+static char *entryName(lbrKey_t const *key) {
+    char *name = malloc(strlen(cacheDir) + 38);
+    if (name)
+        sprintf(name, "%s/%016llx%016llx.lbr", cacheDir, (unsigned long long)key->hi,
+                (unsigned long long)key->lo);
+    return name;
+}
+
+// mark name as just used
+static void touchEntry(char const *name) {
+#ifdef _WIN32
+    _utime(name, NULL);
+#else
+    struct timespec t[2] = { { 0, UTIME_NOW }, { 0, UTIME_OMIT } };
+    utimensat(AT_FDCWD, name, t, 0);
+#endif
+}
+
+static bool copyData(char const *src, FILE *out) {
+    FILE *in  = fopen(src, "rb");
+    char *buf = malloc(0x10000);
+    bool ok   = in && buf;
+    size_t n;
+
+    while (ok && (n = fread(buf, 1, 0x10000, in)) > 0)
+        ok = fwrite(buf, 1, n, out) == n;
+    if (in) {
+        ok = ok && !ferror(in);
+        fclose(in);
+    }
+    free(buf);
+    return ok;
+}
+
+// a new temporary file alongside dst with the content of src, its name in *tmpName
+static bool cloneFile(char const *src, char const *dst, int sync, char **tmpName) {
+    FILE *out = createTemp(dst, tmpName);
+    bool ok   = false;
+
+    if (!out)
+        return false;
+#ifdef __linux__
+    int in = open(src, O_RDONLY);
+    ok     = in >= 0 && ioctl(fileno(out), FICLONE, in) == 0;
+    if (in >= 0)
+        close(in);
+#endif
+#ifndef _WIN32
+    if (!ok) { // the temporary name is free for a hard link once removed
+        fclose(out);
+        remove(*tmpName);
+        if (link(src, *tmpName) == 0)
+            return true;
+        if ((out = fopen(*tmpName, "wb")) == NULL) {
+            free(*tmpName);
+            return false;
+        }
+    }
+#endif
+    if (!ok)
+        ok = copyData(src, out);
+    if (ok && sync != LBR_FSYNC_NONE)
+        ok = syncFile(out);
+    if (fclose(out) != 0)
+        ok = false;
+    if (!ok) {
+        remove(*tmpName);
+        free(*tmpName);
+    }
+    return ok;
+}
+
+// true if a and b are hard links to the same file, which rename would leave both of
+static bool sameFile(char const *a, char const *b) {
+#ifdef _WIN32
+    return false; // there is no inode to compare, and hard links are not used
+#else
+    struct stat sa, sb;
+    return stat(a, &sa) == 0 && stat(b, &sb) == 0 && sa.st_dev == sb.st_dev &&
+           sa.st_ino == sb.st_ino;
+#endif
+}
+
+char *lbrCacheLookup(lbrKey_t const *key, int entries, lbrDir_t *d) {
+    char *name = entryName(key);
+    FILE *fp   = name ? fopen(name, "rb") : NULL;
+    bool hit   = fp && readDir(d, fp);
+
+    if (!fp)
+        d->noMem = !name; // else set by readDir
+
+    if (fp)
+        fclose(fp);
+    if (hit && d->entries != entries) { // not the library the key describes
+        freeDir(d);
+        hit = false;
+    }
+    mtx_lock(&countLock);
+    if (hit)
+        lbrCacheHits++;
+    else
+        lbrCacheMisses++;
+    mtx_unlock(&countLock);
+    if (!hit) {
+        free(name);
+        return NULL;
+    }
+    return name;
+}
+
+bool lbrCachePlace(char const *cached, char const *path, time_t mtime, int sync) {
+    char *tmpName;
+    bool ok;
+
+    if (sameFile(cached, path)) // already in place from an earlier use
+        ok = true;
+    else if (!cloneFile(cached, path, sync, &tmpName))
+        return false;
+    else {
+        if (mtime)
+            setFileTime(tmpName, mtime);
+        if (!(ok = replaceFile(tmpName, path, sync == LBR_FSYNC_FULL)))
+            remove(tmpName);
+        free(tmpName);
+    }
+    touchEntry(cached); // after setting the time, which a hard link shares
+    return ok;
+}
+
+bool lbrCacheStore(lbrKey_t const *key, char const *path) {
+    char *name = entryName(key);
+    char *tmpName;
+    bool ok = name && cloneFile(path, name, LBR_FSYNC_NONE, &tmpName);
+
+    if (ok) {
+        touchEntry(tmpName);
+        if (!(ok = replaceFile(tmpName, name, false)))
+            remove(tmpName);
+        free(tmpName);
+    }
+    free(name);
+    return ok;
+}
+
+typedef struct {
+    char const *path;
+    uint64_t size;
+    int64_t used; // access time in nanoseconds where supported, as uses can be close
+} entry_t;
+
+static int64_t accessTime(char const *path) {
+    struct stat st;
+    if (stat(path, &st) != 0)
+        return 0;
+#if defined(__linux__)
+    return st.st_atim.tv_sec * 1000000000LL + st.st_atim.tv_nsec;
+#elif defined(__APPLE__)
+    return st.st_atimespec.tv_sec * 1000000000LL + st.st_atimespec.tv_nsec;
+#else
+    return st.st_atime * 1000000000LL;
+#endif
+}
+
+static int cmpUsed(void const *a, void const *b) {
+    int64_t ta = ((entry_t const *)a)->used;
+    int64_t tb = ((entry_t const *)b)->used;
+    return ta < tb ? -1 : ta > tb;
+}
+
+void lbrCacheTrim(void) {
+    match_t m;
+    char *pattern = malloc(strlen(cacheDir) + 7);
+    entry_t *ent  = NULL;
+
+    lbrCacheSize = 0;
+    if (!pattern)
+        return;
+    sprintf(pattern, "%s/*.lbr", cacheDir);
+    if (expandPattern(pattern, &m)) {
+        for (size_t i = 0; i < m.count; i++)
+            lbrCacheSize += m.files[i].size;
+        if (lbrCacheSize > cacheMax && (ent = malloc(m.count * sizeof(entry_t)))) {
+            for (size_t i = 0; i < m.count; i++) {
+                ent[i].path = m.files[i].path;
+                ent[i].size = m.files[i].size;
+                ent[i].used = accessTime(ent[i].path);
+            }
+            qsort(ent, m.count, sizeof(entry_t), cmpUsed);
+            for (size_t i = 0; i < m.count && lbrCacheSize > cacheMax; i++)
+                if (remove(ent[i].path) == 0) {
+                    lbrCacheSize -= ent[i].size;
+                    lbrCacheEvictedBytes += ent[i].size;
+                    lbrCacheEvicted++;
+                }
+            free(ent);
+        }
+        freeMatch(&m);
+    }
+    free(pattern);
+}
@@ -0,0 +1,55 @@
+/* mklbr - create .lbr archives from recipes
+ * Copyright (C) - 2020-2023 Mark Ogden
+ *
+ * lbrcache.h - cache of finished libraries keyed on their inputs
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef _LBRCACHE_H_
+#define _LBRCACHE_H_
+#include "lbrdir.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+// 128 bit FNV-1a hash of everything that determines a library's content
+typedef struct {
+    uint64_t hi;
+    uint64_t lo;
+} lbrKey_t;
+
+void lbrKeyInit(lbrKey_t *k);
+void lbrKeyAdd(lbrKey_t *k, void const *data, size_t len);
+
+bool lbrCacheOpen(char const *dir, uint64_t maxSize); // creates dir if missing
+bool lbrCacheEnabled(void);
+
+// the cached library for key, with its directory read into d, which must have entries
+// entries. Returns its name, which the caller frees, or NULL if not cached
+char *lbrCacheLookup(lbrKey_t const *key, int entries, lbrDir_t *d);
+// replace path with the cached library, setting its time if mtime is not 0 and flushing
+// it to disk as the fsync option of lbr.h says
+bool lbrCachePlace(char const *cached, char const *path, time_t mtime, int sync);
+// add the library at path to the cache under key
+bool lbrCacheStore(lbrKey_t const *key, char const *path);
+// remove the least recently used libraries until the cache is within its maximum size
+void lbrCacheTrim(void);
+
+extern unsigned lbrCacheHits, lbrCacheMisses, lbrCacheEvicted;
+extern uint64_t lbrCacheSize, lbrCacheEvictedBytes; // size after trimming
+
+#endif
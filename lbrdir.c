@@ -0,0 +1,136 @@
+/* mklbr - create .lbr archives from recipes
+ * Copyright (C) - 2020-2023 Mark Ogden
+ *
+ * lbrdir.c - lbr directory loading and lookup
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include "lbrdir.h"
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#if _MSC_VER
+#include <sys/utime.h>
+#else
+#include <utime.h>
+#endif
+
+static uint32_t hashName(uint8_t const *name) {
+    uint32_t h = 2166136261u; // FNV-1a
+    for (int i = 0; i < 11; i++)
+        h = (h ^ name[i]) * 16777619u;
+    return h;
+}
+
+// the first entry must be an active, unnamed entry starting at sector 0
+static bool validHdr(dir_t const hdr) {
+    return hdr[Status] == ACTIVE && memcmp(&hdr[Name], "           ", 11) == 0 &&
+           WORD(&hdr[Index]) == 0 && WORD(&hdr[Length]) != 0;
+}
+
+bool readDir(lbrDir_t *d, FILE *fp) {
+    dir_t first;
+
+    memset(d, 0, sizeof(*d));
+    if (fseek(fp, 0, SEEK_SET) != 0 || fread(first, DIRSIZE, 1, fp) != 1 || !validHdr(first))
+        return false;
+    d->entries = WORD(&first[Length]) * 4;
+    if ((d->dir = malloc(d->entries * DIRSIZE)) == NULL) {
+        d->noMem = true;
+        return false;
+    }
+    memcpy(d->dir, first, DIRSIZE);
+    if (fread(d->dir + 1, DIRSIZE, d->entries - 1, fp) != d->entries - 1 || !indexDir(d)) {
+        bool noMem = d->noMem;
+        freeDir(d);
+        d->noMem = noMem;
+        return false;
+    }
+    return true;
+}
+
+bool indexDir(lbrDir_t *d) {
+    d->noMem = false;
+    if (!validHdr(d->dir[0]))
+        return false;
+    int size = 16;
+    while (size < d->entries * 2)
+        size *= 2;
+    if ((d->hash = calloc(size, sizeof(int))) == NULL) {
+        d->noMem = true;
+        return false;
+    }
+    d->hashMask = size - 1;
+    for (int i = 1; i < d->entries; i++)
+        if (d->dir[i][Status] == ACTIVE) {
+            uint32_t h = hashName(&d->dir[i][Name]);
+            while (d->hash[h & d->hashMask]) // if duplicate names, first one wins on lookup
+                h++;
+            d->hash[h & d->hashMask] = i;
+        }
+    return true;
+}
+
+int findEntry(lbrDir_t const *d, uint8_t const *name) {
+    int i;
+    for (uint32_t h = hashName(name); (i = d->hash[h & d->hashMask]); h++)
+        if (memcmp(&d->dir[i][Name], name, 11) == 0)
+            return i;
+    return 0;
+}
+
+void freeDir(lbrDir_t *d) {
+    free(d->dir);
+    free(d->hash);
+    memset(d, 0, sizeof(*d));
+}
+
+void packName(uint8_t *dst, char const *name) {
+    memset(dst, ' ', 11);
+    for (int j = 0; j < 8 && *name && *name != '.'; j++)
+        dst[j] = toupper(*name++);
+    while (*name && *name++ != '.')
+        ;
+    for (int j = 8; j < 11 && *name; j++)
+        dst[j] = toupper(*name++);
+}
+
+void unpackName(char *dst, uint8_t const *name) {
+    for (int j = 0; j < 8 && name[j] != ' '; j++)
+        *dst++ = name[j];
+    if (name[8] != ' ') {
+        *dst++ = '.';
+        for (int j = 8; j < 11 && name[j] != ' '; j++)
+            *dst++ = name[j];
+    }
+    *dst = '\0';
+}
+
+// a zero date word is unset. mklbr stores a zero timestamp as day -CPMDAY0, which wraps
+time_t getDate(uint8_t const *d) {
+    uint16_t day  = WORD(d);
+    uint16_t time = WORD(d + 4);
+    if (day == 0)
+        return 0;
+    return (time_t)((day + CPMDAY0) & 0xffff) * 86400 + (time >> 11) * 3600 +
+           ((time >> 5) & 0x3f) * 60 + (time & 0x1f) * 2;
+}
+
+// set modify and access times
+void setFileTime(char const *path, time_t ftime) {
+    struct utimbuf times = { ftime, ftime };
+    utime(path, &times);
+}
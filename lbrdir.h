@@ -0,0 +1,75 @@
+/* mklbr - create .lbr archives from recipes
+ * Copyright (C) - 2020-2023 Mark Ogden
+ *
+ * lbrdir.h - lbr directory layout and lookup
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef _LBRDIR_H_
+#define _LBRDIR_H_
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+// LBR directory offsets
+#define DIRSIZE 32
+typedef uint8_t dir_t[DIRSIZE];
+enum hdrOffsets {
+    Status     = 0,
+    Name       = 1,
+    Ext        = 9,
+    Index      = 12,
+    Length     = 14,
+    Crc        = 16,
+    CreateDate = 18,
+    ChangeDate = 20,
+    CreateTime = 22,
+    ChangeTime = 24,
+    PadCnt     = 26,
+    Filler     = 27
+};
+
+// Status values
+#define ACTIVE  0
+#define DELETED 0xfe
+#define UNUSED  0xff
+
+#define WORD(p) ((p)[0] + (p)[1] * 256) // directory words are little endian
+
+#define CPMDAY0 2921 // days from 1970-01-01 to CP/M day 0
+
+// directory of an existing lbr with a hashed index of the active entries by name
+typedef struct {
+    dir_t *dir;   // dir[0] describes the directory itself
+    int entries;
+    int *hash;    // open addressing table of entry numbers, 0 if empty
+    int hashMask; // table size - 1
+    bool noMem;   // readDir or indexDir failed for want of memory
+} lbrDir_t;
+
+bool readDir(lbrDir_t *d, FILE *fp); // load and index the directory, false if not an lbr
+bool indexDir(lbrDir_t *d);          // index d->dir, false if invalid
+// both also return false if out of memory, setting noMem, the caller reporting it
+int findEntry(lbrDir_t const *d, uint8_t const *name); // 11 char padded name, 0 if not found
+void freeDir(lbrDir_t *d);
+
+void packName(uint8_t *dst, char const *name); // to 11 char padded upper case name
+void unpackName(char *dst, uint8_t const *name); // to name.ext, dst at least 13 chars
+time_t getDate(uint8_t const *d); // inverse of setDate, d points to the date word
+void setFileTime(char const *path, time_t ftime); // set modify and access times
+
+#endif
@@ -0,0 +1,310 @@
+/* mklbr - create .lbr archives from recipes
+ * Copyright (C) - 2020-2023 Mark Ogden
+ *
+ * lbrread.c - list, verify and extract existing lbr files
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * The library is mapped read only and its directory is used in place, with a hashed index
+ * of the names, so extracting a single member only touches the directory and that member.
+ */
+#include "crc16.h"
+#include "lbrdir.h"
+#include "mklbr.h"
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+typedef struct {
+    uint8_t *base;
+    size_t size;
+    lbrDir_t dir; // dir.dir points into the mapping
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#endif
+} lbrMap_t;
+
+static void unmapLbr(lbrMap_t *m) {
+    free(m->dir.hash);
+#ifdef _WIN32
+    if (m->base)
+        UnmapViewOfFile(m->base);
+    if (m->mapping)
+        CloseHandle(m->mapping);
+    if (m->file != INVALID_HANDLE_VALUE)
+        CloseHandle(m->file);
+#else
+    if (m->base)
+        munmap(m->base, m->size);
+#endif
+}
+
+static bool mapLbr(lbrMap_t *m, char const *path) {
+    memset(m, 0, sizeof(*m));
+#ifdef _WIN32
+    LARGE_INTEGER size;
+    m->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                          FILE_ATTRIBUTE_NORMAL, NULL);
+    if (m->file == INVALID_HANDLE_VALUE) {
+        fprintf(stderr, "cannot open %s\n", path);
+        return false;
+    }
+    if (GetFileSizeEx(m->file, &size) && (m->size = (size_t)size.QuadPart) >= 128 &&
+        (m->mapping = CreateFileMappingA(m->file, NULL, PAGE_READONLY, 0, 0, NULL)))
+        m->base = MapViewOfFile(m->mapping, FILE_MAP_READ, 0, 0, 0);
+#else
+    struct stat stbuf;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "cannot open %s\n", path);
+        return false;
+    }
+    if (fstat(fd, &stbuf) == 0 && (m->size = stbuf.st_size) >= 128 &&
+        (m->base = mmap(NULL, m->size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+        m->base = NULL;
+    close(fd);
+#endif
+    m->dir.dir     = (dir_t *)m->base;
+    m->dir.entries = m->base ? WORD(m->base + Length) * 4 : 0;
+    if (!m->base || m->dir.entries * DIRSIZE > m->size || !indexDir(&m->dir)) {
+        fprintf(stderr, m->dir.noMem ? "out of memory\n" : "%s is not a valid library\n", path);
+        unmapLbr(m);
+        return false;
+    }
+    return true;
+}
+
+static size_t memberSize(dir_t const e) {
+    size_t size = WORD(&e[Length]) * 128;
+    return size >= e[PadCnt] ? size - e[PadCnt] : 0;
+}
+
+// true if the member's sectors lie within the file
+static bool inFile(lbrMap_t const *m, dir_t const e) {
+    return (WORD(&e[Index]) + WORD(&e[Length])) * (size_t)128 <= m->size;
+}
+
+int listLbr(char const *path) {
+    lbrMap_t m;
+    char name[13];
+
+    if (!mapLbr(&m, path))
+        return 1;
+    printf("%-12s %7s  %-4s  %5s  %-19s  %s\n", "Name", "Size", "CRC", "Index", "Modify Time",
+           "Create Time");
+    for (int i = 1; i < m.dir.entries; i++) {
+        dir_t const *e = &m.dir.dir[i];
+        if ((*e)[Status] != ACTIVE)
+            continue;
+        unpackName(name, &(*e)[Name]);
+        printf("%-12s %7zd  %02X%02X  %5d  ", name, memberSize(*e), (*e)[Crc + 1], (*e)[Crc],
+               WORD(&(*e)[Index]));
+        time_t mtime = getDate(&(*e)[ChangeDate]);
+        time_t ctime = getDate(&(*e)[CreateDate]);
+        if (mtime)
+            displayDate(mtime);
+        else
+            printf("%-19s", "");
+        if (ctime) {
+            printf("  ");
+            displayDate(ctime);
+        }
+        putchar('\n');
+    }
+    unmapLbr(&m);
+    return 0;
+}
+
+/*
+ * verification recalculates the CRC of every active entry, including the directory itself,
+ * spreading the members over jobs threads. A stored CRC of 0 is treated as not recorded
+ */
+enum { CRC_OK, CRC_BAD, CRC_NONE, CRC_TRUNC };
+
+typedef struct {
+    lbrMap_t *m;
+    uint8_t *result;
+    uint16_t *calc;
+    int next;
+    mtx_t lock;
+} verify_t;
+
+static uint16_t entryCrc(lbrMap_t const *m, int i) {
+    uint8_t const *data = m->base + WORD(&m->dir.dir[i][Index]) * (size_t)128;
+    size_t len          = WORD(&m->dir.dir[i][Length]) * (size_t)128;
+    if (i != 0)
+        return crc16(0, data, len);
+    // the directory's CRC is calculated with its own CRC field zero
+    static uint8_t const zero[2];
+    uint16_t crc = crc16(0, data, Crc);
+    crc          = crc16(crc, zero, 2);
+    return crc16(crc, data + Crc + 2, len - Crc - 2);
+}
+
+static int verifyWorker(void *arg) {
+    verify_t *v = arg;
+    for (;;) {
+        mtx_lock(&v->lock);
+        int i = v->next++;
+        mtx_unlock(&v->lock);
+        if (i >= v->m->dir.entries)
+            return 0;
+        dir_t const *e = &v->m->dir.dir[i];
+        if ((*e)[Status] != ACTIVE)
+            continue;
+        if (!inFile(v->m, *e))
+            v->result[i] = CRC_TRUNC;
+        else {
+            v->calc[i]      = entryCrc(v->m, i);
+            uint16_t stored = WORD(&(*e)[Crc]);
+            v->result[i]    = stored == v->calc[i] ? CRC_OK : stored == 0 ? CRC_NONE : CRC_BAD;
+        }
+    }
+}
+
+int verifyLbr(char const *path) {
+    lbrMap_t m;
+    verify_t v;
+    int errors = 0, checked = 0;
+    char name[13];
+
+    if (!mapLbr(&m, path))
+        return 1;
+    v.m      = &m;
+    v.next   = 0;
+    v.result = calloc(m.dir.entries, 1);
+    v.calc   = calloc(m.dir.entries, sizeof(uint16_t));
+    if (!v.result || !v.calc) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    mtx_init(&v.lock, mtx_plain);
+    int nThreads = jobs < m.dir.entries ? jobs : m.dir.entries;
+    thrd_t *threads = malloc(nThreads * sizeof(thrd_t));
+    int started     = 0;
+    while (started < nThreads - 1 && threads &&
+           thrd_create(&threads[started], verifyWorker, &v) == thrd_success)
+        started++;
+    verifyWorker(&v); // main thread helps too
+    for (int i = 0; i < started; i++)
+        thrd_join(threads[i], NULL);
+    free(threads);
+    mtx_destroy(&v.lock);
+
+    for (int i = 0; i < m.dir.entries; i++) {
+        dir_t const *e = &m.dir.dir[i];
+        if ((*e)[Status] != ACTIVE)
+            continue;
+        checked++;
+        if (i == 0)
+            strcpy(name, "(directory)");
+        else
+            unpackName(name, &(*e)[Name]);
+        switch (v.result[i]) {
+        case CRC_OK:
+            if (verbose)
+                printf("%-12s ok\n", name);
+            break;
+        case CRC_NONE:
+            if (verbose)
+                printf("%-12s no CRC recorded\n", name);
+            break;
+        case CRC_BAD:
+            printf("%-12s CRC error, recorded %04X calculated %04X\n", name, WORD(&(*e)[Crc]),
+                   v.calc[i]);
+            errors++;
+            break;
+        case CRC_TRUNC:
+            printf("%-12s extends beyond end of library\n", name);
+            errors++;
+            break;
+        }
+    }
+    printf("%s: %d entries checked, %d errors\n", path, checked, errors);
+    free(v.result);
+    free(v.calc);
+    unmapLbr(&m);
+    return errors != 0;
+}
+
+static bool extractEntry(lbrMap_t const *m, int i) {
+    char name[13];
+    dir_t const *e = &m->dir.dir[i];
+    FILE *fp;
+
+    unpackName(name, &(*e)[Name]);
+    if (!*name || strpbrk(name, "/\\:") || name[0] == '.') { // keep within current directory
+        fprintf(stderr, "skipping unsafe member name '%s'\n", name);
+        return false;
+    }
+    if (!inFile(m, *e)) {
+        fprintf(stderr, "%s extends beyond end of library\n", name);
+        return false;
+    }
+    if ((fp = fopen(name, "wb")) == NULL) {
+        fprintf(stderr, "cannot create %s\n", name);
+        return false;
+    }
+    size_t size = memberSize(*e);
+    if (fwrite(m->base + WORD(&(*e)[Index]) * (size_t)128, 1, size, fp) != size) {
+        fprintf(stderr, "error writing %s\n", name);
+        fclose(fp);
+        return false;
+    }
+    fclose(fp);
+    time_t mtime = getDate(&(*e)[ChangeDate]);
+    if (mtime)
+        setFileTime(name, mtime);
+    if (verbose)
+        printf("%s\n", name);
+    return true;
+}
+
+// extract the named members, or all members if none are named, to the current directory
+int extractLbr(char const *path, char **names, int nNames) {
+    lbrMap_t m;
+    uint8_t key[11];
+    int errors = 0;
+
+    if (!mapLbr(&m, path))
+        return 1;
+    if (nNames == 0) {
+        for (int i = 1; i < m.dir.entries; i++)
+            if (m.dir.dir[i][Status] == ACTIVE && !extractEntry(&m, i))
+                errors++;
+    } else
+        for (int j = 0; j < nNames; j++) {
+            packName(key, names[j]);
+            int i = findEntry(&m.dir, key);
+            if (i == 0) {
+                fprintf(stderr, "%s not found in %s\n", names[j], path);
+                errors++;
+            } else if (!extractEntry(&m, i))
+                errors++;
+        }
+    unmapLbr(&m);
+    return errors != 0;
+}
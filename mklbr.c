@@ -7,17 +7,18 @@
  * it under the terms of the GNU General Public License as published by
  * the Free Software Foundation; either version 2 of the License, or (at
  * your option) any later version.
- * 
+ *
  * This program is distributed in the hope that it will be useful, but
  * WITHOUT ANY WARRANTY; without even the implied warranty of
  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
  * General Public License for more details.
- * 
+ *
  * You should have received a copy of the GNU General Public License
  * along with this program; if not, write to the Free Software
  * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
  */
 
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -26,86 +27,126 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #if _MSC_VER
-#include <sys/utime.h>
-#define timegm _mkgmtime
+#include <fcntl.h>
+#include <io.h>
+#define gmtime_r(t, tm)     gmtime_s(tm, t)
+#define S_ISDIR(m)          (((m) & _S_IFMT) == _S_IFDIR)
+#define S_ISREG(m)          (((m) & _S_IFMT) == _S_IFREG)
 #else
+#include <dirent.h>
 #include <unistd.h>
-#include <utime.h>
 #endif
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#endif
+
+#include "crc16.h"
+#include "crccache.h"
+#include "lbr.h"
+#include "lbrcache.h"
+#include "mklbr.h"
+#include "procstat.h"
 #include "showVersion.h"
+#include "tar.h"
+#include "walk.h"
 #include <ctype.h>
+#include <threads.h>
 #include <time.h>
 
-#define CPMDAY0 2921
-
 #pragma warning(disable : 4996)
 
-#define MAXITEM 512 // maximum number of items the tool supports in lbr
-
 #ifdef _WIN32
 #define DIRSEP ":\\/"
 #else
 #define DIRSEP "/"
 #endif
 
-#define BADCHAR     " =?*:;<>" // illegal in CP/M 2 & 3
-#define PROBLEMCHAR ",_[]|"    // illegal dependent on version of CP/M
-
 typedef struct {
-    char *loc;
-    char *name;
-    size_t fileSize;
-    uint16_t secCnt;
-    time_t ctime; // times are stored in utc format
-    time_t mtime;
-
-} item_t;
-
-// LBR directory offsets
-#define DIRSIZE 32
-typedef uint8_t dir_t[DIRSIZE];
-enum hdrOffsets {
-    Status     = 0,
-    Name       = 1,
-    Ext        = 9,
-    Index      = 12,
-    Length     = 14,
-    Crc        = 16,
-    CreateDate = 18,
-    ChangeDate = 20,
-    CreateTime = 22,
-    ChangeTime = 24,
-    PadCnt     = 26,
-    Filler     = 27
-};
-
-int cnt     = 0;
-int entries = 4;
-item_t items[MAXITEM];         // list of items to add, item 0 is the header
-uint8_t hdr[MAXITEM][DIRSIZE]; // constructed header
-uint8_t *ioBuf;
-bool verbose;
+    char *buf;
+    size_t len;
+    size_t size;
+} text_t;
 
-time_t parseTimeStamp(char **line);
+/*
+ * a library being built from recipes, see lbr.h for the builder itself. In batch mode
+ * several are built at once
+ */
+typedef struct {
+    lbr_t *lb;
+    char *path;     // the lbr file, named by the first recipe
+    char *recipe;   // contents of the recipe file, the recipes are split in place
+    bool buffered;  // hold output in out, and the builder's messages, rather than printing them
+    text_t out;
+    char const **patterns; // the pattern recipes, for watch mode
+    int nPatterns;
+    tarRecipe_t *tarRecipes; // with --tar, the recipes applied to the tar's entries
+    int nTarRecipes;
+} build_t;
 
-uint16_t calcCrc(uint8_t *buf, int len) {
-    uint8_t x;
-    uint16_t crc = 0;
+size_t ioBufSize = 64 * 1024; // members are copied in chunks of this size, multiple of 128
+int jobs         = 1;         // number of threads reading members, or building libraries
+bool zeroCopy;                // try to copy members without passing them through ioBuf
+bool incremental;             // reuse unchanged members of the existing lbr
+bool squeezeAll;              // squeeze every member, as if each recipe started with +
+bool dedup;                   // members with the same data share it
+bool watch;                   // keep the library up to date as its sources change
+char update;                  // a or r to add to or replace members of an existing library
+int reserve;                  // unused directory entries to leave for adding members
+int fsyncPolicy;              // LBR_FSYNC_NONE, _DATA or _FULL
+char const *crcCacheFile;     // cache of CRCs from previous runs
+char const *lbrCacheDir;      // cache of libraries from previous runs
+char const *tarFile;          // take the members from this tar, - for stdin
+size_t lbrCacheMax = 1024 * 1024 * 1024; // libraries are evicted beyond this size
+enum { STATS_OFF, STATS_TEXT, STATS_JSON } stats; // report phase times and I/O counts
+bool verbose;
+FILE *info; // where reports go, stderr if the library is written to stdout
 
-    while (len-- > 0) {
-        x = (crc >> 8) ^ *buf++;
-        x ^= x >> 4;
-        crc = (crc << 8) ^ (x << 12) ^ (x << 5) ^ x;
+/*
+ * output goes through the build so that in batch mode each library's report is kept
+ * together. Otherwise it is printed immediately
+ */
+void appendText(text_t *t, char const *fmt, va_list args) {
+    va_list copy;
+    va_copy(copy, args);
+    int len = vsnprintf(NULL, 0, fmt, copy);
+    va_end(copy);
+    if (len < 0)
+        return;
+    if (t->len + len + 1 > t->size) {
+        size_t size = t->size ? t->size : 256;
+        while (t->len + len + 1 > size)
+            size *= 2;
+        char *buf = realloc(t->buf, size);
+        if (!buf)
+            return;
+        t->buf  = buf;
+        t->size = size;
     }
-    return crc;
+    vsnprintf(t->buf + t->len, len + 1, fmt, args);
+    t->len += len;
 }
 
-// set modify and access times
-void setFileTime(char const *path, time_t ftime) {
-    struct utimbuf times = { ftime, ftime };
-    utime(path, &times);
+void outMsg(build_t *b, char const *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    if (b->buffered)
+        appendText(&b->out, fmt, args);
+    else
+        vfprintf(info, fmt, args);
+    va_end(args);
+}
+
+void freeBuild(build_t *b) {
+    lbrFree(b->lb);
+    free(b->recipe);
+    free(b->out.buf);
+    free(b->patterns);
+    free(b->tarRecipes);
 }
 
+time_t parseTimeStamp(lbr_t *lb, char **line);
+
 // items in the recipe file have the following format
 // src [ '|' name] [mtime] [ctime]
 // where src is the file to include, except the first which is the target lbr file
@@ -144,28 +185,36 @@ void trim(char *s) {
 }
 
 char *skipWS(char *s) {
-    while (isspace(*s))
+    while (isspace((uint8_t)*s))
         s++;
     return s;
 }
 
 char *skipNonWS(char *s) {
-    while (*s && !isspace(*s))
+    while (*s && !isspace((uint8_t)*s))
         s++;
     return s;
 }
 
-// split recipe line
-// return true if parsed, else false
-bool parseLine(char *line, int cnt) {
-    char *src  = line;
-    char *name = NULL;
+// split recipe line and add it to the library, the first names the library itself
+// returns false only if the library cannot be built
+bool addItem(build_t *b, char *line) {
+    lbr_t *lb    = b->lb;
+    char *src    = line;
+    char *name   = NULL;
+    bool squeeze = squeezeAll;
 
+    if (b->path && *src == '+') { // squeeze this member
+        src     = line = skipWS(src + 1);
+        squeeze = true;
+    }
     if (*src == '<') {
         src  = skipWS(src + 1);
         line = strchr(src, '>');
-        if (!line)
-            return -1;
+        if (!line) {
+            lbrWarn(lb, "Missing '>' in recipe <%s\n", src);
+            return true;
+        }
         *line++ = '\0'; // replace trailing '>'
         trim(src);
         line = skipWS(line);
@@ -190,298 +239,839 @@ bool parseLine(char *line, int cnt) {
         line = skipNonWS(name);
         if (*line)
             *line++ = '\0';
-    } else
-        name = basename(src);
-    char *s;
-    if (!*name || strpbrk(name, BADCHAR) ||
-        ((s = strchr(name, '.')) && (!s[1] || strchr(s + 1, '.')))) {
-        fprintf(stderr, "Bad CP/M name '%s'\n", name);
-        return false;
     }
-    if (strpbrk(name, PROBLEMCHAR))
-        fprintf(stderr, "Warning: Version dependent CP/M name '%s'\n", name);
-    items[cnt].loc   = strdup(src);
-    items[cnt].name  = strdup(name);
-    items[cnt].mtime = parseTimeStamp(&line);
-    items[cnt].ctime = parseTimeStamp(&line);
+    struct stat st; // a file whose name has wildcard characters is taken as it is
+    bool pattern = b->path && isPattern(src) && !(stat(src, &st) == 0 && S_ISREG(st.st_mode));
+    if (pattern && name && !tarFile) { // a tar recipe with a name is matched literally
+        lbrWarn(lb, "Cannot rename the files matching %s\n", src);
+        return true;
+    } else if (!b->path && !lbrValidName(lb, name ? name : basename(src)))
+        return true; // other names are checked as they are added
+    time_t mtime = parseTimeStamp(lb, &line);
+    time_t ctime = parseTimeStamp(lb, &line);
+    if (!b->path) {
+        b->path = src;
+        lbrSetTimes(lb, mtime, ctime);
+        return true;
+    }
+    if (tarFile) { // matched against the paths of the tar's entries, see tar.c
+        tarRecipe_t *recipes = realloc(b->tarRecipes, (b->nTarRecipes + 1) * sizeof(*recipes));
+        if (!recipes) {
+            lbrWarn(lb, "out of memory\n");
+            return false;
+        }
+        b->tarRecipes                   = recipes;
+        b->tarRecipes[b->nTarRecipes++] = (tarRecipe_t){ src, name, mtime, ctime, squeeze };
+        return true;
+    }
+    if (pattern) { // the directories watch mode watches, so not needed otherwise
+        char const **patterns = realloc(b->patterns, (b->nPatterns + 1) * sizeof(char *));
+        if (patterns) {
+            b->patterns                 = patterns;
+            b->patterns[b->nPatterns++] = src;
+        }
+    }
+    // a bad name or a pattern matching nothing is only warned about
+    lbrSetSqueeze(lb, squeeze);
+    return (pattern ? lbrAddPattern(lb, src, mtime, ctime)
+                    : lbrAddFile(lb, src, name, mtime, ctime)) != LBR_NOMEM;
+}
+
+/*
+ * the timestamp parser accepts exactly what sscanf("%4d-%2d-%2d %2d:%2d:%2d") followed by
+ * timegm did, including out of range fields which are normalised, but calculates the UTC
+ * seconds directly
+ */
+
+// as %<width>d, skip white space then an optional sign and digits, width chars at most
+bool scanInt(char **s, int width, int *val) {
+    char *t  = skipWS(*s);
+    bool neg = false;
+    int n    = 0;
+
+    if (*t == '-' || *t == '+') {
+        neg = *t++ == '-';
+        width--;
+    }
+    if (width <= 0 || !isdigit((uint8_t)*t))
+        return false;
+    while (width-- > 0 && isdigit((uint8_t)*t))
+        n = n * 10 + *t++ - '0';
+    *val = neg ? -n : n;
+    *s   = t;
     return true;
 }
 
-time_t parseTimeStamp(char **line) {
-    char *s = skipWS(*line);
+// days from 1970-01-01 to the first of the month, month is 0-11
+int64_t daysToMonth(int64_t year, int month) {
+    year -= month < 2;
+    int64_t era  = (year >= 0 ? year : year - 399) / 400;
+    int64_t yoe  = year - era * 400;                          // year of era
+    int64_t doy  = (153 * (month + (month < 2 ? 10 : -2)) + 2) / 5; // day of year from March
+    return era * 146097 + yoe * 365 + yoe / 4 - yoe / 100 + doy - 719468;
+}
+
+time_t parseTimeStamp(lbr_t *lb, char **line) {
+    static char const sep[] = "\0-- ::"; // separator preceding each field
+    char *s                 = skipWS(*line);
 
     if (!*s || *s == '-' || *s == '*') {
         *line = *s ? s + 1 : s;
         return *s == '-' ? 0 : -1;
     }
-    struct tm tbuf;
-
-    char *end = skipNonWS(skipWS(skipNonWS(s)));
+    char *end = skipNonWS(skipWS(skipNonWS(s))); // date and time are both consumed
     *line     = *end ? end + 1 : end;
     *end      = '\0';
 
-    int scnt  = sscanf(s, "%4d-%2d-%2d %2d:%2d:%2d", &tbuf.tm_year, &tbuf.tm_mon, &tbuf.tm_mday,
-                       &tbuf.tm_hour, &tbuf.tm_min, &tbuf.tm_sec);
+    int f[6] = { 0 }; // year, month, day, hour, minute, second
+    int scnt = 0;
+    for (char *t = s; scnt < 6; scnt++) {
+        if (sep[scnt] == ' ')
+            t = skipWS(t);
+        else if (sep[scnt] && *t++ != sep[scnt])
+            break;
+        if (!scanInt(&t, scnt ? 2 : 4, &f[scnt]))
+            break;
+    }
     if (scnt >= 5) {
-        if (scnt == 5)
-            tbuf.tm_sec = 0;
-        tbuf.tm_mon--;
-        tbuf.tm_year -= 1900;
-        return timegm(&tbuf);
+        int64_t month = f[1] - 1;
+        int64_t year  = f[0] + (month >= 0 ? month / 12 : (month - 11) / 12);
+        month -= (year - f[0]) * 12;
+        return (time_t)((daysToMonth(year, (int)month) + f[2] - 1) * 86400 + f[3] * 3600LL +
+                        f[4] * 60LL + f[5]);
     }
-    fprintf(stderr, "Warning: invalid timestamp information %s\n", s);
+    lbrWarn(lb, "Warning: invalid timestamp information %s\n", s);
     return -1;
 }
 
-void addItem(char *line) {
-    if (cnt >= MAXITEM) {
-        fprintf(stderr, "Too many files, recompile with larger MAXITEM\n");
-        exit(1);
-    }
-    if (!parseLine(line, cnt))
-        return;
+/*
+ * the recipe file is read whole into one buffer, kept until the library is built, and
+ * split into lines in place, so there is no limit on the line length
+ */
+bool loadRecipe(build_t *b, const char *name) {
+    FILE *fp;
+    size_t len = 0, size = 0x10000;
+    char *buf;
 
-    if (cnt) { // first is lbr file which has special handling of auto timestamps
-        struct stat stbuf;
-        if (stat(items[cnt].loc, &stbuf) != 0) {
-            fprintf(stderr, "cannot find %s -- ignoring\n", items[cnt].loc);
-            free(items[cnt].loc);
-            free(items[cnt].name);
-            return;
-        } else {
-            items[cnt].fileSize = stbuf.st_size;
-            items[cnt].secCnt   = (uint16_t)((items[cnt].fileSize + 127) / 128);
-            // set default timestamps
-            bool autoCtime = items[cnt].ctime == -1;
-            if (autoCtime)
-                items[cnt].ctime = timegm(localtime(&stbuf.st_ctime));
-            if (items[cnt].mtime == -1)
-                items[cnt].mtime = timegm(localtime(&stbuf.st_mtime));
-            if (0 < items[cnt].mtime && items[cnt].mtime < items[cnt].ctime) {
-                if (!autoCtime)
-                    fprintf(
-                        stderr,
-                        "%s: modify time before create time. Setting both to earliest timestamp\n",
-                        items[cnt].loc);
-                items[cnt].ctime = items[cnt].mtime;
+    if ((fp = fopen(name, "rb")) == NULL) {
+        lbrWarn(b->lb, "cannot open %s\n", name);
+        return false;
+    }
+    if ((buf = malloc(size + 1)) == NULL) {
+        fclose(fp);
+        lbrWarn(b->lb, "out of memory\n");
+        return false;
+    }
+    for (size_t n; (n = fread(buf + len, 1, size - len, fp)) != 0;)
+        if ((len += n) == size) {
+            char *t = realloc(buf, (size *= 2) + 1);
+            if (t == NULL) {
+                free(buf);
+                fclose(fp);
+                lbrWarn(b->lb, "out of memory\n");
+                return false;
             }
+            buf = t;
         }
+    bool ok = !ferror(fp);
+    fclose(fp);
+    buf[len]  = '\0';
+    b->recipe = buf;
+    if (!ok) {
+        lbrWarn(b->lb, "error reading %s\n", name);
+        return false;
+    }
+
+    for (char *line = buf; ok && line < buf + len;) {
+        char *eol = memchr(line, '\n', buf + len - line);
+        char *s   = eol ? eol : buf + len;
+        *s        = '\0';
+        if (s > line && s[-1] == '\r') // as text mode would
+            s[-1] = '\0';
+        if (*(s = skipWS(line)) && *s != '#')
+            ok = addItem(b, s);
+        line = eol ? eol + 1 : buf + len;
     }
-    cnt++;
+    return ok;
 }
 
-void loadRecipe(const char *name) {
-    FILE *fp;
-    if ((fp = fopen(name, "rt")) == NULL) {
-        fprintf(stderr, "cannot open %s\n", name);
-        exit(1);
+// buf must be at least 20 chars
+char *formatDate(char *buf, time_t date) {
+    struct tm tbuf;
+    gmtime_r(&date, &tbuf);
+    sprintf(buf, "%04d-%02d-%02d %02d:%02d:%02d", 1900 + tbuf.tm_year, tbuf.tm_mon + 1,
+            tbuf.tm_mday, tbuf.tm_hour, tbuf.tm_min, tbuf.tm_sec);
+    return buf;
+}
+
+void displayDate(const time_t date) {
+    char buf[20];
+    fputs(formatDate(buf, date), stdout);
+}
+
+void list(build_t *b) {
+    lbrEntry_t e;
+    char mdate[20], cdate[20];
+
+    outMsg(b, "%-18s %7s  %-4s      %-19s  %s\n", "File", "Size", "CRC", "Modify Time",
+           "Create Time");
+    lbrGetEntry(b->lb, 0, &e);
+    outMsg(b, "%-18s  %6zd  %04X  %s  %s\n", basename(b->path), e.size, e.crc,
+           formatDate(mdate, e.mtime), formatDate(cdate, e.ctime));
+    for (int i = 1; lbrGetEntry(b->lb, i, &e); i++) {
+        outMsg(b, "  %-16s  %6zd  %04X  ", e.name, e.size, e.crc);
+        if (e.mtime)
+            outMsg(b, "%s", formatDate(mdate, e.mtime));
+        else if (e.ctime)
+            outMsg(b, "%-15s ", "");
+        if (e.ctime)
+            outMsg(b, "  %s", formatDate(cdate, e.ctime));
+        outMsg(b, "\n");
     }
-    char line[256];
-    while (fgets(line, 256, fp)) {
-        char *s = strchr(line, '\0') - 1;
-        if (s < line || *s != '\n') {
-            fprintf(stderr, "Recipe line too long: %s\n", line);
-            exit(1);
+}
+
+// the additional information shown after a library is built
+void report(build_t *b) {
+    lbrStats_t const *s = lbrGetStats(b->lb);
+    if (verbose) {
+        list(b);
+        outMsg(b, "%d source files looked up in %.3fs (%s)\n", s->lookups, s->lookupSecs,
+               s->lookupMethod);
+        if (zeroCopy)
+            outMsg(b, "%llu bytes copied without passing through user memory\n",
+                   (unsigned long long)s->zcBytes);
+        if (s->squeezeIn)
+            outMsg(b, "%llu bytes squeezed to %llu\n", (unsigned long long)s->squeezeIn,
+                   (unsigned long long)s->squeezeOut);
+        if (s->cached)
+            outMsg(b, "taken from the library cache\n");
+    }
+    if (incremental)
+        outMsg(b, "%d of %d members reused from existing library\n", s->reused,
+               lbrCount(b->lb) - 1);
+    if (dedup)
+        outMsg(b, "%d duplicate members share data, saving %llu bytes\n", s->dedupMembers,
+               (unsigned long long)s->dedupBytes);
+}
+
+// the additional information shown after a library is updated
+void reportUpdate(build_t *b) {
+    lbrStats_t const *s = lbrGetStats(b->lb);
+    outMsg(b, "%s: %d added, %d replaced, %d deleted, %llu bytes unused%s\n", b->path, s->added,
+           s->replaced, s->deleted, (unsigned long long)s->unusedBytes,
+           s->compacted ? ", rewritten without gaps" : "");
+    if (verbose)
+        listLbr(b->path);
+}
+
+// s as a quoted JSON string, which the caller frees, NULL if out of memory
+char *jsonString(char const *s) {
+    char *json = malloc(strlen(s) * 6 + 3), *t = json;
+    if (json) {
+        *t++ = '"';
+        for (; *s; s++)
+            if (*s == '"' || *s == '\\') {
+                *t++ = '\\';
+                *t++ = *s;
+            } else if ((uint8_t)*s < ' ')
+                t += sprintf(t, "\\u%04x", *s);
+            else
+                *t++ = *s;
+        strcpy(t, "\"");
+    }
+    return json;
+}
+
+// --stats, the times of each phase of building the library and the I/O done
+void reportStats(build_t *b, bool built) {
+    lbrStats_t const *s = lbrGetStats(b->lb);
+    double wall         = 0, cpu = 0;
+    double crcRate      = s->crcSecs > 0 ? s->crcBytes / s->crcSecs / 1e6 : 0;
+
+    for (int i = 0; i < NPHASES; i++) {
+        wall += s->wall[i];
+        cpu += s->cpu[i];
+    }
+    if (stats == STATS_JSON) {
+        char *name = jsonString(b->path);
+        if (!name)
+            return;
+        outMsg(b, "{\"lbr\":%s,\"ok\":%s,\"members\":%d,\"phases\":{", name,
+               built ? "true" : "false", lbrCount(b->lb) - 1);
+        free(name);
+        for (int i = 0; i < NPHASES; i++)
+            outMsg(b, "\"%s\":{\"wall\":%.6f,\"cpu\":%.6f},", phaseNames[i], s->wall[i],
+                   s->cpu[i]);
+        outMsg(b,
+               "\"total\":{\"wall\":%.6f,\"cpu\":%.6f}},\"bytesRead\":%llu,\"bytesWritten\":%llu,"
+               "\"reads\":%llu,\"writes\":%llu,\"opens\":%llu,\"lookups\":%d,\"crcBytes\":%llu,"
+               "\"crcMBps\":%.1f,\"cached\":%s}\n",
+               wall, cpu, (unsigned long long)s->bytesRead, (unsigned long long)s->bytesWritten,
+               (unsigned long long)s->reads, (unsigned long long)s->writes,
+               (unsigned long long)s->opens, s->lookups, (unsigned long long)s->crcBytes,
+               crcRate, s->cached ? "true" : "false");
+        return;
+    }
+    outMsg(b, "%-8s %10s %10s\n", "Phase", "Wall", "CPU");
+    for (int i = 0; i < NPHASES; i++)
+        outMsg(b, "%-8s %10.4f %10.4f\n", phaseNames[i], s->wall[i], s->cpu[i]);
+    outMsg(b, "%-8s %10.4f %10.4f\n", "total", wall, cpu);
+    outMsg(b, "Read %llu bytes in %llu calls from %llu files opened, wrote %llu bytes in %llu calls\n",
+           (unsigned long long)s->bytesRead, (unsigned long long)s->reads,
+           (unsigned long long)s->opens, (unsigned long long)s->bytesWritten,
+           (unsigned long long)s->writes);
+    outMsg(b, "Looked up %d files, calculated the CRC of %llu bytes at %.1f MB/s\n", s->lookups,
+           (unsigned long long)s->crcBytes, crcRate);
+}
+
+double elapsed(struct timespec const *start) {
+    struct timespec now;
+    timespec_get(&now, TIME_UTC);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// --stats, totals for the whole process
+void reportProcess(struct timespec const *start) {
+    uint64_t reads, writes;
+    bool known = ioCalls(&reads, &writes);
+
+    if (stats == STATS_JSON) {
+        fprintf(info, "{\"process\":{\"wall\":%.6f,\"cpu\":%.6f,\"peakRssKB\":%ld", elapsed(start),
+               cpuTime(false), peakRss());
+        if (known)
+            fprintf(info, ",\"readSyscalls\":%llu,\"writeSyscalls\":%llu", (unsigned long long)reads,
+                   (unsigned long long)writes);
+        fprintf(info, "}}\n");
+    } else {
+        fprintf(info, "Process: %.4fs wall, %.4fs CPU, peak RSS %ld KB", elapsed(start), cpuTime(false),
+               peakRss());
+        if (known)
+            fprintf(info, ", %llu read and %llu write system calls", (unsigned long long)reads,
+                   (unsigned long long)writes);
+        fputc('\n', info);
+    }
+}
+
+// the builder options given on the command line
+lbrOptions_t buildOptions(build_t const *b) {
+    return (lbrOptions_t){ .ioBufSize     = ioBufSize,
+                           .jobs          = b->buffered ? 1 : jobs,
+                           .zeroCopy      = zeroCopy,
+                           .incremental   = incremental,
+                           .crcCache      = crcCacheFile != NULL,
+                           .shareStats    = b->buffered,
+                           .timing        = stats != STATS_OFF,
+                           .threadCpu     = b->buffered, // other threads build other libraries
+                           .printMessages = !b->buffered,
+                           .dedup         = dedup,
+                           .fsync         = fsyncPolicy,
+                           .lbrCache      = lbrCacheDir != NULL,
+                           .reserve       = reserve };
+}
+
+// build the library described by recipeFile, or if it is NULL by the nArgs recipes in args
+bool makeLbr(build_t *b, char const *recipeFile, char **args, int nArgs) {
+    lbrOptions_t opts = buildOptions(b);
+    bool ok           = true;
+
+    if ((b->lb = lbrNew(&opts)) == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return false;
+    }
+    if (recipeFile)
+        ok = loadRecipe(b, recipeFile);
+    else { // copied, as they are split in place and watch mode may add them again
+        size_t len = 1;
+        for (int i = 0; i < nArgs; i++)
+            len += strlen(args[i]) + 1;
+        if ((b->recipe = malloc(len)) == NULL) {
+            lbrWarn(b->lb, "out of memory\n");
+            return false;
+        }
+        char *s = b->recipe;
+        for (int i = 0; ok && i < nArgs; i++) {
+            size_t n = strlen(args[i]) + 1;
+            ok       = addItem(b, memcpy(s, args[i], n));
+            s += n;
         }
-        s = skipWS(line);
-        if (*s && *s != '#')
-            addItem(s);
     }
-    fclose(fp);
+    if (!ok)
+        return false;
+    bool toStdout = b->path && strcmp(b->path, "-") == 0;
+    if (toStdout && (b->buffered || watch || update)) {
+        lbrWarn(b->lb, "Cannot write a library to stdout in %s mode\n",
+                watch ? "watch" : update ? "update" : "batch");
+        return false;
+    }
+    tarIn_t *tar = NULL;
+    if (b->path && tarFile) { // the tar is read now, its data as the library is finished
+        if ((tar = tarOpen(tarFile)) == NULL)
+            return false;
+        if (tarAdd(tar, b->lb, b->tarRecipes, b->nTarRecipes, squeezeAll) != LBR_OK) {
+            tarClose(tar);
+            return false;
+        }
+    }
+    if (!b->path)
+        lbrWarn(b->lb, "Library has no files\n");
+    else {
+        bool built;
+        if (toStdout) { // streamed in one pass
+            info = stderr;
+#ifdef _MSC_VER
+            _setmode(_fileno(stdout), _O_BINARY);
+#endif
+            built = lbrFinishStream(b->lb, stdout) == LBR_OK;
+        } else if (update)
+            built = lbrFinishUpdate(b->lb, b->path, update == 'r' ? LBR_REPLACE : 0) == LBR_OK;
+        else
+            built = lbrFinishFile(b->lb, b->path) == LBR_OK;
+        if (built && update)
+            reportUpdate(b);
+        else if (built)
+            report(b);
+        if (stats)
+            reportStats(b, built);
+    }
+    tarClose(tar);
+    return lbrStatus(b->lb) == LBR_OK;
+}
+
+// -d and --compact, deleting the named members of the library at path, or compacting it
+int editLbr(char *path, char **names, int nNames, bool compact) {
+    build_t b         = { .path = path };
+    lbrOptions_t opts = buildOptions(&b);
+    bool ok           = true;
+
+    if ((b.lb = lbrNew(&opts)) == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    for (int i = 0; ok && i < nNames; i++)
+        ok = lbrRemove(b.lb, names[i]) == LBR_OK;
+    if (ok && (ok = lbrFinishUpdate(b.lb, path, compact ? LBR_COMPACT : 0) == LBR_OK))
+        reportUpdate(&b);
+    if (stats)
+        reportStats(&b, ok);
+    freeBuild(&b);
+    return ok ? 0 : 1;
+}
+
+/*
+ * watch mode, enabled by --watch
+ * Once built, the library is kept up to date as its sources change. The builder is kept,
+ * with the parsed recipe and the directory, and the directories of the recipe file, the
+ * members and the patterns are watched, with inotify on linux, otherwise by checking once
+ * a second. Once there have been no changes for 100ms they are applied together, the
+ * changed members being patched in place, see lbrPatch, and the library rebuilt if the
+ * recipe file has changed or the data would move. Changes inotify cannot see, such as
+ * files in new directories matched by **, are found by checking every 5 seconds
+ */
+#define QUIET_MS  100  // changes are applied once there have been none for this long
+#define SETTLE_MS 1000 // or after this long, if they keep coming
+#define RESCAN_MS 5000
+
+typedef struct {
+    int fd;             // inotify, -1 if not in use
+    char last[FILENAME_MAX]; // directory last watched, as members often share one
+    struct stat recipe; // the recipe file, st_ino 0 if missing
+} watch_t;
+
+// true if path is not as it was in *last, which is updated
+bool statChanged(char const *path, struct stat *last) {
+    struct stat st;
+    bool changed;
+
+    if (stat(path, &st) != 0) {
+        changed = last->st_ino != 0;
+        memset(last, 0, sizeof(struct stat));
+        return changed;
+    }
+    changed = st.st_ino != last->st_ino || st.st_size != last->st_size ||
+              st.st_mtime != last->st_mtime;
+#ifdef __linux__
+    changed = changed || st.st_mtim.tv_nsec != last->st_mtim.tv_nsec;
+#endif
+    *last = st;
+    return changed;
 }
 
-void setName(int i) {
-    char *s       = &hdr[i][Name];
-    const char *t = items[i].name;
+#ifdef __linux__
+// watch the directory containing path, for a pattern the part before any wildcard
+void watchDir(watch_t *w, char const *path, bool pattern) {
+    char dir[FILENAME_MAX];
+    char *s;
 
-    memset(s, ' ', 11);
-    if (i == 0)
+    snprintf(dir, sizeof(dir), "%s", path);
+    if (pattern && (s = strpbrk(dir, "*?[")))
+        *s = '\0';
+    if ((s = strrchr(dir, '/')) == NULL)
+        strcpy(dir, ".");
+    else
+        s[s == dir] = '\0'; // keeping a leading / for the root
+    if (strcmp(dir, w->last) == 0)
         return;
-    for (int j = 0; j < 8 && *t && *t != '.'; j++)
-        *s++ = toupper(*t++);
+    strcpy(w->last, dir);
+    inotify_add_watch(w->fd, dir,
+                      IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE | IN_ATTRIB);
+}
 
-    if (*t && *t != '.')
-        fprintf(stderr, "Truncating %s to 8 char name\n", items[i].name);
-    while (*t && *t++ != '.')
+// discard the events queued, such as those from writing the library
+void drainEvents(watch_t *w) {
+    char buf[4096];
+    struct pollfd p = { w->fd, POLLIN };
+    while (w->fd >= 0 && poll(&p, 1, 0) > 0 && read(w->fd, buf, sizeof(buf)) > 0)
         ;
-    s = &hdr[i][Ext];
-    for (int j = 0; j < 3 && *t; j++)
-        *s++ = toupper(*t++);
-
-    if (*t)
-        fprintf(stderr, "Truncating %s to 3 char extent\n", items[i].name);
-}
-
-void setDate(uint8_t *d, time_t tval) {
-    // store the date in utc format, so what user enters matches
-    struct tm *timestamp = gmtime(&tval); // get raw utc time
-    uint16_t lbrDay =
-        (uint16_t)(tval / 86400 - CPMDAY0); //  adjust for CP/M day 0
-    uint16_t lbrTime =
-        (timestamp->tm_hour << 11) + (timestamp->tm_min << 5) + timestamp->tm_sec / 2;
-
-    // note lbr day and time are split
-    d[0] = lbrDay % 256;
-    d[1] = lbrDay / 256;
-    d[4] = lbrTime % 256;
-    d[5] = lbrTime / 256;
-}
-
-void initHdr() {
-    uint16_t index    = 0;
-    uint16_t largest  = 0;
-    entries           = (cnt + 3) / 4 * 4;
-    items[0].fileSize = entries * DIRSIZE;
-    items[0].secCnt   = entries * DIRSIZE / 128;
-
-    time_t now;
-    time(&now);
-
-    if (items[0].mtime < 0) {
-        for (int i = 1; i < cnt; i++)
-            if (items[0].mtime < items[i].mtime)
-                items[0].mtime = items[i].mtime;
-        if (items[0].mtime < 0)
-            items[0].mtime = now;
-    }
-    if (items[0].ctime < 0)
-        items[0].ctime = items[0].mtime;
-    else if (items[0].ctime > items[0].mtime) {
-        fprintf(stderr, "library create time later than modify time, setting to modify time\n");
-        items[0].ctime = items[0].mtime;
-    }
-
-    for (int i = 0; i < cnt; i++) {
-        hdr[i][Status] = 0;
-        setName(i);
-        setDate(&hdr[i][CreateDate], items[i].ctime);
-        setDate(&hdr[i][ChangeDate], items[i].mtime);
-        hdr[i][Index]      = index % 256;
-        hdr[i][Index + 1]  = index / 256;
-        hdr[i][Length]     = items[i].secCnt % 256;
-        hdr[i][Length + 1] = items[i].secCnt / 256;
-        hdr[i][PadCnt]     = (uint8_t)(items[i].secCnt * 128 - items[i].fileSize);
-        index += items[i].secCnt;
-        if (items[i].secCnt > largest)
-            largest = items[i].secCnt;
-    }
-
-    for (int i = cnt; i < entries; i++)
-        hdr[i][0] = 0xff;
-    ioBuf = malloc(largest * 128);
-}
-
-void buildLbr() {
-    FILE *fp;
-    uint16_t crc;
-    const char *lbrname = items[0].loc;
+}
+#endif
 
-    if ((fp = fopen(lbrname, "wb")) == NULL) {
-        fprintf(stderr, "cannot create %s\n", lbrname);
-        exit(1);
-    }
-    initHdr();
-    if (fwrite(hdr, DIRSIZE, entries, fp) != entries) {
-        fprintf(stderr, "cannot write header\n");
-        exit(1);
+// watch the sources of the library just built, replacing the previous watches
+void watchSources(watch_t *w, build_t *b, char const *recipeFile) {
+#ifdef __linux__
+    lbrEntry_t e;
+    if (w->fd >= 0)
+        close(w->fd);
+    if ((w->fd = inotify_init1(IN_CLOEXEC)) < 0)
+        return; // checked every RESCAN_MS instead
+    w->last[0] = '\0';
+    if (recipeFile)
+        watchDir(w, recipeFile, false);
+    for (int i = 1; lbrGetEntry(b->lb, i, &e); i++)
+        if (e.path)
+            watchDir(w, e.path, false);
+    for (int i = 0; i < b->nPatterns; i++)
+        watchDir(w, b->patterns[i], true);
+    drainEvents(w);
+#endif
+}
+
+// wait for changes to settle, returning false if there were none to see
+bool waitChanges(watch_t *w) {
+#ifdef __linux__
+    char buf[4096];
+    struct pollfd p = { w->fd, POLLIN };
+    struct timespec start;
+
+    if (w->fd < 0) {
+        thrd_sleep(&(struct timespec){ RESCAN_MS / 1000 }, NULL);
+        return false;
     }
-    for (int i = 1; i < cnt; i++) {
-        FILE *fpin = fopen(items[i].loc, "rb");
-        if (fpin == NULL) {
-            fprintf(stderr, "cannot read %s\n", items[i].loc);
-            exit(1);
+    if (poll(&p, 1, RESCAN_MS) <= 0)
+        return false;
+    timespec_get(&start, TIME_UTC);
+    while (read(w->fd, buf, sizeof(buf)) > 0 && elapsed(&start) * 1000 < SETTLE_MS &&
+           poll(&p, 1, QUIET_MS) > 0)
+        ;
+    return true;
+#else
+    thrd_sleep(&(struct timespec){ 1 }, NULL);
+    return false;
+#endif
+}
+
+// save the CRC cache and trim the library cache, as a watch does not end
+void saveCaches(void) {
+    if (crcCacheFile && crcCacheSave())
+        crcCacheOpen(crcCacheFile);
+    if (lbrCacheDir)
+        lbrCacheTrim();
+}
+
+int watchLbr(char const *recipeFile, char **args, int nArgs) {
+    watch_t w    = { .fd = -1 };
+    build_t b    = { 0 };
+    bool rebuild = true;
+    bool built   = false;
+
+    for (bool first = true;; first = false) {
+        if (rebuild) {
+            if (recipeFile)
+                statChanged(recipeFile, &w.recipe);
+            freeBuild(&b);
+            b     = (build_t){ 0 };
+            built = makeLbr(&b, recipeFile, args, nArgs);
+            if (first && (!b.path || strcmp(b.path, "-") == 0)) {
+                freeBuild(&b);
+                return 1;
+            }
+            watchSources(&w, &b, recipeFile);
+            saveCaches();
+            fprintf(info, "%s %s, watching for changes\n", b.path ? b.path : recipeFile,
+                    built ? "built" : "failed");
+            fflush(info);
+            rebuild = false;
         }
-        if (fread(ioBuf, 1, items[i].fileSize, fpin) != items[i].fileSize) {
-            fprintf(stderr, "error reading %s\n", items[i].loc);
-            exit(1);
+        bool seen = waitChanges(&w);
+        if (recipeFile && statChanged(recipeFile, &w.recipe))
+            rebuild = true;
+        else if (!built) // retried only when something changes
+            rebuild = seen;
+        else {
+            int patched;
+            if (lbrPatch(b.lb, &patched) != LBR_OK)
+                rebuild = true;
+            else if (patched) {
+                fprintf(info, "%s patched, %d member%s updated\n", b.path, patched,
+                        patched == 1 ? "" : "s");
+                if (verbose)
+                    list(&b);
+                if (stats)
+                    reportStats(&b, true);
+                fflush(info);
+                saveCaches();
+            }
+#ifdef __linux__
+            drainEvents(&w);
+#endif
         }
-        fclose(fpin);
-        if (items[i].fileSize % 128)
-            memset(ioBuf + items[i].fileSize, 0x1a, 128 - (items[i].fileSize % 128));
-        if (fwrite(ioBuf, 128, items[i].secCnt, fp) != items[i].secCnt) {
-            fprintf(stderr, "error writing %s to lbr\n", items[i].loc);
-            exit(1);
+    }
+}
+
+/*
+ * batch mode, enabled by -m
+ * Builds a library for each recipe file listed in a manifest, or for each file in a
+ * directory of recipes. The libraries are built by a pool of jobs threads, each copying
+ * its members serially, and share stat results and the CRC cache. Messages for each
+ * library are collected and printed together once it is complete, followed by its status.
+ */
+typedef struct {
+    char **recipes;
+    int count;
+    int size;
+    int next;     // next recipe to build
+    int failures;
+    mtx_t lock;   // guards next, failures and the output
+} batch_t;
+
+bool addRecipe(batch_t *b, char const *path) {
+    if (b->count == b->size) {
+        int size     = b->size ? b->size * 2 : 64;
+        char **names = realloc(b->recipes, size * sizeof(char *));
+        if (!names)
+            return false;
+        b->recipes = names;
+        b->size    = size;
+    }
+    if ((b->recipes[b->count] = strdup(path)) == NULL)
+        return false;
+    b->count++;
+    return true;
+}
+
+int cmpName(void const *a, void const *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// every regular file in dir, other than hidden ones, in name order
+bool scanRecipeDir(batch_t *b, char const *dir) {
+    char path[FILENAME_MAX];
+    struct stat stbuf;
+    bool ok = true;
+#ifdef _MSC_VER
+    struct _finddata_t info;
+    snprintf(path, sizeof(path), "%s/*", dir);
+    intptr_t h = _findfirst(path, &info);
+    if (h == -1) {
+        fprintf(stderr, "cannot read directory %s\n", dir);
+        return false;
+    }
+    do {
+        char const *name = info.name;
+#else
+    DIR *d = opendir(dir);
+    struct dirent *de;
+    if (!d) {
+        fprintf(stderr, "cannot read directory %s\n", dir);
+        return false;
+    }
+    while (ok && (de = readdir(d))) {
+        char const *name = de->d_name;
+#endif
+        if (name[0] == '.')
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, name);
+        if (stat(path, &stbuf) == 0 && S_ISREG(stbuf.st_mode) && !(ok = addRecipe(b, path)))
+            fprintf(stderr, "out of memory\n");
+#ifdef _MSC_VER
+    } while (ok && _findnext(h, &info) == 0);
+    _findclose(h);
+#else
+    }
+    closedir(d);
+#endif
+    qsort(b->recipes, b->count, sizeof(char *), cmpName);
+    return ok;
+}
+
+// manifest lines are recipe file names, blank lines and lines starting with # are ignored
+bool loadManifest(batch_t *b, char const *manifest) {
+    struct stat stbuf;
+    char line[FILENAME_MAX + 2];
+    FILE *fp;
+
+    if (stat(manifest, &stbuf) == 0 && S_ISDIR(stbuf.st_mode))
+        return scanRecipeDir(b, manifest);
+    if ((fp = fopen(manifest, "rt")) == NULL) {
+        fprintf(stderr, "cannot open %s\n", manifest);
+        return false;
+    }
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), fp)) {
+        char *s = strchr(line, '\0') - 1;
+        if (s < line || *s != '\n') {
+            fprintf(stderr, "Manifest line too long: %s\n", line);
+            ok = false;
+        } else {
+            while (s >= line && isspace(*s))
+                *s-- = '\0';
+            if (*(s = skipWS(line)) && *s != '#' && !(ok = addRecipe(b, s)))
+                fprintf(stderr, "out of memory\n");
         }
-        crc             = calcCrc(ioBuf, items[i].secCnt * 128);
-        hdr[i][Crc]     = crc % 256;
-        hdr[i][Crc + 1] = crc / 256;
-    }
-    // now calculate the headers own CRC
-    items[0].fileSize = ftell(fp);
-    crc               = calcCrc(hdr[0], items[0].secCnt * 128);
-    hdr[0][Crc]       = crc % 256;
-    hdr[0][Crc + 1]   = crc / 256;
-    rewind(fp);
-    if (fwrite(hdr, DIRSIZE, entries, fp) != entries) {
-        fprintf(stderr, "failed to update header\n");
-        exit(1);
     }
     fclose(fp);
-    if (items[0].mtime)
-        setFileTime(lbrname, items[0].mtime);
+    return ok;
 }
 
-void displayDate(const time_t date) {
-    struct tm const *timeptr = gmtime(&date);
-    printf("%04d-%02d-%02d %02d:%02d:%02d", 1900 + timeptr->tm_year, timeptr->tm_mon + 1,
-           timeptr->tm_mday, timeptr->tm_hour, timeptr->tm_min, timeptr->tm_sec);
-}
-
-void list() {
-    char cpmName[12];
-
-    printf("%-18s %7s  %-4s      %-19s  %s\n", "File", "Size", "CRC", "Modify Time", "Create Time");
-    printf("%-18s  %6zd  %02X%02X  ", basename(items[0].loc), items[0].fileSize, hdr[0][Crc + 1],
-           hdr[0][Crc]);
-    displayDate(items[0].mtime);
-    putchar(' ');
-    putchar(' ');
-    displayDate(items[0].ctime);
-    putchar('\n');
-    for (int i = 1; i < cnt; i++) {
-        char *s = cpmName;
-        for (int j = 0; j < 8 && hdr[i][Name + j] != ' '; j++)
-            *s++ = hdr[i][Name + j];
-        if (hdr[i][Ext] != ' ') {
-            *s++ = '.';
-            for (int j = 0; j < 3 && hdr[i][Ext + j] != ' '; j++)
-                *s++ = hdr[i][Ext + j];
-        }
-        *s = '\0';
-        printf("  %-16s  %6zd  %02X%02X  ", cpmName, items[i].fileSize, hdr[i][Crc + 1],
-               hdr[i][Crc]);
-        if (items[i].mtime)
-            displayDate(items[i].mtime);
-        else if (items[i].ctime)
-            printf("%-15s ", "");
-        if (items[i].ctime) {
-            putchar(' ');
-            putchar(' ');
-            displayDate(items[i].ctime);
+int batchWorker(void *arg) {
+    batch_t *b = arg;
+
+    for (;;) {
+        mtx_lock(&b->lock);
+        int n = b->next < b->count ? b->next++ : b->count;
+        mtx_unlock(&b->lock);
+        if (n >= b->count)
+            return 0;
+        build_t lb = { .buffered = true };
+        bool ok    = makeLbr(&lb, b->recipes[n], NULL, 0);
+        mtx_lock(&b->lock);
+        if (lb.out.len) {
+            fwrite(lb.out.buf, 1, lb.out.len, stdout);
+            fflush(stdout);
         }
-        putchar('\n');
+        if (lb.lb)
+            fputs(lbrMessages(lb.lb), stderr);
+        printf("%s: %s\n", b->recipes[n], ok ? "ok" : "failed");
+        fflush(stdout);
+        if (!ok)
+            b->failures++;
+        mtx_unlock(&b->lock);
+        freeBuild(&lb);
     }
 }
 
-int main(int argc, char **argv) {
-    CHK_SHOW_VERSION(argc, argv);
-    if (argc > 1 && strcmp(argv[1], "-v") == 0) {
-        argc--, argv++;
-        verbose = true;
+int runBatch(char const *manifest) {
+    batch_t b = { 0 };
+
+    if (!loadManifest(&b, manifest))
+        return 1;
+    if (b.count == 0)
+        fprintf(stderr, "%s has no recipes\n", manifest);
+    else {
+        mtx_init(&b.lock, mtx_plain);
+        int nThreads    = jobs < b.count ? jobs : b.count;
+        thrd_t *threads = malloc(nThreads * sizeof(thrd_t));
+        int started     = 0;
+        while (started < nThreads - 1 && threads &&
+               thrd_create(&threads[started], batchWorker, &b) == thrd_success)
+            started++;
+        batchWorker(&b); // main thread builds too
+        for (int i = 0; i < started; i++)
+            thrd_join(threads[i], NULL);
+        free(threads);
+        mtx_destroy(&b.lock);
+        lbrFreeShared();
+        if (verbose)
+            printf("%d of %d libraries built\n", b.count - b.failures, b.count);
     }
-    if (argc < 2 || argc == 2 && strcmp(argv[1], "-h") == 0) {
-        fprintf(
-            stderr,
-            "Usage: mklbr -v | -V | -h | [-v] (lbrRecipe fileRecipe+ | recipefile)\n"
+    for (int i = 0; i < b.count; i++)
+        free(b.recipes[i]);
+    free(b.recipes);
+    return b.failures != 0;
+}
+
+// parse a size with optional k or m suffix
+bool parseSize(char const *s, size_t *val) {
+    char *end;
+    unsigned long long n = strtoull(s, &end, 10);
+    if (end == s)
+        return false;
+    if (*end == 'k' || *end == 'K')
+        n *= 1024, end++;
+    else if (*end == 'm' || *end == 'M')
+        n *= 1024 * 1024, end++;
+    else if (*end == 'g' || *end == 'G')
+        n *= 1024 * 1024 * 1024, end++;
+    *val = n;
+    return *end == '\0';
+}
+
+void usage() {
+    fprintf(stderr,
+            "Usage: mklbr -v | -V | -h | --selftest | [options] (lbrRecipe fileRecipe+ | recipefile)\n"
+            "       mklbr [options] -m (manifest | recipedir)\n"
+            "       mklbr [options] (-a | -r) (lbrRecipe fileRecipe+ | recipefile)\n"
+            "       mklbr [options] (-d lbrfile member+ | --compact lbrfile)\n"
+            "       mklbr [options] [-a | -r] --tar[=tarfile] lbrRecipe [fileRecipe+]\n"
+            "       mklbr [-v] [-j n] (-l | -c | -x) lbrfile [member+]\n"
+            "       mklbr [-v] [-j n] (-i catalog (dir | lbrfile)+ | -f catalog query+)\n"
             "A single -v or -V shows version information and -h shows this help\n"
-            "Otherwise -v provides additional information on the created lbrfile\n"
+            "--selftest checks the CRC engines against the reference and shows their speed\n"
+            "-m builds a library from each recipefile listed in manifest, one per line, or from\n"
+            "   each file in recipedir, reporting ok or failed for each\n"
+            "-l lists, -c verifies the CRCs of, and -x extracts the members of an existing lbrfile\n"
+            "-x extracts to the current directory, either the named members or all of them\n"
+            "-a adds members to an existing lbrfile in place, using unused directory entries and\n"
+            "   the gaps left by deleted members, -r also replaces members of the same name and\n"
+            "   -d deletes members. --compact rewrites lbrfile without the gaps\n"
+            "--tar takes the members from the regular files in tarfile, or stdin, without\n"
+            "   extracting them. The fileRecipes name entries, or patterns matching their paths,\n"
+            "   giving the lbrname, times or + of the first they match\n"
+            "-i adds the .lbr files in each dir tree to catalog, an index of their members,\n"
+            "   reading only the libraries new or changed since it was last updated\n"
+            "-f lists the members in catalog matching each query, a member name, which can\n"
+            "   use * ? and [set], or a CRC given as crc=xxxx in hex\n"
+            "\n"
+            "Options are\n"
+            "  -v           provides additional information on the created lbrfile\n"
+            "  -b size      size of the copy buffer, optional k or m suffix (default 64k)\n"
+            "  -j n         read and CRC members using n threads, each with 2 copy buffers\n"
+            "               with -m, build n libraries at once instead\n"
+            "  -z           use zero copy I/O where supported, falling back to buffered I/O\n"
+            "  -u           incremental, reuse members of the existing lbr whose name, size\n"
+            "               and timestamps are unchanged, and whose file is unchanged since the\n"
+            "               lbr was written, or with -C has the CRC cached for the same file\n"
+            "  -q           squeeze every member, see + below\n"
+            "  --dedup      store members with the same data once, their directory entries\n"
+            "               sharing it, and report the bytes saved\n"
+            "  --fsync[=data|full] flush the library to disk before it replaces the old one,\n"
+            "               with full (the default) also its directory, so the replacement\n"
+            "               survives a crash. --fsync=none leaves it to the system\n"
+            "  --lbr-cache=dir  take libraries from a cache of previous builds in dir when the\n"
+            "               recipe, options and source file identities match, reading no\n"
+            "               members, otherwise adding the library built to it\n"
+            "  --lbr-cache-size=size  evict the least recently used beyond size (default 1g)\n"
+            "  --watch      after building the library keep it up to date, patching members\n"
+            "               that change in place while they fit their sectors, otherwise\n"
+            "               rebuilding it, until interrupted\n"
+            "  --reserve=n  leave n unused directory entries, for -a to add members to without\n"
+            "               moving data, when building or with --compact\n"
+            "  -C file      cache member CRCs in file, keyed on path, inode, size and mtime\n"
+            "  --crc=engine select CRC engine: auto (default), ref, slice8 or clmul (x86-64)\n"
+            "  --stats[=json] report the time of each phase, I/O counts, CRC speed and peak\n"
+            "               memory, as text or as one JSON object per library and the process\n"
             "\n"
             "The content of the .lbr file is determined by recipes of the format\n"
-            "  sourcefile [ '|' lbrname] [modifytime [createtime]]\n"
+            "  [+] sourcefile [ '|' lbrname] [modifytime [createtime]]\n"
             "\n"
+            "A leading + squeezes the member, in the CP/M SQ format, using the -j threads, and\n"
+            "the middle letter of its extension becomes Q, e.g. FOO.ASM is stored as FOO.AQM.\n"
+            "A member that would not get smaller is stored as it is\n"
             "lbrname defaults the filename part of sourcefile, converted to uppercase\n"
             "sourcefile can be surrounded by <> to allow embedded spaces, e.g. directory path\n"
             "however if there are embedded spaces in the filename part, lbrname must be specified\n"
+            "sourcefile can also be a directory, ending in /, or a pattern using * ? and [set]\n"
+            "e.g. src/*.asm, to add each matching file, with ** matching any number of\n"
+            "directories e.g. src/**, lbrname cannot be given and names must not collide\n"
             "\n"
             "Time information is one of\n"
             "  yyyy-mm-dd hh:mm[:ss] -- explicitly set UTC time\n"
@@ -490,22 +1080,167 @@ int main(int argc, char **argv) {
             "\n"
             "The first recipe is taken as the name of the lbr file to create.\n"
             "Its default timestamp is set to the newest source file or the current time.\n"
+            "An lbr file of - writes the library to stdout, and a pipe or device can be named,\n"
+            "in both cases in one pass with the CRCs calculated before the copy\n"
             "\n"
             "Complex recipes will require command line quoting, alternatively a recipefile,\n"
-            "containing a list of the recipes, one per line, can be used to avoid this\n"
-            );
+            "containing a list of the recipes, one per line, can be used to avoid this\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    char mode = 0; // l, c, x, a, r, d or k (--compact) for existing library, i or f for a catalog
+    char const *manifest = NULL;
+    struct timespec start;
+    timespec_get(&start, TIME_UTC);
+    info = stdout;
+    CHK_SHOW_VERSION(argc, argv);
+    // options must precede the recipes, a sourcefile starting with - can be enclosed in <>
+    while (argc > 1 && argv[1][0] == '-' && argv[1][1]) {
+        char *opt = argv[1];
+        if (strcmp(opt, "-v") == 0)
+            verbose = true;
+        else if (strcmp(opt, "-z") == 0)
+            zeroCopy = true;
+        else if (strcmp(opt, "-u") == 0)
+            incremental = true;
+        else if (strcmp(opt, "-q") == 0)
+            squeezeAll = true;
+        else if (strcmp(opt, "--dedup") == 0)
+            dedup = true;
+        else if (strcmp(opt, "--watch") == 0)
+            watch = true;
+        else if (strcmp(opt, "--fsync") == 0 || strcmp(opt, "--fsync=full") == 0)
+            fsyncPolicy = LBR_FSYNC_FULL;
+        else if (strcmp(opt, "--fsync=data") == 0)
+            fsyncPolicy = LBR_FSYNC_DATA;
+        else if (strcmp(opt, "--fsync=none") == 0)
+            fsyncPolicy = LBR_FSYNC_NONE;
+        else if (strncmp(opt, "--lbr-cache=", 12) == 0 && opt[12])
+            lbrCacheDir = opt + 12;
+        else if (strncmp(opt, "--lbr-cache-size=", 17) == 0) {
+            if (!parseSize(opt + 17, &lbrCacheMax)) {
+                fprintf(stderr, "Invalid cache size %s\n", opt + 17);
+                exit(1);
+            }
+        }
+        else if (strcmp(opt, "-l") == 0 || strcmp(opt, "-c") == 0 || strcmp(opt, "-x") == 0 ||
+                 strcmp(opt, "-i") == 0 || strcmp(opt, "-f") == 0 || strcmp(opt, "-a") == 0 ||
+                 strcmp(opt, "-r") == 0 || strcmp(opt, "-d") == 0)
+            mode = opt[1];
+        else if (strcmp(opt, "--compact") == 0)
+            mode = 'k';
+        else if (strcmp(opt, "--tar") == 0)
+            tarFile = "-";
+        else if (strncmp(opt, "--tar=", 6) == 0 && opt[6])
+            tarFile = opt + 6;
+        else if (strncmp(opt, "--reserve=", 10) == 0) {
+            char *end;
+            long n = strtol(opt + 10, &end, 10);
+            if (end == opt + 10 || *end || n < 0 || n > 65534) {
+                fprintf(stderr, "Invalid directory reserve %s\n", opt + 10);
+                exit(1);
+            }
+            reserve = (int)n;
+        }
+        else if (strcmp(opt, "-m") == 0 && argc > 2) {
+            manifest = argv[2];
+            argc--, argv++;
+        } else if (strcmp(opt, "-C") == 0 && argc > 2) {
+            if (!crcCacheOpen(crcCacheFile = argv[2]))
+                exit(1);
+            argc--, argv++;
+        } else if (strcmp(opt, "-b") == 0 && argc > 2) {
+            if (!parseSize(argv[2], &ioBufSize) || ioBufSize < 128) {
+                fprintf(stderr, "Invalid buffer size %s\n", argv[2]);
+                exit(1);
+            }
+            ioBufSize &= ~(size_t)127;
+            argc--, argv++;
+        } else if (strcmp(opt, "-j") == 0 && argc > 2) {
+            if ((jobs = atoi(argv[2])) < 1) {
+                fprintf(stderr, "Invalid thread count %s\n", argv[2]);
+                exit(1);
+            }
+            argc--, argv++;
+        } else if (strcmp(opt, "--selftest") == 0)
+            exit(crcSelfTest(true) ? 0 : 1);
+        else if (strncmp(opt, "--crc=", 6) == 0) {
+            if (!crcSelect(opt + 6)) {
+                fprintf(stderr, "CRC engine %s not available\n", opt + 6);
+                exit(1);
+            }
+        } else if (strcmp(opt, "--stats") == 0 || strcmp(opt, "--stats=text") == 0)
+            stats = STATS_TEXT;
+        else if (strcmp(opt, "--stats=json") == 0)
+            stats = STATS_JSON;
+        else if (strcmp(opt, "-h") == 0)
+            usage();
+        else {
+            fprintf(stderr, "Unknown option %s\n", opt);
+            usage();
+        }
+        argc--, argv++;
+    }
+    if (lbrCacheDir && !lbrCacheOpen(lbrCacheDir, lbrCacheMax))
         exit(1);
+    int status;
+    if (manifest) {
+        if (mode || watch || tarFile || argc != 1)
+            usage();
+        status = runBatch(manifest);
+    } else {
+        if (argc < 2)
+            usage();
+        if (mode == 'l' && argc == 2)
+            return listLbr(argv[1]);
+        if (mode == 'c' && argc == 2)
+            return verifyLbr(argv[1]);
+        if (mode == 'x')
+            return extractLbr(argv[1], argv + 2, argc - 2);
+        if (mode == 'i' && argc > 2)
+            return catalogUpdate(argv[1], argv + 2, argc - 2);
+        if (mode == 'f' && argc > 2)
+            return catalogFind(argv[1], argv + 2, argc - 2);
+        if (mode == 'd' && argc > 2)
+            return editLbr(argv[1], argv + 2, argc - 2, false);
+        if (mode == 'k' && argc == 2)
+            return editLbr(argv[1], NULL, 0, true);
+        if ((mode == 'a' || mode == 'r') && !watch)
+            update = mode;
+        else if (mode)
+            usage();
+        if (watch && tarFile)
+            usage();
+        if (watch)
+            return watchLbr(argc == 2 ? argv[1] : NULL, argv + 1, argc - 1);
+        build_t lb = { 0 };
+        char const *recipeFile = argc == 2 && !tarFile ? argv[1] : NULL; // --tar takes recipes
+        status = makeLbr(&lb, recipeFile, argv + 1, argc - 1) ? 0 : 1;
+        freeBuild(&lb);
     }
-    if (argc == 2)
-        loadRecipe(argv[1]);
-    else
-        for (int i = 1; i < argc; i++)
-            addItem(argv[i]);
-    if (cnt == 0)
-        fprintf(stderr, "Library has no files\n");
-    else {
-        buildLbr();
-        if (verbose)
-            list();
+    if (crcCacheFile && !crcCacheSave())
+        status = 1;
+    if (verbose && crcCacheFile)
+        fprintf(info, "CRC cache: %u hits, %u misses\n", cacheHits, cacheMisses);
+    if (lbrCacheDir) {
+        lbrCacheTrim();
+        if (stats == STATS_JSON)
+            fprintf(info,
+                    "{\"lbrCache\":{\"hits\":%u,\"misses\":%u,\"bytes\":%llu,\"evicted\":%u,"
+                    "\"evictedBytes\":%llu}}\n",
+                    lbrCacheHits, lbrCacheMisses, (unsigned long long)lbrCacheSize,
+                    lbrCacheEvicted, (unsigned long long)lbrCacheEvictedBytes);
+        else if (verbose || stats)
+            fprintf(info,
+                    "Library cache: %u hits, %u misses (%.0f%% hit rate), %llu bytes, %u "
+                    "evicted freeing %llu bytes\n",
+                    lbrCacheHits, lbrCacheMisses,
+                    lbrCacheHits ? 100.0 * lbrCacheHits / (lbrCacheHits + lbrCacheMisses) : 0.0,
+                    (unsigned long long)lbrCacheSize, lbrCacheEvicted,
+                    (unsigned long long)lbrCacheEvictedBytes);
     }
-}
\ No newline at end of file
+    if (stats)
+        reportProcess(&start);
+    return status;
+}
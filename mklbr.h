@@ -0,0 +1,41 @@
+/* mklbr - create .lbr archives from recipes
+ * Copyright (C) - 2020-2023 Mark Ogden
+ *
+ * mklbr.h - functions and options shared between the modules
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef _MKLBR_H_
+#define _MKLBR_H_
+#include <stdbool.h>
+#include <time.h>
+
+extern int jobs;
+extern bool verbose;
+
+void displayDate(const time_t date);
+double elapsed(struct timespec const *start);
+
+// lbrread.c
+int listLbr(char const *path);
+int verifyLbr(char const *path);
+int extractLbr(char const *path, char **names, int nNames);
+
+// catalog.c
+int catalogUpdate(char const *catalog, char **trees, int nTrees);
+int catalogFind(char const *catalog, char **queries, int nQueries);
+
+#endif
@@ -0,0 +1,154 @@
+/* mklbr - create .lbr archives from recipes
+ * Copyright (C) - 2020-2023 Mark Ogden
+ *
+ * outfile.c - write libraries through a temporary file renamed into place
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * A library is written to a temporary file in its own directory, so the rename that
+ * replaces the old library is atomic and a reader sees either the old or the new one,
+ * never a partial one. The temporary file is named after the library and the process,
+ * created exclusively so concurrent builds cannot share one. Preallocation uses fallocate
+ * and is only supported on Linux, elsewhere the file grows as it is written.
+ */
+#ifdef __linux__
+#define _GNU_SOURCE // for fallocate
+#endif
+#include "outfile.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#include <process.h>
+#include <windows.h>
+#define getpid _getpid
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#pragma warning(disable : 4996)
+
+FILE *createTemp(char const *path, char **tmpName) {
+    size_t len = strlen(path);
+    char *name = malloc(len + 32);
+
+    if (name)
+        memcpy(name, path, len);
+    for (int n = 0; name && n < 100; n++) {
+        if (n)
+            sprintf(name + len, ".%ld-%d.tmp", (long)getpid(), n);
+        else
+            sprintf(name + len, ".%ld.tmp", (long)getpid());
+#ifdef _WIN32
+        int fd = _open(name, _O_WRONLY | _O_CREAT | _O_EXCL | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+        int fd = open(name, O_WRONLY | O_CREAT | O_EXCL, 0666);
+#endif
+        if (fd < 0) {
+            if (errno == EEXIST) // left by another build of the same library
+                continue;
+            break;
+        }
+#ifndef _WIN32
+        struct stat st;
+        if (stat(path, &st) == 0 && S_ISREG(st.st_mode))
+            fchmod(fd, st.st_mode & 07777);
+#endif
+        FILE *fp = fdopen(fd, "wb");
+        if (!fp) {
+            close(fd);
+            remove(name);
+            break;
+        }
+        *tmpName = name;
+        return fp;
+    }
+    free(name);
+    return NULL;
+}
+
+bool preallocate(FILE *fp, uint64_t size) {
+#ifdef __linux__
+    if (size && fallocate(fileno(fp), 0, 0, (off_t)size) != 0)
+        return errno != ENOSPC && errno != EFBIG && errno != EDQUOT; // else unsupported
+#endif
+    return true;
+}
+
+bool writeAt(FILE *fp, void const *buf, size_t len, uint64_t offset) {
+    if (fflush(fp) != 0)
+        return false;
+#ifdef _WIN32
+    return _fseeki64(fp, offset, SEEK_SET) == 0 && fwrite(buf, 1, len, fp) == len &&
+           fflush(fp) == 0;
+#else
+    return pwrite(fileno(fp), buf, len, (off_t)offset) == (ssize_t)len;
+#endif
+}
+
+bool syncFile(FILE *fp) {
+    if (fflush(fp) != 0)
+        return false;
+#ifdef _WIN32
+    return _commit(_fileno(fp)) == 0;
+#else
+    return fsync(fileno(fp)) == 0;
+#endif
+}
+
+bool truncateFile(FILE *fp, uint64_t size) {
+    if (fflush(fp) != 0)
+        return false;
+#ifdef _WIN32
+    return _chsize_s(_fileno(fp), size) == 0;
+#else
+    return ftruncate(fileno(fp), (off_t)size) == 0;
+#endif
+}
+
+bool replaceFile(char const *tmpName, char const *path, bool syncDir) {
+#ifdef _WIN32
+    // rename will not replace an existing file, MoveFileEx does so atomically
+    // the directory entry is flushed by the file system
+    return MoveFileExA(tmpName, path, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+#else
+    if (rename(tmpName, path) != 0)
+        return false;
+    if (!syncDir)
+        return true;
+    char const *s = strrchr(path, '/');
+    char *dir     = s ? malloc(s - path + 2) : NULL;
+    if (s && !dir)
+        return false;
+    if (dir) {
+        memcpy(dir, path, s - path + 1); // keeps the / so the root directory works
+        dir[s - path + 1] = '\0';
+    }
+    int fd = open(dir ? dir : ".", O_RDONLY);
+    free(dir);
+    if (fd < 0)
+        return false;
+    bool ok = fsync(fd) == 0;
+    close(fd);
+    return ok;
+#endif
+}
@@ -0,0 +1,49 @@
+/* mklbr - create .lbr archives from recipes
+ * Copyright (C) - 2020-2023 Mark Ogden
+ *
+ * outfile.h - write libraries through a temporary file renamed into place
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef _OUTFILE_H_
+#define _OUTFILE_H_
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// create a new temporary file in the same directory as path, with the permissions of
+// path if it exists. Returns NULL on failure, else the stream with its name in *tmpName,
+// which the caller frees
+FILE *createTemp(char const *path, char **tmpName);
+
+// reserve size bytes for fp, where supported. Returns false only if there is no space
+bool preallocate(FILE *fp, uint64_t size);
+
+// write len bytes of buf at offset, flushing fp first. The stream position is unchanged
+// except on windows
+bool writeAt(FILE *fp, void const *buf, size_t len, uint64_t offset);
+
+// flush fp to disk
+bool syncFile(FILE *fp);
+
+// cut the file fp to size bytes
+bool truncateFile(FILE *fp, uint64_t size);
+
+// replace path with tmpName, then if syncDir is set flush the directory to disk so the
+// rename is durable
+bool replaceFile(char const *tmpName, char const *path, bool syncDir);
+
+#endif
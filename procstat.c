@@ -0,0 +1,100 @@
+/* mklbr - create .lbr archives from recipes
+ * Copyright (C) - 2020-2023 Mark Ogden
+ *
+ * procstat.c - process CPU time, memory and I/O counters
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * the operating system's view of the process, used by --stats. The system call counts
+ * come from /proc/self/io so are only available on Linux
+ */
+#include "procstat.h"
+#include <stdio.h>
+#ifdef _WIN32
+#define PSAPI_VERSION 2 // GetProcessMemoryInfo is in kernel32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#include <time.h>
+#endif
+
+#pragma warning(disable : 4996)
+
+#ifdef _WIN32
+static double seconds(FILETIME const *ft) {
+    return (((uint64_t)ft->dwHighDateTime << 32) + ft->dwLowDateTime) / 1e7;
+}
+
+double cpuTime(bool thisThread) {
+    FILETIME create, exit, kernel, user;
+    if (!(thisThread ? GetThreadTimes(GetCurrentThread(), &create, &exit, &kernel, &user)
+                     : GetProcessTimes(GetCurrentProcess(), &create, &exit, &kernel, &user)))
+        return 0;
+    return seconds(&kernel) + seconds(&user);
+}
+
+long peakRss(void) {
+    PROCESS_MEMORY_COUNTERS pmc;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)))
+        return 0;
+    return (long)(pmc.PeakWorkingSetSize / 1024);
+}
+#else
+double cpuTime(bool thisThread) {
+    struct timespec ts;
+    if (clock_gettime(thisThread ? CLOCK_THREAD_CPUTIME_ID : CLOCK_PROCESS_CPUTIME_ID, &ts) != 0)
+        return 0;
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+long peakRss(void) {
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) != 0)
+        return 0;
+#ifdef __APPLE__
+    return ru.ru_maxrss / 1024; // reported in bytes rather than KB
+#else
+    return ru.ru_maxrss;
+#endif
+}
+#endif
+
+bool ioCalls(uint64_t *reads, uint64_t *writes) {
+#ifdef __linux__
+    FILE *fp = fopen("/proc/self/io", "r");
+    char line[64];
+    int found = 0;
+    unsigned long long val;
+
+    if (!fp)
+        return false;
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "syscr: %llu", &val) == 1) {
+            *reads = val;
+            found++;
+        } else if (sscanf(line, "syscw: %llu", &val) == 1) {
+            *writes = val;
+            found++;
+        }
+    }
+    fclose(fp);
+    return found == 2;
+#else
+    return false;
+#endif
+}
@@ -0,0 +1,33 @@
+/* mklbr - create .lbr archives from recipes
+ * Copyright (C) - 2020-2023 Mark Ogden
+ *
+ * procstat.h - process CPU time, memory and I/O counters
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef _PROCSTAT_H_
+#define _PROCSTAT_H_
+#include <stdbool.h>
+#include <stdint.h>
+
+double cpuTime(bool thisThread); // CPU seconds used by the process, or by the calling thread
+long peakRss(void);              // peak resident set size in KB, 0 if not known
+
+// read and write system calls made by the process so far
+// returns false if the operating system does not report them
+bool ioCalls(uint64_t *reads, uint64_t *writes);
+
+#endif
@@ -0,0 +1,230 @@
+/* mklbr - create .lbr archives from recipes
+ * Copyright (C) - 2020-2023 Mark Ogden
+ *
+ * squeeze.c - compress members in the CP/M squeeze format
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * The format is that of SQ and USQ. The file is run length encoded, a run being the byte
+ * followed by DLE and the run length, with each DLE itself sent as DLE 0 and never run
+ * length encoded. The result, and a special end of file value, is Huffman coded with codes
+ * of at most 16 bits. The squeezed file is
+ *   0xFF76              recognition word, all words little endian
+ *   checksum            sum of the original bytes
+ *   name '\0'           original file name
+ *   numnodes            nodes in the decoding tree, the root being node 0
+ *   node[numnodes]      child for a 0 bit and for a 1 bit, a node number or -(value + 1)
+ *   codes               packed least significant bit first, ending with the end code
+ */
+#include "squeeze.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define RECOGNIZE 0xff76
+#define DLE       0x90
+#define SPEOF     256 // end of file value
+#define NVALS     257
+#define MAXBITS   16 // longest code, as USQ versions rely on
+
+typedef struct {
+    uint32_t weight[2 * NVALS];
+    int child[2 * NVALS][2]; // internal nodes, numbered from NVALS
+    int depth[2 * NVALS];
+    uint64_t code[2 * NVALS]; // path from the root, first bit in bit 0
+    int nNodes;               // next internal node
+} tree_t;
+
+// run length encode len bytes of in to out, which must hold 2 * len bytes
+static size_t runLength(uint8_t const *in, size_t len, uint8_t *out) {
+    uint8_t *t = out;
+    for (size_t i = 0; i < len;) {
+        uint8_t c  = in[i];
+        size_t run = 1;
+        if (c == DLE) { // never repeated, as SQ does
+            *t++ = DLE;
+            *t++ = 0;
+            i++;
+            continue;
+        }
+        while (i + run < len && in[i + run] == c && run < 255)
+            run++;
+        *t++ = c;
+        if (run > 2) { // shorter as c DLE run
+            *t++ = DLE;
+            *t++ = (uint8_t)run;
+            i += run;
+        } else
+            i++;
+    }
+    return t - out;
+}
+
+// binary heap of node numbers, lightest first, ties to the lower number so the tree
+// does not depend on the heap's history
+static bool lighter(tree_t const *t, int a, int b) {
+    return t->weight[a] < t->weight[b] || (t->weight[a] == t->weight[b] && a < b);
+}
+
+static void heapPush(tree_t const *t, int *heap, int *n, int node) {
+    int i = (*n)++;
+    for (; i > 0 && lighter(t, node, heap[(i - 1) / 2]); i = (i - 1) / 2)
+        heap[i] = heap[(i - 1) / 2];
+    heap[i] = node;
+}
+
+static int heapPop(tree_t const *t, int *heap, int *n) {
+    int top  = heap[0];
+    int last = heap[--*n];
+    int i    = 0;
+    for (int c; (c = 2 * i + 1) < *n; i = c) {
+        if (c + 1 < *n && lighter(t, heap[c + 1], heap[c]))
+            c++;
+        if (!lighter(t, heap[c], last))
+            break;
+        heap[i] = heap[c];
+    }
+    heap[i] = last;
+    return top;
+}
+
+// build the Huffman tree of the values with non zero weights, returning the root and
+// the longest code
+static int buildTree(tree_t *t, int *maxDepth) {
+    int heap[NVALS];
+    int n = 0;
+
+    t->nNodes = NVALS;
+    for (int i = 0; i < NVALS; i++)
+        if (t->weight[i])
+            heapPush(t, heap, &n, i);
+    if (n == 1) { // only the end code, the root has it as both children
+        int leaf           = heap[0];
+        t->child[NVALS][0] = leaf;
+        t->child[NVALS][1] = leaf;
+        t->weight[NVALS]   = t->weight[leaf];
+        t->nNodes          = NVALS + 1;
+    }
+    while (n > 1) {
+        int a             = heapPop(t, heap, &n);
+        int b             = heapPop(t, heap, &n);
+        int node          = t->nNodes++;
+        t->child[node][0] = a;
+        t->child[node][1] = b;
+        t->weight[node]   = t->weight[a] + t->weight[b];
+        heapPush(t, heap, &n, node);
+    }
+    // children are always numbered below their parent, so one pass down sets the depths
+    int root       = t->nNodes - 1;
+    t->depth[root] = 0;
+    t->code[root]  = 0;
+    *maxDepth      = 0;
+    for (int node = root; node >= NVALS; node--)
+        for (int j = 0; j < 2; j++) {
+            int c       = t->child[node][j];
+            t->depth[c] = t->depth[node] + 1;
+            t->code[c]  = t->code[node] | (uint64_t)j << t->depth[node];
+            if (t->depth[c] > *maxDepth)
+                *maxDepth = t->depth[c];
+        }
+    return root;
+}
+
+static uint8_t *putWord(uint8_t *s, unsigned w) {
+    *s++ = w % 256;
+    *s++ = (w / 256) % 256;
+    return s;
+}
+
+bool squeeze(uint8_t const *in, size_t len, char const *name, uint8_t **out, size_t *outLen) {
+    uint8_t *rle         = malloc(2 * len + 1);
+    tree_t *t            = calloc(1, sizeof(tree_t));
+    uint32_t freq[NVALS] = { 0 };
+    unsigned checksum    = 0;
+    int maxDepth;
+    int root;
+
+    *out = NULL;
+    if (!rle || !t) {
+        free(rle);
+        free(t);
+        return false;
+    }
+    size_t rleLen = runLength(in, len, rle);
+    for (size_t i = 0; i < len; i++)
+        checksum += in[i];
+    for (size_t i = 0; i < rleLen; i++)
+        freq[rle[i]]++;
+    freq[SPEOF] = 1;
+
+    // halve the weights until no code is too long, as SQ does
+    memcpy(t->weight, freq, sizeof(freq));
+    while ((root = buildTree(t, &maxDepth)), maxDepth > MAXBITS) {
+        for (int i = 0; i < NVALS; i++)
+            freq[i] = freq[i] ? (freq[i] + 1) / 2 : 0;
+        memset(t, 0, sizeof(tree_t));
+        memcpy(t->weight, freq, sizeof(freq));
+    }
+
+    // number the nodes breadth first from the root, which is node 0
+    int order[NVALS];  // tree node for each output node
+    int number[NVALS]; // output node for each tree node, indexed from NVALS
+    int nOut             = 0;
+    order[nOut++]        = root;
+    number[root - NVALS] = 0;
+    for (int i = 0; i < nOut; i++)
+        for (int j = 0; j < 2; j++) {
+            int c = t->child[order[i]][j];
+            if (c >= NVALS) {
+                number[c - NVALS] = nOut;
+                order[nOut++]     = c;
+            }
+        }
+
+    size_t size = 4 + strlen(name) + 1 + 2 + 4 * nOut + (rleLen + 1) * MAXBITS / 8 + 2;
+    uint8_t *s  = *out = malloc(size);
+    if (!s) {
+        free(rle);
+        free(t);
+        return false;
+    }
+    s = putWord(s, RECOGNIZE);
+    s = putWord(s, checksum);
+    strcpy((char *)s, name);
+    s += strlen(name) + 1;
+    s = putWord(s, nOut);
+    for (int i = 0; i < nOut; i++)
+        for (int j = 0; j < 2; j++) {
+            int c = t->child[order[i]][j];
+            s     = putWord(s, c >= NVALS ? (unsigned)number[c - NVALS] : (unsigned)(-(c + 1)));
+        }
+
+    uint32_t acc = 0; // bits not yet written, least significant first
+    int nBits    = 0;
+    for (size_t i = 0; i <= rleLen; i++) {
+        int v = i < rleLen ? rle[i] : SPEOF;
+        acc |= (uint32_t)t->code[v] << nBits;
+        nBits += t->depth[v];
+        for (; nBits >= 8; nBits -= 8, acc >>= 8)
+            *s++ = (uint8_t)acc;
+    }
+    if (nBits)
+        *s++ = (uint8_t)acc;
+    *outLen = s - *out;
+    free(rle);
+    free(t);
+    return true;
+}
@@ -0,0 +1,31 @@
+/* mklbr - create .lbr archives from recipes
+ * Copyright (C) - 2020-2023 Mark Ogden
+ *
+ * squeeze.h - compress members in the CP/M squeeze format
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef _SQUEEZE_H_
+#define _SQUEEZE_H_
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// squeeze the len bytes of in, recording name as the original file name, as SQ does
+// *out is allocated, and freed by the caller. Returns false if out of memory
+bool squeeze(uint8_t const *in, size_t len, char const *name, uint8_t **out, size_t *outLen);
+
+#endif
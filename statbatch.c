@@ -0,0 +1,309 @@
+/* mklbr - create .lbr archives from recipes
+ * Copyright (C) - 2020-2023 Mark Ogden
+ *
+ * statbatch.c - look up the metadata of many files at once
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * On a cold or network file system each stat is a round trip, so looking up thousands of
+ * members one after another is slow. Here the lookups are all issued together, as statx
+ * requests on an io_uring where the kernel supports it, otherwise spread over a pool of
+ * threads each calling stat. The io_uring is driven directly through its system calls as
+ * only a single operation is used. Requests the kernel rejects as unsupported are redone
+ * by the threads.
+ */
+#ifdef __linux__
+#define _GNU_SOURCE // statx
+#endif
+#include "statbatch.h"
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <threads.h>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+#endif
+
+#define STATTHREADS 16 // lookups in flight when using threads
+#define MINBATCH    16 // fewer files than this are looked up serially
+#define RINGSIZE    256
+
+void setMeta(fileMeta_t *f, struct stat const *st) {
+    f->err   = 0;
+    f->dev   = st->st_dev;
+    f->ino   = st->st_ino;
+    f->size  = st->st_size;
+    f->mtime = st->st_mtime;
+    f->ctime = st->st_ctime;
+#if defined(__linux__)
+    f->mtimeNs = st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+    f->ctimeNs = st->st_ctim.tv_sec * 1000000000LL + st->st_ctim.tv_nsec;
+#elif defined(__APPLE__)
+    f->mtimeNs = st->st_mtimespec.tv_sec * 1000000000LL + st->st_mtimespec.tv_nsec;
+    f->ctimeNs = st->st_ctimespec.tv_sec * 1000000000LL + st->st_ctimespec.tv_nsec;
+#else
+    f->mtimeNs = st->st_mtime * 1000000000LL;
+    f->ctimeNs = st->st_ctime * 1000000000LL;
+#endif
+}
+
+static void statOne(fileMeta_t *f) {
+    struct stat stbuf;
+    if (stat(f->path, &stbuf) != 0)
+        f->err = errno ? errno : ENOENT;
+    else
+        setMeta(f, &stbuf);
+}
+
+/*
+ * thread pool version. Each thread claims the next block of 8 files until all are done
+ */
+typedef struct {
+    fileMeta_t **files;
+    size_t n;
+    size_t next;
+    mtx_t lock;
+} pool_t;
+
+static int statWorker(void *arg) {
+    pool_t *p = arg;
+    for (;;) {
+        mtx_lock(&p->lock);
+        size_t i = p->next;
+        p->next += i < p->n ? 8 : 0;
+        mtx_unlock(&p->lock);
+        if (i >= p->n)
+            return 0;
+        for (size_t end = i + 8 < p->n ? i + 8 : p->n; i < end; i++)
+            statOne(p->files[i]);
+    }
+}
+
+static char const *statThreads(fileMeta_t **files, size_t n) {
+    pool_t p = { files, n, 0 };
+    thrd_t threads[STATTHREADS - 1];
+    int started = 0;
+
+    if (n < MINBATCH) {
+        for (size_t i = 0; i < n; i++)
+            statOne(files[i]);
+        return "serial";
+    }
+    mtx_init(&p.lock, mtx_plain);
+    while (started < STATTHREADS - 1 && (size_t)started * 8 < n &&
+           thrd_create(&threads[started], statWorker, &p) == thrd_success)
+        started++;
+    statWorker(&p); // main thread helps too
+    for (int i = 0; i < started; i++)
+        thrd_join(threads[i], NULL);
+    mtx_destroy(&p.lock);
+    return started ? "threads" : "serial";
+}
+
+#ifdef __linux__
+typedef struct {
+    int fd;
+    unsigned entries;
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sqRing, *cqRing;
+    size_t sqLen, cqLen, sqesLen;
+} ring_t;
+
+static void ringClose(ring_t *r) {
+    if (r->sqes)
+        munmap(r->sqes, r->sqesLen);
+    if (r->cqRing && r->cqRing != r->sqRing)
+        munmap(r->cqRing, r->cqLen);
+    if (r->sqRing)
+        munmap(r->sqRing, r->sqLen);
+    close(r->fd);
+}
+
+static bool ringOpen(ring_t *r, unsigned entries) {
+    struct io_uring_params p;
+
+    memset(r, 0, sizeof(*r));
+    memset(&p, 0, sizeof(p));
+    if ((r->fd = (int)syscall(__NR_io_uring_setup, entries, &p)) < 0)
+        return false; // not supported or not permitted
+    r->entries = p.sq_entries;
+    r->sqLen   = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cqLen   = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->sqesLen = p.sq_entries * sizeof(struct io_uring_sqe);
+    if ((p.features & IORING_FEAT_SINGLE_MMAP) && r->cqLen > r->sqLen)
+        r->sqLen = r->cqLen;
+    r->sqRing = mmap(NULL, r->sqLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd,
+                     IORING_OFF_SQ_RING);
+    if (r->sqRing == MAP_FAILED) {
+        r->sqRing = NULL;
+        ringClose(r);
+        return false;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        r->cqRing = r->sqRing;
+    else if ((r->cqRing = mmap(NULL, r->cqLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                               r->fd, IORING_OFF_CQ_RING)) == MAP_FAILED) {
+        r->cqRing = NULL;
+        ringClose(r);
+        return false;
+    }
+    if ((r->sqes = mmap(NULL, r->sqesLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        r->fd, IORING_OFF_SQES)) == MAP_FAILED) {
+        r->sqes = NULL;
+        ringClose(r);
+        return false;
+    }
+    r->sqHead  = (unsigned *)((char *)r->sqRing + p.sq_off.head);
+    r->sqTail  = (unsigned *)((char *)r->sqRing + p.sq_off.tail);
+    r->sqMask  = (unsigned *)((char *)r->sqRing + p.sq_off.ring_mask);
+    r->sqArray = (unsigned *)((char *)r->sqRing + p.sq_off.array);
+    r->cqHead  = (unsigned *)((char *)r->cqRing + p.cq_off.head);
+    r->cqTail  = (unsigned *)((char *)r->cqRing + p.cq_off.tail);
+    r->cqMask  = (unsigned *)((char *)r->cqRing + p.cq_off.ring_mask);
+    r->cqes    = (struct io_uring_cqe *)((char *)r->cqRing + p.cq_off.cqes);
+    return true;
+}
+
+/*
+ * keeps up to the ring size of statx requests in flight, each with its own result buffer
+ * slot. The completion ring is twice the size of the submission ring so cannot overflow.
+ * Files the kernel could not handle are left in retry for the thread pool, their err is -1
+ * until they complete.
+ * returns false if the ring could not be used at all
+ */
+static bool statRing(fileMeta_t **files, size_t n, fileMeta_t **retry, size_t *nRetry) {
+    ring_t r;
+    if (!ringOpen(&r, RINGSIZE))
+        return false;
+
+    struct statx *stx = malloc(r.entries * sizeof(struct statx));
+    unsigned *freeSlot = malloc(r.entries * sizeof(unsigned));
+    if (!stx || !freeSlot) {
+        free(stx);
+        free(freeSlot);
+        ringClose(&r);
+        return false;
+    }
+    unsigned nFree = r.entries;
+    for (unsigned i = 0; i < r.entries; i++)
+        freeSlot[i] = i;
+
+    size_t next = 0, done = 0;
+    *nRetry     = 0;
+    for (size_t i = 0; i < n; i++)
+        files[i]->err = -1;
+    while (done < n) {
+        unsigned tail = *r.sqTail; // only this thread adds to the submission ring
+        for (; next < n && nFree; next++) {
+            unsigned slot             = freeSlot[--nFree];
+            unsigned idx              = tail++ & *r.sqMask;
+            struct io_uring_sqe *sqe  = &r.sqes[idx];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode      = IORING_OP_STATX;
+            sqe->fd          = AT_FDCWD;
+            sqe->addr        = (uintptr_t)files[next]->path;
+            sqe->len         = STATX_BASIC_STATS; // the mask
+            sqe->off         = (uintptr_t)&stx[slot];
+            sqe->statx_flags = 0;
+            sqe->user_data   = (uint64_t)slot << 32 | next;
+            r.sqArray[idx]   = idx;
+        }
+        __atomic_store_n(r.sqTail, tail, __ATOMIC_RELEASE);
+        // also resubmit any the kernel did not take last time
+        unsigned submit = tail - __atomic_load_n(r.sqHead, __ATOMIC_ACQUIRE);
+        if (syscall(__NR_io_uring_enter, r.fd, submit, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+            errno != EINTR) {
+            // requests may still be in flight, so the result buffers cannot be freed
+            *nRetry = 0;
+            for (size_t i = 0; i < n; i++)
+                if (files[i]->err == -1)
+                    retry[(*nRetry)++] = files[i];
+            ringClose(&r);
+            free(freeSlot);
+            return true;
+        }
+        unsigned head  = *r.cqHead;
+        unsigned cTail = __atomic_load_n(r.cqTail, __ATOMIC_ACQUIRE);
+        for (; head != cTail; head++, done++) {
+            struct io_uring_cqe const *cqe = &r.cqes[head & *r.cqMask];
+            unsigned slot                  = (unsigned)(cqe->user_data >> 32);
+            fileMeta_t *f                  = files[(uint32_t)cqe->user_data];
+            struct statx const *s          = &stx[slot];
+            if (cqe->res == -EINVAL || cqe->res == -EOPNOTSUPP)
+                retry[(*nRetry)++] = f; // statx not supported by this kernel's io_uring
+            else if (cqe->res < 0)
+                f->err = -cqe->res;
+            else {
+                f->err     = 0;
+                f->dev     = makedev(s->stx_dev_major, s->stx_dev_minor); // as st_dev
+                f->ino     = s->stx_ino;
+                f->size    = s->stx_size;
+                f->mtime   = s->stx_mtime.tv_sec;
+                f->ctime   = s->stx_ctime.tv_sec;
+                f->mtimeNs = s->stx_mtime.tv_sec * 1000000000LL + s->stx_mtime.tv_nsec;
+                f->ctimeNs = s->stx_ctime.tv_sec * 1000000000LL + s->stx_ctime.tv_nsec;
+            }
+            freeSlot[nFree++] = slot;
+        }
+        __atomic_store_n(r.cqHead, head, __ATOMIC_RELEASE);
+    }
+    ringClose(&r);
+    free(stx);
+    free(freeSlot);
+    return true;
+}
+#endif
+
+char const *statBatch(fileMeta_t *files, size_t n) {
+    fileMeta_t **todo = malloc((n ? n : 1) * sizeof(fileMeta_t *));
+    char const *method;
+
+    if (!todo) { // fall back to one at a time
+        for (size_t i = 0; i < n; i++)
+            statOne(&files[i]);
+        return "serial";
+    }
+    for (size_t i = 0; i < n; i++)
+        todo[i] = &files[i];
+#ifdef __linux__
+    size_t nRetry;
+    fileMeta_t **retry = malloc((n ? n : 1) * sizeof(fileMeta_t *));
+    if (n >= MINBATCH && retry && statRing(todo, n, retry, &nRetry)) {
+        method = "io_uring";
+        if (nRetry)
+            statThreads(retry, nRetry);
+    } else
+        method = statThreads(todo, n);
+    free(retry);
+#else
+    method = statThreads(todo, n);
+#endif
+    free(todo);
+    return method;
+}
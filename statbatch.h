@@ -0,0 +1,48 @@
+/* mklbr - create .lbr archives from recipes
+ * Copyright (C) - 2020-2023 Mark Ogden
+ *
+ * statbatch.h - look up the metadata of many files at once
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef _STATBATCH_H_
+#define _STATBATCH_H_
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+// the parts of stat the lbr needs
+typedef struct {
+    char const *path;
+    int err; // 0 if found, else the errno
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtimeNs; // nanoseconds where the file system supports it
+    int64_t ctimeNs;
+    time_t mtime;
+    time_t ctime;
+} fileMeta_t;
+
+// fill in the metadata of the n files, overlapping the lookups using io_uring where the
+// kernel supports it, otherwise a pool of threads
+// returns the method used: "io_uring", "threads" or "serial"
+char const *statBatch(fileMeta_t *files, size_t n);
+
+struct stat;
+void setMeta(fileMeta_t *f, struct stat const *st); // fill in f from a stat result
+
+#endif
@@ -0,0 +1,502 @@
+/* mklbr - create .lbr archives from recipes
+ * Copyright (C) - 2020-2023 Mark Ogden
+ *
+ * tar.c - take the members of a library from a tar
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * A tar is read once, from the start, as a sequence of 512 byte headers each followed by
+ * its data padded to 512 bytes, ending at a zero block. ustar, pax and GNU tars are
+ * understood: a pax extended header or GNU long name applies to the entry that follows.
+ * Nothing is extracted. The library's directory comes before the data, so the headers are
+ * all read before any member is written. If the tar is a regular file, including stdin
+ * redirected from one, each member is a read callback that seeks to its data when the
+ * library is finished, so the data is read once, by the copy and CRC pass. A pipe cannot
+ * be reread, so there the data is held in memory, which the 8M limit of a library bounds.
+ */
+#include "tar.h"
+#include "walk.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <threads.h>
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#define S_ISREG(m) (((m) & _S_IFMT) == _S_IFREG)
+#define fseeko     _fseeki64
+typedef int64_t off_t;
+#else
+#include <unistd.h>
+#endif
+
+#pragma warning(disable : 4996)
+
+#define BLOCK   512
+#define MAXHELD (0xffffL * 128) // data held from a pipe, the most a library can hold
+#define MAXMETA (1024 * 1024)   // size of a pax header or GNU long name
+
+// header field offsets
+enum { Name = 0, Size = 124, Mtime = 136, Chksum = 148, Type = 156, Linkname = 157,
+       Magic = 257, Prefix = 345 };
+
+// a regular file in the tar
+typedef struct {
+    tarIn_t *t;
+    char *path;
+    off_t offset;       // of its data, if the tar is seekable
+    size_t size;
+    size_t pos;         // read so far
+    uint8_t *data;      // its data, if the tar is a pipe
+    bool ownsData;      // false for a hard link
+} tarEntry_t;
+
+struct tarIn {
+    FILE *fp;
+    char const *name;   // for messages
+    bool seekable;
+    off_t size;         // of a seekable tar
+    off_t offset;       // of the next header
+    mtx_t lock;         // serialises the callbacks' seek and read
+    tarEntry_t **entries;
+    int nEntries;
+    size_t held;        // bytes of data held
+};
+
+// the parts of a pax extended header or GNU long names used, for the next entry
+typedef struct {
+    char *buf;          // pax records
+    char *longName;     // GNU L
+    char *longLink;     // GNU K
+    char const *path;
+    char const *linkpath;
+    uint64_t size;
+    bool hasSize;
+    int64_t mtime;
+    bool hasMtime;
+} pending_t;
+
+tarIn_t *tarOpen(char const *path) {
+    tarIn_t *t = calloc(1, sizeof(tarIn_t));
+    struct stat st;
+
+    if (!t) {
+        fprintf(stderr, "out of memory\n");
+        return NULL;
+    }
+    if (strcmp(path, "-") == 0) {
+        t->fp   = stdin;
+        t->name = "stdin";
+#ifdef _WIN32
+        _setmode(_fileno(stdin), _O_BINARY);
+#endif
+    } else if ((t->fp = fopen(path, "rb")) == NULL) {
+        fprintf(stderr, "cannot open %s\n", path);
+        free(t);
+        return NULL;
+    } else
+        t->name = path;
+    if ((t->seekable = fstat(fileno(t->fp), &st) == 0 && S_ISREG(st.st_mode)))
+        t->size = st.st_size;
+    mtx_init(&t->lock, mtx_plain);
+    return t;
+}
+
+void tarClose(tarIn_t *t) {
+    if (!t)
+        return;
+    for (int i = 0; i < t->nEntries; i++) {
+        if (t->entries[i]->ownsData)
+            free(t->entries[i]->data);
+        free(t->entries[i]->path);
+        free(t->entries[i]);
+    }
+    free(t->entries);
+    if (t->fp != stdin)
+        fclose(t->fp);
+    mtx_destroy(&t->lock);
+    free(t);
+}
+
+// read len bytes of the tar, false at the end or on error
+static bool readTar(tarIn_t *t, void *buf, size_t len) {
+    if (fread(buf, 1, len, t->fp) != len)
+        return false;
+    t->offset += len;
+    return true;
+}
+
+// skip len bytes, seeking if possible
+static bool skipTar(tarIn_t *t, uint64_t len) {
+    uint8_t buf[BLOCK * 8];
+
+    if (t->seekable) {
+        if (fseeko(t->fp, t->offset + (off_t)len, SEEK_SET) != 0)
+            return false;
+        t->offset += len;
+        return true;
+    }
+    for (size_t n; len; len -= n)
+        if (!readTar(t, buf, n = len < sizeof(buf) ? (size_t)len : sizeof(buf)))
+            return false;
+    return true;
+}
+
+static uint64_t padded(uint64_t len) {
+    return (len + BLOCK - 1) / BLOCK * BLOCK;
+}
+
+// a numeric header field, in octal, or for large values GNU base-256 with the top bit set
+static uint64_t tarNumber(uint8_t const *f, int len) {
+    uint64_t n = 0;
+    int i      = 0;
+
+    if (f[0] & 0x80) {
+        if (f[0] & 0x40) // negative, only possible for times
+            return 0;
+        for (n = f[0] & 0x3f; ++i < len;)
+            n = (n << 8) | f[i];
+        return n;
+    }
+    while (i < len && (f[i] == ' ' || f[i] == '\0'))
+        i++;
+    for (; i < len && '0' <= f[i] && f[i] <= '7'; i++)
+        n = n * 8 + f[i] - '0';
+    return n;
+}
+
+// the checksum is the sum of the header bytes with itself as spaces, some old tars summing
+// them as signed
+static bool validHeader(uint8_t const *h) {
+    uint64_t sum = 0;
+    int64_t ssum = 0;
+
+    for (int i = 0; i < BLOCK; i++) {
+        uint8_t c = Chksum <= i && i < Chksum + 8 ? ' ' : h[i];
+        sum += c;
+        ssum += (int8_t)c;
+    }
+    uint64_t stored = tarNumber(h + Chksum, 8);
+    return stored == sum || stored == (uint64_t)ssum;
+}
+
+static bool zeroBlock(uint8_t const *h) {
+    for (int i = 0; i < BLOCK; i++)
+        if (h[i])
+            return false;
+    return true;
+}
+
+// the data of a pax header or GNU long name, NUL terminated
+static char *readMeta(tarIn_t *t, uint64_t size) {
+    char *buf;
+
+    if (size > MAXMETA || (buf = malloc((size_t)size + 1)) == NULL)
+        return NULL;
+    if (!readTar(t, buf, (size_t)size) || !skipTar(t, padded(size) - size)) {
+        free(buf);
+        return NULL;
+    }
+    buf[size] = '\0';
+    return buf;
+}
+
+// pax records are "length key=value\n", the length including itself
+static void paxRecords(char *s, char *end, pending_t *p) {
+    while (s < end) {
+        char *value;
+        unsigned long n = strtoul(s, &value, 10);
+        if (n == 0 || *value != ' ' || n > (unsigned long)(end - s) || s[n - 1] != '\n')
+            return;
+        char *key = value + 1;
+        s[n - 1]  = '\0';
+        s += n;
+        if ((value = strchr(key, '=')) == NULL)
+            continue;
+        *value++ = '\0';
+        if (strcmp(key, "path") == 0)
+            p->path = value;
+        else if (strcmp(key, "linkpath") == 0)
+            p->linkpath = value;
+        else if (strcmp(key, "size") == 0) {
+            p->size    = strtoull(value, NULL, 10);
+            p->hasSize = true;
+        } else if (strcmp(key, "mtime") == 0) { // fractional seconds are dropped
+            p->mtime    = strtoll(value, NULL, 10);
+            p->hasMtime = true;
+        }
+    }
+}
+
+static void clearPending(pending_t *p) {
+    free(p->buf);
+    free(p->longName);
+    free(p->longLink);
+    memset(p, 0, sizeof(*p));
+}
+
+// a header string field, which need not be NUL terminated
+static char *field(char *buf, uint8_t const *f, int len) {
+    memcpy(buf, f, len);
+    buf[len] = '\0';
+    return buf;
+}
+
+// the path without leading ./ or /, as recipes name it
+static char const *tarPath(char const *path) {
+    for (;;)
+        if (path[0] == '/')
+            path++;
+        else if (path[0] == '.' && path[1] == '/')
+            path += 2;
+        else
+            return path;
+}
+
+// true if the tar path s matches pattern p a component at a time, as expandPattern
+// matches files: ** matches any number of directories, an empty last component any name,
+// and hidden names are only matched by a component starting with '.'
+static bool pathMatch(char const *p, char const *s) {
+    char pComp[256], sComp[256];
+    char const *pEnd = strchr(p, '/');
+    char const *sEnd = strchr(s, '/');
+    size_t pLen      = pEnd ? (size_t)(pEnd - p) : strlen(p);
+    size_t sLen      = sEnd ? (size_t)(sEnd - s) : strlen(s);
+
+    if (pLen == 2 && strncmp(p, "**", 2) == 0) {
+        if (!pEnd) // every file below
+            return *s != '.' && (!sEnd || pathMatch(p, sEnd + 1));
+        for (;;) {
+            if (pathMatch(pEnd + 1, s))
+                return true;
+            if (!sEnd || *s == '.')
+                return false;
+            s    = sEnd + 1;
+            sEnd = strchr(s, '/');
+        }
+    }
+    if (pLen >= sizeof(pComp) || sLen >= sizeof(sComp) || sLen == 0)
+        return false;
+    if (*s == '.' && *p != '.')
+        return false;
+    if (pLen && !globMatch(field(pComp, (uint8_t const *)p, (int)pLen),
+                           field(sComp, (uint8_t const *)s, (int)sLen)))
+        return false;
+    if (!pEnd || !sEnd)
+        return !pEnd && !sEnd;
+    return pathMatch(pEnd + 1, sEnd + 1);
+}
+
+static bool hidden(char const *path) {
+    for (char const *s = path; s; s = strchr(s, '/'))
+        if (*(s += *s == '/') == '.')
+            return true;
+    return false;
+}
+
+// the first recipe matching path, -1 if none. A recipe matches the entry it names exactly,
+// even if the name has wildcard characters, as well as those its pattern matches, but one
+// giving an lbrname only matches exactly
+static int findRecipe(char const *path, tarRecipe_t const *recipes, int nRecipes) {
+    for (int i = 0; i < nRecipes; i++) {
+        char const *src = tarPath(recipes[i].src);
+        if (strcmp(src, path) == 0 ||
+            (!recipes[i].name && isPattern(src) && pathMatch(src, path)))
+            return i;
+    }
+    return -1;
+}
+
+static tarEntry_t *findEntry(tarIn_t *t, char const *path) {
+    for (int i = t->nEntries; i-- > 0;)
+        if (strcmp(t->entries[i]->path, path) == 0)
+            return t->entries[i];
+    return NULL;
+}
+
+// read callback of a member from a seekable tar
+static long readEntry(void *ctx, void *buf, size_t len) {
+    tarEntry_t *e = ctx;
+    tarIn_t *t    = e->t;
+    size_t n      = 0;
+
+    if (len > e->size - e->pos)
+        len = e->size - e->pos;
+    if (len == 0)
+        return 0;
+    mtx_lock(&t->lock);
+    if (fseeko(t->fp, e->offset + (off_t)e->pos, SEEK_SET) == 0)
+        n = fread(buf, 1, len, t->fp);
+    mtx_unlock(&t->lock);
+    if (n == 0)
+        return -1;
+    e->pos += n;
+    return (long)n;
+}
+
+// record the regular file, or hard link to one, whose data starts at the current offset.
+// Returns LBR_OK, or an error with a message if it cannot be read or held
+static int newEntry(tarIn_t *t, lbr_t *lb, char const *path, uint64_t size,
+                    tarEntry_t const *link, tarEntry_t **entry) {
+    tarEntry_t **entries = realloc(t->entries, (t->nEntries + 1) * sizeof(tarEntry_t *));
+    tarEntry_t *e;
+
+    if (entries)
+        t->entries = entries;
+    if (!entries || (e = calloc(1, sizeof(tarEntry_t))) == NULL)
+        return lbrWarn(lb, "out of memory\n"), LBR_NOMEM;
+    if ((e->path = strdup(path)) == NULL) {
+        free(e);
+        return lbrWarn(lb, "out of memory\n"), LBR_NOMEM;
+    }
+    t->entries[t->nEntries++] = e;
+    e->t                      = t;
+    *entry                    = e;
+    if (link) { // shares the data of the earlier entry
+        e->offset = link->offset;
+        e->size   = link->size;
+        e->data   = link->data;
+        return LBR_OK;
+    }
+    e->offset = t->offset;
+    e->size   = (size_t)size;
+    if (t->seekable) { // checked against the size, as seeking past the end succeeds
+        if (size > (uint64_t)(t->size - t->offset) || !skipTar(t, padded(size)))
+            return lbrWarn(lb, "%s: truncated at %s\n", t->name, path), LBR_READ;
+        return LBR_OK;
+    }
+    if ((t->held += (size_t)size) > MAXHELD)
+        return lbrWarn(lb, "%s: members from a pipe exceed the 8M library limit\n", t->name),
+               LBR_TOOLARGE;
+    if ((e->data = malloc(size ? (size_t)size : 1)) == NULL)
+        return lbrWarn(lb, "out of memory\n"), LBR_NOMEM;
+    e->ownsData = true;
+    if (!readTar(t, e->data, (size_t)size) || !skipTar(t, padded(size) - size))
+        return lbrWarn(lb, "%s: truncated at %s\n", t->name, path), LBR_READ;
+    return LBR_OK;
+}
+
+int tarAdd(tarIn_t *t, lbr_t *lb, tarRecipe_t const *recipes, int nRecipes, bool squeeze) {
+    uint8_t h[BLOCK];
+    char name[101], prefix[156], link[101], path[257];
+    pending_t p = { 0 };
+    bool *used  = calloc(nRecipes + 1, sizeof(bool));
+    int status  = LBR_OK;
+    bool ended  = false; // seen the zero block ending the tar
+
+    if (!used)
+        return lbrWarn(lb, "out of memory\n"), LBR_NOMEM;
+    while (status == LBR_OK && readTar(t, h, BLOCK) && !(ended = zeroBlock(h))) {
+        if (!validHeader(h)) {
+            lbrWarn(lb, "%s: bad tar header at offset %lld\n", t->name,
+                    (long long)(t->offset - BLOCK));
+            status = LBR_READ;
+            break;
+        }
+        uint64_t size = tarNumber(h + Size, 12);
+        char type     = (char)h[Type];
+
+        if (type == 'x' || type == 'L' || type == 'K') { // applies to the next entry
+            char *meta = readMeta(t, size);
+            if (!meta) {
+                lbrWarn(lb, "%s: cannot read extended header\n", t->name);
+                status = LBR_READ;
+            } else if (type == 'x') {
+                free(p.buf);
+                paxRecords(p.buf = meta, meta + size, &p);
+            } else if (type == 'L') {
+                free(p.longName);
+                p.longName = meta;
+            } else {
+                free(p.longLink);
+                p.longLink = meta;
+            }
+            continue;
+        }
+        if (p.hasSize)
+            size = p.size;
+        if (memcmp(h + Magic, "ustar", 6) == 0 && h[Prefix]) // POSIX, not GNU
+            snprintf(path, sizeof(path), "%s/%s", field(prefix, h + Prefix, 155),
+                     field(name, h + Name, 100));
+        else
+            field(path, h + Name, 100);
+        char const *entryPath = tarPath(p.path ? p.path : p.longName ? p.longName : path);
+        char const *linkPath  = p.linkpath ? p.linkpath
+                              : p.longLink ? p.longLink
+                                           : field(link, h + Linkname, 100);
+        time_t tarTime = (time_t)(p.hasMtime ? p.mtime : (int64_t)tarNumber(h + Mtime, 12));
+        size_t len     = strlen(entryPath);
+        tarEntry_t *e  = NULL;
+
+        if ((type == '0' || type == '\0' || type == '7') && len && entryPath[len - 1] != '/')
+            status = newEntry(t, lb, entryPath, size, NULL, &e);
+        else if (type == '1') {
+            tarEntry_t const *target = findEntry(t, tarPath(linkPath));
+            if (target)
+                status = newEntry(t, lb, entryPath, 0, target, &e);
+            else
+                lbrWarn(lb, "%s: link to %s not found, skipped\n", entryPath, linkPath);
+            if (!skipTar(t, padded(size))) // normally none
+                status = LBR_READ;
+        } else {
+            if (type == '2')
+                lbrWarn(lb, "%s: symbolic link skipped\n", entryPath);
+            if (!skipTar(t, padded(size)))
+                status = LBR_READ;
+        }
+        if (e && status == LBR_OK) {
+            int i                = findRecipe(e->path, recipes, nRecipes);
+            tarRecipe_t const *r = i >= 0 ? &recipes[i] : NULL;
+            char const *base     = strrchr(e->path, '/');
+            char const *cpmName  = r && r->name ? r->name : base ? base + 1 : e->path;
+            time_t local         = lbrLocalTime(tarTime);
+            time_t mtime         = r && r->mtime != -1 ? r->mtime : local;
+            time_t ctime         = r && r->ctime != -1         ? r->ctime
+                                   : 0 < mtime && mtime < local ? mtime
+                                                                : local;
+
+            if (r)
+                used[i] = true;
+            if (r || !hidden(e->path)) {
+                lbrSetSqueeze(lb, r ? r->squeeze : squeeze);
+                status = t->seekable
+                             ? lbrAddCallback(lb, cpmName, e->size, readEntry, e, mtime, ctime)
+                             : lbrAddMem(lb, cpmName, e->data, e->size, mtime, ctime);
+                if (status == LBR_BADNAME) { // warned, the rest can still be added
+                    lbrWarn(lb, "%s: skipped, it needs a recipe giving a CP/M name\n", e->path);
+                    status = LBR_OK;
+                }
+            }
+        }
+        clearPending(&p);
+    }
+    if (status == LBR_OK && ferror(t->fp)) {
+        lbrWarn(lb, "%s: read error\n", t->name);
+        status = LBR_READ;
+    } else if (status == LBR_OK && !ended) { // an entry may be missing
+        lbrWarn(lb, "%s: truncated\n", t->name);
+        status = LBR_READ;
+    }
+    for (int i = 0; i < nRecipes; i++)
+        if (!used[i])
+            lbrWarn(lb, "Warning: %s matches nothing in %s\n", recipes[i].src, t->name);
+    clearPending(&p);
+    free(used);
+    return status;
+}
@@ -0,0 +1,49 @@
+/* mklbr - create .lbr archives from recipes
+ * Copyright (C) - 2020-2023 Mark Ogden
+ *
+ * tar.h - take the members of a library from a tar
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef _TAR_H_
+#define _TAR_H_
+#include "lbr.h"
+#include <stdbool.h>
+#include <time.h>
+
+// a recipe applied to the tar entries it matches, in place of their own name and times
+typedef struct {
+    char const *src;  // an entry's path, or a pattern matched against the paths
+    char const *name; // CP/M name, NULL for the filename part of the path
+    time_t mtime;     // -1 for the entry's time, see lbrAddFile
+    time_t ctime;
+    bool squeeze;
+} tarRecipe_t;
+
+typedef struct tarIn tarIn_t;
+
+// open the tar file path, - for stdin. NULL, with a message, if it cannot be opened
+tarIn_t *tarOpen(char const *path);
+
+// add each regular file in the tar to lb, applying the first of the recipes that matches
+// it, otherwise squeezing it if squeeze is set. Returns LBR_OK, or an error if the tar
+// cannot be read, in which case the library should not be finished
+int tarAdd(tarIn_t *t, lbr_t *lb, tarRecipe_t const *recipes, int nRecipes, bool squeeze);
+
+// close the tar, once the library is finished, as its members may be read from it
+void tarClose(tarIn_t *t);
+
+#endif
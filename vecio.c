@@ -0,0 +1,117 @@
+/* mklbr - create .lbr archives from recipes
+ * Copyright (C) - 2020-2023 Mark Ogden
+ *
+ * vecio.c - whole file reads and vectored writes for small members
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Most CP/M members are a few sectors, so the cost of copying them is in the system calls
+ * rather than the data. A file read whole with open, pread and close avoids the fstat and
+ * buffer stdio adds, and a run of small members gathered into one writev replaces a write
+ * per member, or per stdio buffer. The stream is flushed first and repositioned after, so
+ * stdio and the vectored writes can be mixed. Windows falls back to stdio.
+ */
+#include "vecio.h"
+#include <string.h>
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+#pragma warning(disable : 4996)
+
+int readWhole(char const *path, void *buf, size_t size) {
+#ifdef _WIN32
+    FILE *fp = fopen(path, "rb");
+    if (!fp)
+        return VEC_OPENERR;
+    size_t n = fread(buf, 1, size, fp);
+    fclose(fp);
+    return n == size ? VEC_OK : VEC_READERR;
+#else
+    int fd      = open(path, O_RDONLY);
+    size_t done = 0;
+    if (fd < 0)
+        return VEC_OPENERR;
+    while (done < size) {
+        ssize_t n = pread(fd, (char *)buf + done, size - done, done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        done += n;
+    }
+    close(fd);
+    return done == size ? VEC_OK : VEC_READERR;
+#endif
+}
+
+void vecAdd(vecBatch_t *b, void const *data, size_t len) {
+    if (!len)
+        return;
+    if (b->n && (char const *)b->vec[b->n - 1].base + b->vec[b->n - 1].len == data)
+        b->vec[b->n - 1].len += len;
+    else {
+        b->vec[b->n].base  = data;
+        b->vec[b->n++].len = len;
+    }
+    b->len += len;
+}
+
+bool vecFull(vecBatch_t const *b) {
+    return b->n >= VEC_MAX - 1; // room for a member's data and its padded tail
+}
+
+bool vecWrite(vecBatch_t *b, FILE *fp) {
+    bool ok = fflush(fp) == 0;
+#ifdef _WIN32
+    for (int i = 0; ok && i < b->n; i++)
+        ok = fwrite(b->vec[i].base, 1, b->vec[i].len, fp) == b->vec[i].len;
+#else
+    struct iovec iov[VEC_MAX];
+    int out     = fileno(fp);
+    off_t start = lseek(out, 0, SEEK_CUR); // -1 for a pipe, which writev appends to
+    int first   = 0;
+
+    for (int i = 0; i < b->n; i++) {
+        iov[i].iov_base = (void *)b->vec[i].base;
+        iov[i].iov_len  = b->vec[i].len;
+    }
+    while (ok && first < b->n) {
+        ssize_t n = writev(out, iov + first, b->n - first);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            ok = false;
+        else { // skip what was written, which may end within a range
+            while (first < b->n && (size_t)n >= iov[first].iov_len)
+                n -= iov[first++].iov_len;
+            if (first < b->n) {
+                iov[first].iov_base = (char *)iov[first].iov_base + n;
+                iov[first].iov_len -= n;
+            }
+        }
+    }
+    if (ok && start >= 0) // bring stdio's idea of the position up to date
+        ok = fseeko(fp, start + (off_t)b->len, SEEK_SET) == 0;
+#endif
+    b->n   = 0;
+    b->len = 0;
+    return ok;
+}
@@ -0,0 +1,50 @@
+/* mklbr - create .lbr archives from recipes
+ * Copyright (C) - 2020-2023 Mark Ogden
+ *
+ * vecio.h - whole file reads and vectored writes for small members
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef _VECIO_H_
+#define _VECIO_H_
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+// read the first size bytes of path into buf with one open, read and close, without stdio
+// returns VEC_OK, or VEC_OPENERR or VEC_READERR, the latter if the file is shorter
+enum { VEC_OK, VEC_OPENERR, VEC_READERR };
+int readWhole(char const *path, void *buf, size_t size);
+
+// ranges of memory gathered to be written together
+#define VEC_MAX 64
+typedef struct {
+    struct {
+        void const *base;
+        size_t len;
+    } vec[VEC_MAX];
+    int n;
+    size_t len; // total of the ranges
+} vecBatch_t;
+
+// add a range, merging it with the last if they are contiguous. The caller checks vecFull
+void vecAdd(vecBatch_t *b, void const *data, size_t len);
+bool vecFull(vecBatch_t const *b);
+
+// write the batch at fp's position, with one writev where supported, and empty it
+bool vecWrite(vecBatch_t *b, FILE *fp);
+
+#endif
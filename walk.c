@@ -0,0 +1,444 @@
+/* mklbr - create .lbr archives from recipes
+ * Copyright (C) - 2020-2023 Mark Ogden
+ *
+ * walk.c - expand directories and wildcard patterns in recipes
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * The pattern is split into path components and the tree is walked one component at a
+ * time, only reading the directories a wildcard component needs. On Linux the walk holds
+ * a file descriptor for each directory, reads it with getdents64, whose entry types avoid
+ * a stat of every name, and stats the matches relative to the directory with fstatat, so
+ * the names and metadata are collected in the one pass and nothing is looked up again.
+ * Elsewhere the same walk uses readdir, or _findfirst, and stat on the full path.
+ * ** does not follow symbolic links to directories, so a cycle cannot be walked.
+ */
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+#include "walk.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#if defined(__linux__)
+#include <dirent.h> // DT_ values
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#elif defined(_MSC_VER)
+#include <io.h>
+#define S_ISDIR(m) (((m) & _S_IFMT) == _S_IFDIR)
+#define S_ISREG(m) (((m) & _S_IFMT) == _S_IFREG)
+#else
+#include <dirent.h>
+#endif
+
+#pragma warning(disable : 4996)
+
+#ifdef _WIN32
+#define ISSEP(c)   ((c) == '/' || (c) == '\\')
+#define FOLD(c)    (((c) >= 'a' && (c) <= 'z') ? (c) - 'a' + 'A' : (c)) // names are not case sensitive
+#else
+#define ISSEP(c)   ((c) == '/')
+#define FOLD(c)    (c)
+#endif
+
+enum { T_UNKNOWN, T_DIR, T_REG, T_LINK, T_OTHER }; // directory entry types
+
+typedef struct {
+    char **comp; // pattern components
+    int nComp;
+    fileMeta_t *files; // paths are offsets into names until the walk completes
+    size_t count;
+    size_t size;
+    char *names;
+    size_t namesLen;
+    size_t namesSize;
+    char *path; // directory being walked, with a trailing separator unless empty
+    size_t pathLen;
+    size_t pathSize;
+    bool ok; // false once out of memory
+} walk_t;
+
+// match a [set] at *pp against c, advancing *pp past it. returns -1 if it is not a set
+static int matchSet(char const **pp, uint8_t c) {
+    char const *p = *pp + 1;
+    bool negate   = *p == '!' || *p == '^';
+    bool found    = false;
+
+    if (negate)
+        p++;
+    char const *start = p;
+    while (*p && (*p != ']' || p == start)) { // a leading ] is part of the set
+        uint8_t lo = *p, hi = *p;
+        if (p[1] == '-' && p[2] && p[2] != ']') {
+            hi = p[2];
+            p += 2;
+        }
+        if (FOLD(lo) <= FOLD(c) && FOLD(c) <= FOLD(hi))
+            found = true;
+        p++;
+    }
+    if (*p != ']')
+        return -1;
+    *pp = p + 1;
+    return found != negate;
+}
+
+bool globMatch(char const *p, char const *s) {
+    char const *starP = NULL, *starS = NULL;
+
+    while (*s) {
+        char const *next = p;
+        int m;
+        if (*p == '*') {
+            starP = ++p;
+            starS = s;
+            continue;
+        }
+        if (*p == '[' && (m = matchSet(&next, *s)) >= 0) {
+            if (m) {
+                p = next;
+                s++;
+                continue;
+            }
+        } else if (*p == '?' || (*p && FOLD((uint8_t)*p) == FOLD((uint8_t)*s))) {
+            p++;
+            s++;
+            continue;
+        }
+        if (!starP)
+            return false;
+        p = starP; // let the last * absorb one more character
+        s = ++starS;
+    }
+    while (*p == '*')
+        p++;
+    return *p == '\0';
+}
+
+static bool hasWild(char const *s) {
+    for (; *s; s++)
+        if (*s == '*' || *s == '?' || (*s == '[' && strchr(s + 1, ']')))
+            return true;
+    return false;
+}
+
+bool isPattern(char const *path) {
+    return *path && (ISSEP(strchr(path, '\0')[-1]) || hasWild(path));
+}
+
+static bool grow(void **buf, size_t *size, size_t need, size_t elem) {
+    if (need <= *size)
+        return true;
+    size_t n = *size ? *size : 64;
+    while (n < need)
+        n *= 2;
+    void *t = realloc(*buf, n * elem);
+    if (!t)
+        return false;
+    *buf  = t;
+    *size = n;
+    return true;
+}
+
+// append name and optionally a separator to the current path, returning the old length
+static size_t pushPath(walk_t *w, char const *name, bool dir) {
+    size_t mark = w->pathLen;
+    size_t len  = strlen(name);
+    if (!grow((void **)&w->path, &w->pathSize, w->pathLen + len + 2, 1)) {
+        w->ok = false;
+        return mark;
+    }
+    memcpy(w->path + w->pathLen, name, len);
+    w->pathLen += len;
+    if (dir)
+        w->path[w->pathLen++] = '/';
+    w->path[w->pathLen] = '\0';
+    return mark;
+}
+
+static void popPath(walk_t *w, size_t mark) {
+    w->pathLen = mark;
+    if (w->path)
+        w->path[mark] = '\0';
+}
+
+/*
+ * directory access. On Linux dirFd is the open directory, elsewhere it is unused and the
+ * current path, which always names the directory, is used instead
+ */
+#ifdef __linux__
+typedef struct {
+    int fd;
+    long len;
+    long pos;
+    char buf[32768];
+} scan_t;
+
+struct dirent64_t { // as returned by getdents64
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+static bool scanOpen(scan_t *s, walk_t *w, int dirFd) {
+    s->len = s->pos = 0;
+    s->fd  = dirFd;
+    return lseek(dirFd, 0, SEEK_SET) == 0;
+}
+
+static char const *scanNext(scan_t *s, int *type) {
+    if (s->pos >= s->len) {
+        s->len = syscall(SYS_getdents64, s->fd, s->buf, sizeof(s->buf));
+        s->pos = 0;
+        if (s->len <= 0)
+            return NULL;
+    }
+    struct dirent64_t *d = (struct dirent64_t *)(s->buf + s->pos);
+    s->pos += d->d_reclen;
+    *type = d->d_type == DT_DIR   ? T_DIR
+            : d->d_type == DT_REG ? T_REG
+            : d->d_type == DT_LNK ? T_LINK
+            : d->d_type == DT_UNKNOWN ? T_UNKNOWN
+                                      : T_OTHER;
+    return d->d_name;
+}
+
+static void scanClose(scan_t *s) {}
+
+static int openChild(walk_t *w, int dirFd, char const *name) {
+    return openat(dirFd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+static void closeChild(int fd) {
+    close(fd);
+}
+
+static int statChild(walk_t *w, int dirFd, char const *name, struct stat *st, bool follow) {
+    return fstatat(dirFd, name, st, follow ? 0 : AT_SYMLINK_NOFOLLOW);
+}
+#else
+typedef struct {
+#ifdef _MSC_VER
+    intptr_t h;
+    struct _finddata_t info;
+    bool first;
+#else
+    DIR *d;
+#endif
+} scan_t;
+
+static bool scanOpen(scan_t *s, walk_t *w, int dirFd) {
+#ifdef _MSC_VER
+    size_t mark = pushPath(w, "*", false);
+    s->h        = _findfirst(w->path, &s->info);
+    s->first    = true;
+    popPath(w, mark);
+    return s->h != -1;
+#else
+    return (s->d = opendir(w->pathLen ? w->path : ".")) != NULL;
+#endif
+}
+
+static char const *scanNext(scan_t *s, int *type) {
+#ifdef _MSC_VER
+    if (!s->first && _findnext(s->h, &s->info) != 0)
+        return NULL;
+    s->first = false;
+    *type    = (s->info.attrib & _A_SUBDIR) ? T_DIR : T_UNKNOWN;
+    return s->info.name;
+#else
+    struct dirent *d = readdir(s->d);
+    *type            = T_UNKNOWN;
+    return d ? d->d_name : NULL;
+#endif
+}
+
+static void scanClose(scan_t *s) {
+#ifdef _MSC_VER
+    _findclose(s->h);
+#else
+    closedir(s->d);
+#endif
+}
+
+static int statChild(walk_t *w, int dirFd, char const *name, struct stat *st, bool follow) {
+    size_t mark = pushPath(w, name, false);
+    int rc      = w->ok ? stat(w->path, st) : -1; // without lstat, links are followed
+    popPath(w, mark);
+    return rc;
+}
+
+static int openChild(walk_t *w, int dirFd, char const *name) {
+    struct stat st;
+    return statChild(w, dirFd, name, &st, true) == 0 && S_ISDIR(st.st_mode) ? 0 : -1;
+}
+
+static void closeChild(int fd) {}
+#endif
+
+static void walkDir(walk_t *w, int dirFd, int ci);
+
+static void descend(walk_t *w, int dirFd, char const *name, int ci) {
+    int fd = openChild(w, dirFd, name);
+    if (fd < 0)
+        return;
+    size_t mark = pushPath(w, name, true);
+    if (w->ok)
+        walkDir(w, fd, ci);
+    popPath(w, mark);
+    closeChild(fd);
+}
+
+static void addFile(walk_t *w, int dirFd, char const *name, int type) {
+    struct stat st;
+    if (type == T_DIR || type == T_OTHER || statChild(w, dirFd, name, &st, true) != 0 ||
+        !S_ISREG(st.st_mode))
+        return;
+    size_t len = w->pathLen + strlen(name) + 1;
+    if (!grow((void **)&w->files, &w->size, w->count + 1, sizeof(fileMeta_t)) ||
+        !grow((void **)&w->names, &w->namesSize, w->namesLen + len, 1)) {
+        w->ok = false;
+        return;
+    }
+    fileMeta_t *f = &w->files[w->count++];
+    setMeta(f, &st);
+    f->path = (char const *)(uintptr_t)w->namesLen; // fixed up once names stops moving
+    memcpy(w->names + w->namesLen, w->path, w->pathLen);
+    strcpy(w->names + w->namesLen + w->pathLen, name);
+    w->namesLen += len;
+}
+
+static void walkDir(walk_t *w, int dirFd, int ci) {
+    char const *comp = w->comp[ci];
+    bool last        = ci == w->nComp - 1;
+    bool globstar    = strcmp(comp, "**") == 0;
+
+    if (*comp && !globstar && !hasWild(comp)) { // literal, no need to read the directory
+        if (last)
+            addFile(w, dirFd, comp, T_UNKNOWN);
+        else
+            descend(w, dirFd, comp, ci + 1);
+        return;
+    }
+    if (globstar && !last)
+        walkDir(w, dirFd, ci + 1); // ** matching no directories
+
+    scan_t *s = malloc(sizeof(scan_t));
+    if (!s) {
+        w->ok = false;
+        return;
+    }
+    if (scanOpen(s, w, dirFd)) {
+        char const *name;
+        int type;
+        while (w->ok && (name = scanNext(s, &type))) {
+            if (name[0] == '.' &&
+                (globstar || comp[0] != '.' || strcmp(name, ".") == 0 || strcmp(name, "..") == 0))
+                continue;
+            if (globstar) {
+                struct stat st;
+                if (type == T_UNKNOWN && statChild(w, dirFd, name, &st, false) == 0)
+                    type = S_ISDIR(st.st_mode) ? T_DIR : T_REG;
+                if (type == T_DIR)
+                    descend(w, dirFd, name, ci); // deeper, still matching **
+                else if (last)
+                    addFile(w, dirFd, name, type);
+            } else if (!*comp || globMatch(comp, name)) { // empty after a trailing separator
+                if (last)
+                    addFile(w, dirFd, name, type);
+                else if (type != T_REG && type != T_OTHER)
+                    descend(w, dirFd, name, ci + 1);
+            }
+        }
+        scanClose(s);
+    }
+    free(s);
+}
+
+static int cmpPath(void const *a, void const *b) {
+    return strcmp(((fileMeta_t const *)a)->path, ((fileMeta_t const *)b)->path);
+}
+
+bool expandPattern(char const *pattern, match_t *m) {
+    walk_t w   = { 0 };
+    char *copy = strdup(pattern);
+    int dirFd  = -1;
+
+    memset(m, 0, sizeof(*m));
+    w.ok   = copy && (w.comp = malloc((strlen(pattern) / 2 + 2) * sizeof(char *)));
+    if (w.ok) {
+        char *s = copy;
+        if (ISSEP(*s)) { // absolute
+            pushPath(&w, "", true);
+            while (ISSEP(*s))
+                s++;
+        }
+        while (*s) { // split into components, ignoring empty ones
+            w.comp[w.nComp++] = s;
+            while (*s && !ISSEP(*s))
+                s++;
+            if (*s) {
+                *s++ = '\0';
+                while (ISSEP(*s))
+                    s++;
+                if (!*s)
+                    w.comp[w.nComp++] = s; // trailing separator, every file
+            }
+        }
+    }
+#ifdef __linux__
+    if (w.ok && w.nComp && (dirFd = open(w.pathLen ? "/" : ".", O_RDONLY | O_DIRECTORY)) >= 0) {
+        walkDir(&w, dirFd, 0);
+        close(dirFd);
+    }
+#else
+    if (w.ok && w.nComp)
+        walkDir(&w, dirFd, 0);
+#endif
+    free(w.comp);
+    free(copy);
+    free(w.path);
+    if (!w.ok) {
+        free(w.files);
+        free(w.names);
+        return false;
+    }
+    for (size_t i = 0; i < w.count; i++)
+        w.files[i].path = w.names + (uintptr_t)w.files[i].path;
+    if (w.count)
+        qsort(w.files, w.count, sizeof(fileMeta_t), cmpPath);
+    size_t n = 0;
+    for (size_t i = 0; i < w.count; i++) // ** can reach a file more than one way
+        if (n == 0 || strcmp(w.files[n - 1].path, w.files[i].path) != 0)
+            w.files[n++] = w.files[i];
+    m->files = w.files;
+    m->count = n;
+    m->names = w.names;
+    return true;
+}
+
+void freeMatch(match_t *m) {
+    free(m->files);
+    free(m->names);
+    memset(m, 0, sizeof(*m));
+}
@@ -0,0 +1,46 @@
+/* mklbr - create .lbr archives from recipes
+ * Copyright (C) - 2020-2023 Mark Ogden
+ *
+ * walk.h - expand directories and wildcard patterns in recipes
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef _WALK_H_
+#define _WALK_H_
+#include "statbatch.h"
+#include <stdbool.h>
+
+// the files matching a pattern, sorted by path
+typedef struct {
+    fileMeta_t *files; // each path points into names
+    size_t count;
+    char *names;
+} match_t;
+
+// true if s matches the wildcard pattern p, using * ? and [set], within one path component
+bool globMatch(char const *p, char const *s);
+
+// true if path ends in a separator, naming a directory, or contains * ? or [set]
+bool isPattern(char const *path);
+
+// find the regular files matching pattern, along with their metadata. Wildcards match
+// within a path component, ** matches any number of directories and a trailing separator
+// matches every file in the directory. Hidden names are only matched by a leading '.'
+// returns false if out of memory
+bool expandPattern(char const *pattern, match_t *m);
+void freeMatch(match_t *m);
+
+#endif
@@ -0,0 +1,158 @@
+/* mklbr - create .lbr archives from recipes
+ * Copyright (C) - 2020-2023 Mark Ogden
+ *
+ * zcopy.c - zero copy transfer of members into the lbr
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * The CRC is calculated over a read only mapping of the source and the whole sectors are
+ * moved by the kernel, with copy_file_range, which can share blocks on file systems that
+ * support reflinks, or failing that sendfile. Only the padded final sector is written
+ * from user memory. A pipe or socket, which cannot seek, is written with sendfile and
+ * write at its current position. Currently only supported on Linux.
+ */
+#ifdef __linux__
+#define _GNU_SOURCE // for copy_file_range
+#endif
+#include "zcopy.h"
+#include "crc16.h"
+#include "statbatch.h"
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// true if the open file is still the version looked up, as a mapping beyond its end faults
+static bool sameVersion(int fd, size_t size, int64_t mtimeNs) {
+    struct stat st;
+    fileMeta_t f;
+
+    if (fstat(fd, &st) != 0)
+        return false;
+    setMeta(&f, &st);
+    return f.size == size && f.mtimeNs == mtimeNs;
+}
+
+bool mapCrc(char const *path, size_t size, int64_t mtimeNs, uint16_t *crc) {
+    size_t full = size & ~(size_t)127;
+    int fd      = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+    if (!sameVersion(fd, size, mtimeNs)) {
+        close(fd);
+        return false;
+    }
+    *crc = 0;
+    if (size) {
+        uint8_t *src = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (src == MAP_FAILED) {
+            close(fd);
+            return false;
+        }
+        madvise(src, size, MADV_SEQUENTIAL);
+        *crc = crc16(0, src, full);
+        if (size % 128) {
+            uint8_t tail[128];
+            memcpy(tail, src + full, size % 128);
+            memset(tail + size % 128, 0x1a, 128 - size % 128);
+            *crc = crc16(*crc, tail, 128);
+        }
+        munmap(src, size);
+    }
+    bool same = sameVersion(fd, size, mtimeNs); // not changed while the CRC was calculated
+    close(fd);
+    return same;
+}
+
+int kernelCopy(char const *path, size_t size, int64_t mtimeNs, FILE *fp, uint64_t *copied) {
+    size_t full      = size & ~(size_t)127;
+    size_t done      = 0;
+    bool useSendfile = false;
+    bool atEof       = false;
+
+    fflush(fp);
+    int out       = fileno(fp);
+    off_t start   = lseek(out, 0, SEEK_CUR);
+    bool seekable = start >= 0;
+    off_t inOff = 0, outOff = start;
+    int in      = open(path, O_RDONLY);
+    if (in < 0)
+        return ZC_UNSUPPORTED;
+    if (!sameVersion(in, size, mtimeNs)) {
+        close(in);
+        return ZC_READERR;
+    }
+    useSendfile = !seekable;
+    while (done < full) {
+        ssize_t n;
+        if (!useSendfile) {
+            n = copy_file_range(in, &inOff, out, &outOff, full - done, 0);
+            if (n < 0 && done == 0 &&
+                (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) {
+                useSendfile = true; // sendfile writes at the current position, i.e. start
+                continue;
+            }
+        } else if ((n = sendfile(out, in, &inOff, full - done)) > 0)
+            outOff += n;
+        if (n <= 0) {
+            atEof = n == 0;
+            break;
+        }
+        done += n;
+    }
+    if (done < full) {
+        close(in);
+        if (atEof) // the file is shorter than it was
+            return ZC_READERR;
+        return done == 0 && (!seekable || lseek(out, start, SEEK_SET) == start) ? ZC_UNSUPPORTED
+                                                                               : ZC_WRITEERR;
+    }
+    *copied += full;
+    if (size % 128) {
+        uint8_t tail[128];
+        if (pread(in, tail, size % 128, full) != (ssize_t)(size % 128)) {
+            close(in);
+            return ZC_READERR;
+        }
+        memset(tail + size % 128, 0x1a, 128 - size % 128);
+        if ((seekable ? pwrite(out, tail, 128, outOff) : write(out, tail, 128)) != 128) {
+            close(in);
+            return ZC_WRITEERR;
+        }
+        outOff += 128;
+    }
+    bool same = sameVersion(in, size, mtimeNs); // not changed while it was copied
+    close(in);
+    if (!same)
+        return ZC_READERR;
+    return !seekable || fseeko(fp, outOff, SEEK_SET) == 0 ? ZC_OK : ZC_WRITEERR;
+}
+#else
+bool mapCrc(char const *path, size_t size, int64_t mtimeNs, uint16_t *crc) {
+    return false;
+}
+
+int kernelCopy(char const *path, size_t size, int64_t mtimeNs, FILE *fp, uint64_t *copied) {
+    return ZC_UNSUPPORTED;
+}
+#endif
@@ -0,0 +1,43 @@
+/* mklbr - create .lbr archives from recipes
+ * Copyright (C) - 2020-2023 Mark Ogden
+ *
+ * zcopy.h - zero copy transfer of members into the lbr
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef _ZCOPY_H_
+#define _ZCOPY_H_
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// size and mtimeNs are those the file was looked up with, see statbatch.h. As the CRC and
+// the copy are separate passes, both check the file is still that version, before and
+// after reading it, so a file changed during the build is not stored with the wrong CRC
+
+// CRC of the 0x1a padded file, calculated over a read only mapping of it
+// returns false if not supported or the file has changed, in which case the caller uses
+// buffered I/O
+bool mapCrc(char const *path, size_t size, int64_t mtimeNs, uint16_t *crc);
+
+// append the padded file to fp, moving the whole sectors within the kernel and adding
+// the number of bytes moved to *copied
+// returns ZC_OK, ZC_UNSUPPORTED if nothing was written so buffered I/O can be used instead
+// or ZC_READERR, including if the file has changed, / ZC_WRITEERR
+enum { ZC_OK, ZC_UNSUPPORTED, ZC_READERR, ZC_WRITEERR };
+int kernelCopy(char const *path, size_t size, int64_t mtimeNs, FILE *fp, uint64_t *copied);
+
+#endif